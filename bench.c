@@ -0,0 +1,553 @@
+/* For nftw and wait4 */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Synthetic trees are generated from a seed, so that the same options
+ * always produce the same tree (names, sizes and contents alike) */
+#define BENCH_DEFAULT_SEED 0x5EED
+#define BENCH_BLOCK_SIZE   ((size_t)(0x10000))
+#define BENCH_MAX_RUNS     100
+#define BENCH_STATS_SIZE   4096
+
+enum bench_kind_t {
+	BENCH_UNIQUE,
+	BENCH_PREFIX,
+	BENCH_COPY,
+	BENCH_LINK
+};
+
+/* What each generated file holds: its own stream of bytes (id), after
+ * the first prefix bytes of another's (base), or a hard link to one */
+struct bench_file_t
+{
+	enum bench_kind_t kind;
+	uint64_t size, prefix;
+	size_t id, base, target;
+};
+
+struct bench_tree_t
+{
+	size_t num_files, depth, width;
+	uint64_t min_size, max_size, prefix_size, seed;
+	double copies, prefixes, links;
+};
+
+inline uint64_t
+bench_mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* A uniform double in [0, 1) */
+inline double
+bench_uniform(uint64_t *state)
+{
+	*state = bench_mix(*state);
+	return (double)(*state >> 11) / 9007199254740992.0;
+}
+
+/* Sizes are spread evenly over orders of magnitude (log-uniform) */
+inline uint64_t
+bench_size(uint64_t *state, uint64_t min_size, uint64_t max_size)
+{
+	double r = bench_uniform(state);
+	if (max_size <= min_size) {
+		return min_size;
+	}
+	return (uint64_t)(exp(log((double)(min_size))
+				+ r * (log((double)(max_size)) - log((double)(min_size)))));
+}
+
+/* Fill part of a stream (offset is a multiple of eight); every word of a
+ * stream can be generated on its own, so any part can be rewritten */
+void
+bench_fill(unsigned char *buffer, uint64_t offset, size_t length, uint64_t key)
+{
+	size_t i;
+	uint64_t word;
+	for (i = 0; i < length; i += sizeof(uint64_t)) {
+		word = bench_mix(key ^ ((offset + i) / sizeof(uint64_t) * 0xD6E8FEB86659FD93ULL));
+		memcpy(buffer + i, &word, (length - i < sizeof(uint64_t)) ? length - i : sizeof(uint64_t));
+	}
+}
+
+/* Where a file goes: depth directories down, each picked from width */
+void
+bench_path(const struct bench_tree_t *tree, const char *root, size_t i, char *path)
+{
+	size_t level, length;
+	length = (size_t)(snprintf(path, PATH_MAX, "%s", root));
+	for (level = 0; level < tree->depth && length < PATH_MAX; ++level) {
+		length += (size_t)(snprintf(path + length, PATH_MAX - length, "/d%02lu",
+					(unsigned long)(bench_mix(tree->seed ^ (i * 131 + level)) % tree->width)));
+	}
+	snprintf(path + length, PATH_MAX - length, "/f%07lu", (unsigned long)(i));
+}
+
+/* Create each directory above a path, as needed (returns zero on failure) */
+int
+bench_mkdirs(char *path)
+{
+	char *slash;
+	for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			*slash = '/';
+			return 0;
+		}
+		*slash = '/';
+	}
+	return 1;
+}
+
+int
+bench_write(const char *path, const struct bench_file_t *file, uint64_t seed,
+		unsigned char *buffer, unsigned char *scratch)
+{
+	int fd;
+	size_t length;
+	uint64_t offset;
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return 0;
+	}
+	for (offset = 0; offset < file->size; offset += length) {
+		length = (file->size - offset < BENCH_BLOCK_SIZE) ?
+			(size_t)(file->size - offset) : BENCH_BLOCK_SIZE;
+		bench_fill(buffer, offset, length, bench_mix(seed ^ file->id));
+		if (offset < file->prefix) {
+			bench_fill(scratch, offset, length, bench_mix(seed ^ file->base));
+			memcpy(buffer, scratch, (file->prefix - offset < length) ?
+					(size_t)(file->prefix - offset) : length);
+		}
+		if (write(fd, buffer, length) != (ssize_t)(length)) {
+			close(fd);
+			return 0;
+		}
+	}
+	return !close(fd);
+}
+
+/* Plan every file first (later files copy, extend or link earlier ones),
+ * then write them out in order (returns an exit status) */
+int
+bench_generate(const struct bench_tree_t *tree, const char *root)
+{
+	size_t i, j, num_originals = 0;
+	double r;
+	uint64_t state = tree->seed;
+	char path[PATH_MAX], target[PATH_MAX];
+	unsigned char *buffer, *scratch;
+	size_t *originals;
+	struct bench_file_t *files;
+	/* Generating the same tree again rewrites it */
+	if (mkdir(root, 0755) && errno != EEXIST) {
+		fprintf(stderr, "[FATAL] '%s' (%s)\n", root, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	files = calloc(tree->num_files + 1, sizeof(struct bench_file_t));
+	originals = calloc(tree->num_files + 1, sizeof(size_t));
+	buffer = malloc(BENCH_BLOCK_SIZE);
+	scratch = malloc(BENCH_BLOCK_SIZE);
+	if (!files || !originals || !buffer || !scratch) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		free(files);
+		free(originals);
+		free(buffer);
+		free(scratch);
+		return (EXIT_FAILURE);
+	}
+	for (i = 0; i < tree->num_files; ++i) {
+		r = bench_uniform(&state);
+		files[i].id = files[i].base = files[i].target = i;
+		files[i].kind = BENCH_UNIQUE;
+		if (num_originals > 0) {
+			j = originals[(size_t)(bench_uniform(&state) * num_originals)];
+			if (r < tree->links) {
+				files[i] = files[j];
+				files[i].kind = BENCH_LINK;
+				files[i].target = j;
+				continue;
+			}
+			if (r < tree->links + tree->copies) {
+				files[i] = files[j];
+				files[i].kind = BENCH_COPY;
+				files[i].target = i;
+				originals[num_originals++] = i;
+				continue;
+			}
+			/* Same size and leading bytes, so only the rest tells them apart */
+			if (r < tree->links + tree->copies + tree->prefixes && files[j].size > 1) {
+				files[i].kind = BENCH_PREFIX;
+				files[i].size = files[j].size;
+				files[i].base = files[j].base;
+				files[i].prefix = (tree->prefix_size < files[j].size) ?
+					tree->prefix_size : files[j].size - 1;
+				originals[num_originals++] = i;
+				continue;
+			}
+		}
+		files[i].size = bench_size(&state, tree->min_size, tree->max_size);
+		originals[num_originals++] = i;
+	}
+	for (i = 0; i < tree->num_files; ++i) {
+		bench_path(tree, root, i, path);
+		if (!bench_mkdirs(path)) {
+			fprintf(stderr, "[FATAL] '%s' (%s)\n", path, strerror(errno));
+			break;
+		}
+		if (files[i].kind == BENCH_LINK) {
+			bench_path(tree, root, files[i].target, target);
+			if ((unlink(path) && errno != ENOENT) || link(target, path)) {
+				fprintf(stderr, "[FATAL] '%s' (%s)\n", path, strerror(errno));
+				break;
+			}
+		} else if (!bench_write(path, &files[i], tree->seed, buffer, scratch)) {
+			fprintf(stderr, "[FATAL] '%s' (%s)\n", path, strerror(errno));
+			break;
+		}
+	}
+	free(files);
+	free(originals);
+	free(buffer);
+	free(scratch);
+	return (i == tree->num_files) ? (EXIT_SUCCESS) : (EXIT_FAILURE);
+}
+
+/* What a tree holds: paths, and bytes of distinct files (see bench_count) */
+static size_t bench_num_files, bench_num_inodes, bench_max_inodes;
+static uint64_t bench_num_bytes;
+static struct bench_inode_t
+{
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+} *bench_inodes;
+
+int
+bench_visit(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	struct bench_inode_t *inodes;
+	(void)(path);
+	(void)(ftw);
+	if (flag != FTW_F || !S_ISREG(st->st_mode)) {
+		return 0;
+	}
+	++bench_num_files;
+	bench_num_bytes += (uint64_t)(st->st_size);
+	/* Hard linked files are only read once, so they only count once */
+	if (st->st_nlink > 1) {
+		if (bench_num_inodes == bench_max_inodes) {
+			bench_max_inodes = bench_max_inodes ? 2 * bench_max_inodes : 64;
+			inodes = realloc(bench_inodes, bench_max_inodes * sizeof(struct bench_inode_t));
+			if (!inodes) {
+				return -1;
+			}
+			bench_inodes = inodes;
+		}
+		bench_inodes[bench_num_inodes].dev = st->st_dev;
+		bench_inodes[bench_num_inodes].ino = st->st_ino;
+		bench_inodes[bench_num_inodes++].size = st->st_size;
+	}
+	return 0;
+}
+
+int
+compare_inodes(const void *lhs, const void *rhs)
+{
+	const struct bench_inode_t *l = (const struct bench_inode_t *)(lhs);
+	const struct bench_inode_t *r = (const struct bench_inode_t *)(rhs);
+	if (l->dev != r->dev) {
+		return (l->dev > r->dev) - (l->dev < r->dev);
+	}
+	return (l->ino > r->ino) - (l->ino < r->ino);
+}
+
+/* Count the paths and distinct bytes under a tree (returns zero on failure) */
+int
+bench_count(const char *root)
+{
+	size_t i;
+	bench_num_files = bench_num_inodes = 0;
+	bench_num_bytes = 0;
+	if (nftw(root, &bench_visit, 64, FTW_PHYS)) {
+		return 0;
+	}
+	qsort(bench_inodes, bench_num_inodes, sizeof(struct bench_inode_t), &compare_inodes);
+	for (i = 1; i < bench_num_inodes; ++i) {
+		if (!compare_inodes(&bench_inodes[i - 1], &bench_inodes[i])) {
+			bench_num_bytes -= (uint64_t)(bench_inodes[i].size);
+		}
+	}
+	free(bench_inodes);
+	bench_inodes = NULL;
+	bench_max_inodes = 0;
+	return 1;
+}
+
+/* Remove whatever bloom left in its working directory, then the directory */
+void
+bench_clean(const char *scratch)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	if ((dir = opendir(scratch))) {
+		while ((entry = readdir(dir))) {
+			if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+				snprintf(path, PATH_MAX, "%s/%s", scratch, entry->d_name);
+				unlink(path);
+			}
+		}
+		closedir(dir);
+	}
+	rmdir(scratch);
+}
+
+/* Read a small file whole, without its trailing newline (or "null") */
+void
+bench_slurp(const char *path, char *buffer, size_t length)
+{
+	size_t n = 0;
+	FILE *in = fopen(path, "r");
+	if (in) {
+		n = fread(buffer, 1, length - 1, in);
+		fclose(in);
+	}
+	for (; n > 0 && (buffer[n - 1] == '\n' || buffer[n - 1] == '\r'); --n);
+	buffer[n] = '\0';
+	if (n == 0) {
+		snprintf(buffer, length, "null");
+	}
+}
+
+/* Start from a cold page cache, if we may (returns zero if not) */
+int
+bench_drop_caches(void)
+{
+	int fd, status;
+	sync();
+	if ((fd = open("/proc/sys/vm/drop_caches", O_WRONLY)) < 0) {
+		return 0;
+	}
+	status = write(fd, "3", 1) == 1;
+	return !close(fd) && status;
+}
+
+/* Run bloom over a tree a number of times, from a scratch directory (so
+ * its cache and index stay apart from the tree, and the first run starts
+ * without a cache), writing one JSON object per run; options after the
+ * tree are passed on (returns an exit status, failing if any run did) */
+int
+bench_run(const char *bloom, const char *root, char **options, int num_options,
+		const char *label, size_t num_runs, int cold, FILE *out)
+{
+	int i, status, failed = 0;
+	size_t run;
+	pid_t pid;
+	double seconds;
+	struct rusage usage;
+	struct timespec started, finished;
+	char tree[PATH_MAX], binary[PATH_MAX], scratch[PATH_MAX], stats_file[PATH_MAX + 16];
+	char stats[BENCH_STATS_SIZE];
+	char **argv;
+	if (!realpath(root, tree) || !realpath(bloom, binary)) {
+		fprintf(stderr, "[FATAL] '%s' (%s)\n", realpath(root, tree) ? bloom : root,
+				strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	if (!bench_count(tree)) {
+		fprintf(stderr, "[FATAL] '%s' (cannot count files)\n", tree);
+		return (EXIT_FAILURE);
+	}
+	snprintf(scratch, PATH_MAX, "%s/bloom_bench.XXXXXX",
+			getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(scratch)) {
+		fprintf(stderr, "[FATAL] '%s' (%s)\n", scratch, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	snprintf(stats_file, sizeof(stats_file), "%s/stats.json", scratch);
+	argv = malloc((num_options + 5) * sizeof(char *));
+	if (!argv) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		bench_clean(scratch);
+		return (EXIT_FAILURE);
+	}
+	argv[0] = binary;
+	argv[1] = "--stats";
+	argv[2] = stats_file;
+	for (i = 0; i < num_options; ++i) {
+		argv[3 + i] = options[i];
+	}
+	argv[3 + num_options] = tree;
+	argv[4 + num_options] = NULL;
+	for (run = 0; run < num_runs; ++run) {
+		if (cold && !bench_drop_caches()) {
+			fprintf(stderr, "[WARNING] cannot drop caches (runs are not cold)\n");
+			cold = 0;
+		}
+		unlink(stats_file);
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		if ((pid = fork()) < 0) {
+			fprintf(stderr, "[FATAL] cannot fork (%s)\n", strerror(errno));
+			break;
+		}
+		if (pid == 0) {
+			/* Only the timings matter, not the report */
+			if (chdir(scratch) || !freopen("/dev/null", "w", stdout)
+					|| !freopen("/dev/null", "w", stderr)) {
+				_exit(127);
+			}
+			execv(binary, argv);
+			_exit(127);
+		}
+		if (wait4(pid, &status, 0, &usage) != pid) {
+			fprintf(stderr, "[FATAL] cannot wait for '%s' (%s)\n", binary, strerror(errno));
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &finished);
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+		seconds = (double)(finished.tv_sec - started.tv_sec)
+			+ (double)(finished.tv_nsec - started.tv_nsec) / 1e9;
+		bench_slurp(stats_file, stats, BENCH_STATS_SIZE);
+		fprintf(out, "{\"label\": \"%s\", \"tree\": \"%s\", \"run\": %lu, \"cold\": %s,"
+				" \"exit_status\": %d, \"files\": %lu, \"bytes\": %llu, \"seconds\": %.6f,"
+				" \"files_per_second\": %.1f, \"bytes_per_second\": %.1f,"
+				" \"user_seconds\": %.6f, \"system_seconds\": %.6f,"
+				" \"peak_rss_kib\": %ld, \"stats\": %s}\n",
+				label, tree, (unsigned long)(run), cold ? "true" : "false",
+				WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+				(unsigned long)(bench_num_files), (unsigned long long)(bench_num_bytes), seconds,
+				(double)(bench_num_files) / seconds, (double)(bench_num_bytes) / seconds,
+				(double)(usage.ru_utime.tv_sec) + (double)(usage.ru_utime.tv_usec) / 1e6,
+				(double)(usage.ru_stime.tv_sec) + (double)(usage.ru_stime.tv_usec) / 1e6,
+				usage.ru_maxrss, stats);
+		fflush(out);
+	}
+	free(argv);
+	bench_clean(scratch);
+	return (run == num_runs && !failed) ? (EXIT_SUCCESS) : (EXIT_FAILURE);
+}
+
+void
+usage(const char *program)
+{
+	fprintf(stderr, "usage: %s gen [-n files] [-a bytes] [-b bytes] [-c ratio] [-p ratio]"
+			" [-P bytes] [-l ratio] [-D depth] [-w width] [-s seed] dir\n", program);
+	fprintf(stderr, "\t-n files\thow many paths to create (default: 1000)\n");
+	fprintf(stderr, "\t-a, -b bytes\tsmallest and largest file (log-uniform, default: 1 to 1048576)\n");
+	fprintf(stderr, "\t-c ratio\tshare of files that copy an earlier one (default: 0.2)\n");
+	fprintf(stderr, "\t-p ratio\tshare that only start like an earlier one (default: 0.1)\n");
+	fprintf(stderr, "\t-P bytes\thow much of the start they share (default: 65536)\n");
+	fprintf(stderr, "\t-l ratio\tshare that hard link an earlier one (default: 0.05)\n");
+	fprintf(stderr, "\t-D depth, -w width\tdirectories deep, and per level (default: 3, 8)\n");
+	fprintf(stderr, "\t-s seed\tthe same seed makes the same tree (default: %d)\n",
+			BENCH_DEFAULT_SEED);
+	fprintf(stderr, "usage: %s run [-o file] [-L label] [-r runs] [-C] bloom dir"
+			" [bloom options ...]\n", program);
+	fprintf(stderr, "\t-o file\tappend one JSON object per run here (default: stdout)\n");
+	fprintf(stderr, "\t-L label\tname the runs (default: the tree)\n");
+	fprintf(stderr, "\t-r runs\thow many times to run (default: 3)\n");
+	fprintf(stderr, "\t-C\tdrop the page cache before each run (needs root)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int option, cold = 0, status;
+	size_t num_runs = 3;
+	const char *label = NULL, *output = NULL, *program = argv[0];
+	FILE *out = stdout;
+	struct bench_tree_t tree;
+	if (argc < 2) {
+		usage(program);
+		return (EXIT_FAILURE);
+	}
+	/* Each command parses its own options */
+	--argc;
+	++argv;
+	if (!strcmp(argv[0], "gen")) {
+		tree.num_files = 1000;
+		tree.min_size = 1;
+		tree.max_size = 0x100000;
+		tree.copies = 0.2;
+		tree.prefixes = 0.1;
+		tree.prefix_size = 0x10000;
+		tree.links = 0.05;
+		tree.depth = 3;
+		tree.width = 8;
+		tree.seed = BENCH_DEFAULT_SEED;
+		while ((option = getopt(argc, argv, "n:a:b:c:p:P:l:D:w:s:")) != -1) {
+			switch (option) {
+			case 'n': tree.num_files = strtoul(optarg, NULL, 10); break;
+			case 'a': tree.min_size = strtoull(optarg, NULL, 10); break;
+			case 'b': tree.max_size = strtoull(optarg, NULL, 10); break;
+			case 'c': tree.copies = atof(optarg); break;
+			case 'p': tree.prefixes = atof(optarg); break;
+			case 'P': tree.prefix_size = strtoull(optarg, NULL, 10); break;
+			case 'l': tree.links = atof(optarg); break;
+			case 'D': tree.depth = strtoul(optarg, NULL, 10); break;
+			case 'w': tree.width = strtoul(optarg, NULL, 10); break;
+			case 's': tree.seed = strtoull(optarg, NULL, 0); break;
+			default:
+				usage(program);
+				return (EXIT_FAILURE);
+			}
+		}
+		if (optind + 1 != argc || tree.width == 0 || tree.min_size == 0
+				|| tree.copies + tree.prefixes + tree.links > 1.0) {
+			usage(program);
+			return (EXIT_FAILURE);
+		}
+		return bench_generate(&tree, argv[optind]);
+	}
+	if (!strcmp(argv[0], "run")) {
+		/* Stop at the first argument, so bloom's options pass through */
+		while ((option = getopt(argc, argv, "+o:L:r:C")) != -1) {
+			switch (option) {
+			case 'o': output = optarg; break;
+			case 'L': label = optarg; break;
+			case 'r': num_runs = strtoul(optarg, NULL, 10); break;
+			case 'C': cold = 1; break;
+			default:
+				usage(program);
+				return (EXIT_FAILURE);
+			}
+		}
+		if (optind + 2 > argc || num_runs == 0 || num_runs > BENCH_MAX_RUNS) {
+			usage(program);
+			return (EXIT_FAILURE);
+		}
+		if (output && !(out = fopen(output, "a"))) {
+			fprintf(stderr, "[FATAL] '%s' (%s)\n", output, strerror(errno));
+			return (EXIT_FAILURE);
+		}
+		status = bench_run(argv[optind], argv[optind + 1], argv + optind + 2,
+				argc - optind - 2, label ? label : argv[optind + 1], num_runs, cold, out);
+		if (out != stdout) {
+			fclose(out);
+		}
+		return status;
+	}
+	usage(program);
+	return (EXIT_FAILURE);
+}
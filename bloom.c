@@ -1,57 +1,368 @@
+/* For O_DIRECT and statx, where available */
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <dirent.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
-#include <libcalg-1.0/libcalg/bloom-filter.h>
-#include <libcalg-1.0/libcalg/hash-pointer.h>
-#include <libcalg-1.0/libcalg/compare-pointer.h>
-#include <libcalg-1.0/libcalg/set.h>
 #include <libcalg-1.0/libcalg/slist.h>
-#include <libcalg-1.0/libcalg/trie.h>
 
+#include "file_cache.h"
+#include "file_digest.h"
 #include "file_entry.h"
+#include "file_filter.h"
 #include "file_info.h"
 #include "file_hash.h"
+#include "file_pool.h"
+#include "file_stats.h"
+#include "file_table.h"
+#include "file_walk.h"
 
 #include "persist.h"
 
+/* Queue every entry in a batch that might have a duplicate for hashing
+ * (returns zero on failure); the filter is queried for the whole batch
+ * up front, so entries that were absent are checked again once another
+ * entry in the batch has been inserted */
+int
+filter_batch(struct file_info_t *info, struct file_pool_t *pool,
+		struct file_entry_t **batch, size_t batch_len)
+{
+	size_t i;
+	int inserted = 0;
+	uint64_t keys[FILTER_BATCH_SIZE];
+	unsigned char maybe[FILTER_BATCH_SIZE];
+	struct file_group_t *group;
+	assert(batch_len <= FILTER_BATCH_SIZE);
+	if (batch_len == 0) {
+		return 1;
+	}
+	for (i = 0; i < batch_len; ++i) {
+		keys[i] = batch[i]->shash;
+	}
+	filter_query_batch(info->shash_filter, keys, batch_len, maybe);
+	stats_filter_queries += batch_len;
+	stats_count(STATS_FILES, batch_len);
+	for (i = 0; i < batch_len; ++i) {
+		/* Check again, once an entry in this batch has been inserted */
+		if (!maybe[i] && inserted) {
+			maybe[i] = filter_query(info->shash_filter, (unsigned char *)(&batch[i]->shash));
+			++stats_filter_queries;
+		}
+		/* Check to see if we might have seen this file before */
+		if (maybe[i]) {
+			++stats_filter_hits;
+			/* The new file will need a full hash */
+			if (!pool_push(pool, batch[i])) {
+				return 0;
+			}
+			/* Check to see if bloom failed us */
+			group = table_find(info->shash_table, (unsigned char *)(&batch[i]->shash));
+			if (!group) {
+				++stats_filter_false;
+				#ifndef NDEBUG
+				printf("[DEBUG] '%s' (false positive)\n", entry_path(batch[i]));
+				#endif
+				group = table_insert(info->shash_table, batch[i], 0);
+			} else if (!pool_push(pool, group->members)) {
+				/* The old file will need a full hash too */
+				group = NULL;
+			}
+		} else {
+			/* Add a record of this shash to the filter */
+			filter_insert(info->shash_filter, (unsigned char *)(&batch[i]->shash));
+			group = table_insert(info->shash_table, batch[i], 0);
+			inserted = 1;
+		}
+		if (!group) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Look up each file in an index written by an earlier run (returns an
+ * exit status); the index is mapped, so this starts up just as fast
+ * no matter how large it is */
+int
+query(char *index_file, struct file_info_t *info)
+{
+	uint64_t i, num_matches;
+	unsigned char *hash_value;
+	SListIterator slist_iterator;
+	struct file_entry_t *file_entry, *link;
+	struct file_index_t index;
+	const struct index_entry_t *matches;
+	const char *name;
+	if (recover(index_file, &index)) {
+		fprintf(stderr, "[FATAL] '%s' (cannot recover index)\n", index_file);
+		return (EXIT_FAILURE);
+	}
+	#ifndef NDEBUG
+	/* Reading every page defeats the point, except when debugging */
+	if (!index_verify(&index)) {
+		fprintf(stderr, "[WARNING] '%s' (checksum mismatch)\n", index_file);
+	}
+	#endif
+	/* Digests have to be made the same way as those in the index */
+	for (i = 0; digest_engines[i].name && i < index.header->engine; ++i);
+	if (!digest_engines[i].name || digest_engines[i].length != index.header->digest_length) {
+		fprintf(stderr, "[FATAL] '%s' (unknown digest)\n", index_file);
+		release_index(&index);
+		return (EXIT_FAILURE);
+	}
+	digest_engine = &digest_engines[i];
+	slist_iterate(&info->good_files, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		file_entry = slist_iter_next(&slist_iterator);
+		/* Only files that pass the filter need a full hash */
+		matches = NULL;
+		num_matches = 0;
+		hash_value = hash_entry(file_entry, SHALLOW);
+		stats_filter_queries += (hash_value != NULL);
+		if (hash_value && filter_query(&index.filter, hash_value)) {
+			++stats_filter_hits;
+			hash_value = hash_entry(file_entry, FULL);
+			matches = hash_value ? index_entries(&index,
+					index_find(&index, hash_value), &num_matches) : NULL;
+		}
+		/* Hard links share the answer (paths outside the index are left out) */
+		for (link = file_entry; link; link = link->link) {
+			printf("[QUERY] %s (%lu match(es))\n", entry_path(link),
+				(unsigned long)(num_matches));
+			for (i = 0; i < num_matches; ++i) {
+				if ((name = index_name(&index, &matches[i]))) {
+					printf("\t%s (%lu bytes)\n", name, (unsigned long)(matches[i].size));
+				}
+			}
+		}
+	}
+	release_hash_window();
+	release_index(&index);
+	return (EXIT_SUCCESS);
+}
+
+/* Hash every readable file that the scan left without a full digest
+ * (or a shallow hash, which keys the index filter), so that the index
+ * covers unique files as well as duplicates (returns zero on failure) */
+int
+hash_remaining(struct file_info_t *info, size_t num_workers)
+{
+	int status = 1;
+	SListEntry **lists[2];
+	SListIterator slist_iterator;
+	struct file_entry_t *file_entry;
+	struct file_pool_t pool;
+	static const enum hash_depth_t depths[] = { SHALLOW, FULL };
+	size_t i, j;
+	lists[0] = &info->good_files;
+	lists[1] = &info->unique_files;
+	for (j = 0; status && j < 2; ++j) {
+		if (!pool_init(&pool, depths[j])) {
+			pool_destroy(&pool);
+			return 0;
+		}
+		for (i = 0; status && i < 2; ++i) {
+			slist_iterate(lists[i], &slist_iterator);
+			while (status && slist_iter_has_more(&slist_iterator)) {
+				file_entry = slist_iter_next(&slist_iterator);
+				if (file_entry->type == REGULAR && hash_pending(file_entry, depths[j])) {
+					status = pool_push(&pool, file_entry);
+				}
+			}
+		}
+		if (status) {
+			pool_run(&pool, num_workers);
+		}
+		pool_destroy(&pool);
+	}
+	return status;
+}
+
+#define MAX_STAGES     8
+#define DEFAULT_STAGES "htm"
+
+/* Parse a chain of sampling stages (h = head, t = tail, m = middle)
+ * into a list terminated by NONE (returns zero if it is invalid) */
+int
+parse_stages(const char *chain, enum hash_depth_t *stages)
+{
+	size_t i;
+	for (i = 0; chain[i] != '\0'; ++i) {
+		if (i == MAX_STAGES) {
+			return 0;
+		}
+		switch (chain[i]) {
+		case 'h': stages[i] = HEAD; break;
+		case 't': stages[i] = TAIL; break;
+		case 'm': stages[i] = SAMPLE; break;
+		default: return 0;
+		}
+	}
+	stages[i] = NONE;
+	return 1;
+}
+
+/* Page cache modes, by name (see page_mode) */
+int
+parse_page_mode(const char *name)
+{
+	if (!strcmp(name, "normal")) {
+		page_mode = PAGE_NORMAL;
+	} else if (!strcmp(name, "aggressive")) {
+		page_mode = PAGE_AGGRESSIVE;
+	} else if (!strcmp(name, "neutral")) {
+		page_mode = PAGE_NEUTRAL;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+const char *
+stage_name(enum hash_depth_t depth)
+{
+	switch (depth) {
+	case HEAD: return "head";
+	case TAIL: return "tail";
+	case SAMPLE: return "middle";
+	default: return "unknown";
+	}
+}
+
 void
-archive(struct file_info_t *info, struct file_entry_t *entry)
+usage(const char *program)
 {
-	Set *hash_set = trie_lookup(info->hash_trie, entry->hash);
-	if (hash_set == TRIE_NULL) {
-		/* Otherwise, the value needs a new list */
-		hash_set = set_new(&pointer_hash, &pointer_equal);
-		slist_prepend(&info->duplicates, hash_set);
-		trie_insert(info->hash_trie, entry->hash, hash_set);
-	}
-	if (!set_insert(hash_set, entry)) {
-		#ifndef NDEBUG
-		fprintf(stderr, "[DEBUG] '%s' (extra file)\n", entry->path);
-		#endif
+	const struct digest_engine_t *engine;
+	fprintf(stderr, "usage: %s [-C | -c cache] [-q index] [-d digest] [-j jobs] [-m mode]"
+			" [-n] [-s stages] [-S KiB] [-T | --stats file] [-V] [path ...]\n", program);
+	fprintf(stderr, "\t-c cache\treuse digests of unchanged files from here"
+			" (default: %s)\n", CACHE_DEFAULT_FILE);
+	fprintf(stderr, "\t-C\thash every file (neither read nor write the cache)\n");
+	fprintf(stderr, "\t-q index\tlook up each file in an index (see %s) instead\n",
+			INDEX_DEFAULT_FILE);
+	fprintf(stderr, "\t-d digest\tfull-hash with one of:");
+	for (engine = digest_engines; engine->name; ++engine) {
+		fprintf(stderr, " %s", engine->name);
 	}
+	fprintf(stderr, " (default: %s)\n", digest_engine->name);
+	fprintf(stderr, "\t-j jobs\tfull-hash with this many workers (0 = one per CPU)\n");
+	fprintf(stderr, "\t-m mode\tpage cache use: normal, aggressive (read ahead)"
+			" or neutral (leave it as found)\n");
+	fprintf(stderr, "\t-n\tdo not write an index (%s), which full-hashes every file\n",
+			INDEX_DEFAULT_FILE);
+	fprintf(stderr, "\t-s stages\tsample (h)ead, (t)ail, (m)iddle before a full hash"
+			" (default: %s)\n", DEFAULT_STAGES);
+	fprintf(stderr, "\t-S KiB\tsize of the head and tail samples (default: %lu)\n",
+			(unsigned long)(sample_size / 1024));
+	fprintf(stderr, "\t-T, --stats file\twrite what each stage did, and how long"
+			" it took (as JSON) here\n");
+	fprintf(stderr, "\t-V\tcompare duplicates byte for byte (rules out digest collisions)\n");
 }
 
 int
 main(int argc, char *argv[])
 {
-	size_t path_len, total_files;
+	int option, status, verify = 0, indexed = 1;
+	long eliminated;
+	char *option_end;
+	size_t i, total_files, job, stage, num_groups, num_sets, batch_len = 0, num_workers = 1;
+	size_t num_roots;
+	const char *cache_file = CACHE_DEFAULT_FILE, *stats_file = NULL;
+	char *index_file = NULL;
+	time_t started = time(NULL);
+	enum hash_depth_t stages[MAX_STAGES + 1];
 	off_t bytes_wasted, total_wasted;
-	char path_buffer[PATH_MAX_LEN], *hash_value;
-	struct file_entry_t *file_entry, *trie_entry;
+	unsigned char *hash_value;
+	#ifndef NDEBUG
+	char hex_buffer[2 * DIGEST_MAX_LENGTH + 1];
+	#endif
+	struct file_entry_t *file_entry, *group_entry, **set_entries;
+	struct file_entry_t *batch[FILTER_BATCH_SIZE];
+	struct file_group_t *group, **groups = NULL;
+	static const struct option long_options[] = {
+		{ "stats", required_argument, NULL, 'T' },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	SListIterator slist_iterator;
-	SetIterator set_iterator;
+	struct file_pool_t file_pool;
 
 	/* Step 0: Session data */
 	struct file_info_t file_info;
 	clear_info(&file_info);
 
 	/* Step 1: Parse arguments */
-	while (--argc) {
+	parse_stages(DEFAULT_STAGES, stages);
+	while ((option = getopt_long(argc, argv, "Cc:d:j:m:nq:s:S:T:V", long_options, NULL)) != -1) {
+		switch (option) {
+		case 'C':
+			cache_file = NULL;
+			break;
+		case 'c':
+			cache_file = optarg;
+			break;
+		case 'd':
+			if (!select_digest(optarg)) {
+				fprintf(stderr, "[FATAL] '%s' (unknown digest)\n", optarg);
+				return (EXIT_FAILURE);
+			}
+			break;
+		case 'n':
+			indexed = 0;
+			break;
+		case 'q':
+			index_file = optarg;
+			break;
+		case 'j':
+			num_workers = strtoul(optarg, &option_end, 10);
+			if (*optarg == '\0' || *option_end != '\0') {
+				fprintf(stderr, "[FATAL] '%s' (invalid job count)\n", optarg);
+				return (EXIT_FAILURE);
+			}
+			if (num_workers == 0) {
+				num_workers = pool_default_workers();
+			}
+			break;
+		case 'm':
+			if (!parse_page_mode(optarg)) {
+				fprintf(stderr, "[FATAL] '%s' (invalid page cache mode)\n", optarg);
+				return (EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			if (!parse_stages(optarg, stages)) {
+				fprintf(stderr, "[FATAL] '%s' (invalid stages)\n", optarg);
+				return (EXIT_FAILURE);
+			}
+			break;
+		case 'S':
+			sample_size = (off_t)(strtoul(optarg, &option_end, 10)) * 1024;
+			if (*optarg == '\0' || *option_end != '\0'
+					|| sample_size <= 0 || sample_size > SAMPLE_MAX_SIZE) {
+				fprintf(stderr, "[FATAL] '%s' (invalid sample size)\n", optarg);
+				return (EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			stats_file = optarg;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+	/* The cache only forgets files under the paths given (see cache_save) */
+	num_roots = (argc > optind) ? (size_t)(argc - optind) : 0;
+	while (--argc >= optind) {
 		/* Being unable to record implies insufficient resources */
 		if (!record(argv[argc], &file_info)){
 			fprintf(stderr, "[FATAL] out of memory\n");
@@ -64,31 +375,35 @@ main(int argc, char *argv[])
 	#ifndef NDEBUG
 	printf("[DEBUG] Creating file list...\n");
 	#endif
-	while (slist_length(file_info.file_stack) > 0) {
-		/* Pick off the top of the file stack */
-		file_entry = (struct file_entry_t *)(slist_data(file_info.file_stack));
-		slist_remove_entry(&file_info.file_stack, file_info.file_stack);
-		assert(file_entry->type == DIRECTORY);
-		/* Copy the basename to a buffer */
-		memset(path_buffer, '\0', PATH_MAX_LEN);
-		path_len = strnlen(file_entry->path, PATH_MAX_LEN);
-		memcpy(path_buffer, file_entry->path, path_len);
-		/* Ignore cases that would cause overflow */
-		if (path_len < PATH_MAX_LEN) {
-			/* Append a trailing slash */
-			path_buffer[path_len] = '/';
-			/* Record all contents (may push onto file stack or one of the lists) */
-			DIR *directory = opendir(file_entry->path);
-			if (traverse(&file_info, directory, path_buffer, ++path_len)) {
-				fprintf(stderr, "[FATAL] out of memory\n");
-				destroy_info(&file_info);
-				return (EXIT_FAILURE);
-			} else if (closedir(directory)) {
-				fprintf(stderr, "[WARNING] '%s' (close failed)\n", file_entry->path);
-			}
+	stats_start();
+	if (walk_tree(&file_info, num_workers)) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		destroy_info(&file_info);
+		return (EXIT_FAILURE);
+	}
+	/* Workers finish in any order, so sort (this fixes the report order) */
+	if (!sort_list(&file_info.good_files, &compare_paths)
+			|| !sort_list(&file_info.bad_files, &compare_paths)) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		destroy_info(&file_info);
+		return (EXIT_FAILURE);
+	}
+	/* Every path to the same file shares one entry's hash (and report) */
+	if (!collapse_links(&file_info)) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		destroy_info(&file_info);
+		return (EXIT_FAILURE);
+	}
+	stats_count(STATS_FILES, file_info.total_files);
+	stats_stop(STATS_WALK);
+	if (index_file) {
+		option = query(index_file, &file_info);
+		stats_stop(STATS_INDEX);
+		if (stats_file && !stats_write(stats_file)) {
+			fprintf(stderr, "[WARNING] '%s' (stats not written)\n", stats_file);
 		}
-		/* Discard this entry */
-		destroy_entry(file_entry);
+		destroy_info(&file_info);
+		return option;
 	}
 
 	/* Step 3: Warn about any ignored files */
@@ -96,7 +411,7 @@ main(int argc, char *argv[])
 		slist_iterate(&file_info.bad_files, &slist_iterator);
 		while (slist_iter_has_more(&slist_iterator)) {
 			file_entry = slist_iter_next(&slist_iterator);
-			fprintf(stderr, "[WARNING] '%s' ", file_entry->path);
+			fprintf(stderr, "[WARNING] '%s' ", entry_path(file_entry));
 			switch (file_entry->type) {
 			case INVALID:
 				++file_info.invalid_files;
@@ -124,87 +439,293 @@ main(int argc, char *argv[])
 	printf("[DEBUG] Found %lu / %lu valid files\n",
 		(unsigned long)(num_files(&file_info)),
 		(unsigned long)(file_info.total_files));
+	printf("[DEBUG] Collapsed %lu / %lu files (hard links)\n",
+		(unsigned long)(file_info.linked_files_count),
+		(unsigned long)(num_files(&file_info)));
 	#endif
 
 	/* Step 4: Begin the filtering process */
 	#ifndef NDEBUG
 	printf("[DEBUG] Creating file table...\n");
 	#endif
+	/* Only files with a common size need to be hashed */
+	if (!prune_sizes(&file_info)) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		destroy_info(&file_info);
+		return (EXIT_FAILURE);
+	}
+	#ifndef NDEBUG
+	printf("[DEBUG] Pruned %lu / %lu files (unique size)\n",
+		(unsigned long)(file_info.unique_files_count),
+		(unsigned long)(num_files(&file_info)));
+	#endif
+	stats_count(STATS_FILES, num_files(&file_info));
+	stats_stop(STATS_PRUNE);
+	/* Files that have not changed since the last scan keep their digests
+	 * (unique files too, since the index covers them) */
+	if (cache_file) {
+		eliminated = cache_load(cache_file, &file_info);
+		stats_count(STATS_FILES, (eliminated > 0) ? (size_t)(eliminated) : 0);
+		#ifndef NDEBUG
+		printf("[DEBUG] Reused %ld / %lu digests (cache)\n", eliminated,
+			(unsigned long)(slist_length(file_info.good_files)
+				+ slist_length(file_info.unique_files)));
+		#endif
+		stats_stop(STATS_CACHE);
+	}
 	if (slist_length(file_info.good_files) > 0) {
-		file_info.hash_trie = trie_new();
-		file_info.shash_trie = trie_new();
+		file_info.hash_shards = shards_new(offsetof(struct file_entry_t, hash),
+				digest_engine->length, num_candidates(&file_info));
+		file_info.shash_table = table_new(offsetof(struct file_entry_t, shash),
+				sizeof(uint64_t), num_candidates(&file_info));
 		optimize_filter(&file_info);
-		/* Extract each file from the list (they should all be regular) */
+		if (!file_info.hash_shards || !file_info.shash_table || !file_info.shash_filter) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+		/* Shallow-hash every candidate up front, many at a time */
+		status = pool_init(&file_pool, SHALLOW);
+		slist_iterate(&file_info.good_files, &slist_iterator);
+		while (status && slist_iter_has_more(&slist_iterator)) {
+			status = pool_push(&file_pool, slist_iter_next(&slist_iterator));
+		}
+		if (status) {
+			pool_run(&file_pool, num_workers);
+			#ifndef NDEBUG
+			printf("[DEBUG] '%lu / %lu' (shallow hashes through io_uring)\n",
+				(unsigned long)(ring_hash_count), (unsigned long)(file_pool.num_jobs));
+			#endif
+		}
+		pool_destroy(&file_pool);
+		stats_stop(STATS_SHALLOW);
+		if (!status || !pool_init(&file_pool, FULL)) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			pool_destroy(&file_pool);
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+		/* Extract each file from the list (they were all regular when found) */
 		slist_iterate(&file_info.good_files, &slist_iterator);
 		while (slist_iter_has_more(&slist_iterator)) {
 			file_entry = slist_iter_next(&slist_iterator);
-			assert(file_entry->type == REGULAR);
-			/* Perform a "shallow" hash of the file */
-			hash_value = hash_entry(file_entry, SHALLOW);
+			/* Perform a "shallow" hash of the file (unless it failed to
+			 * open above, which is already known) */
+			hash_value = (file_entry->type == REGULAR) ?
+				hash_entry(file_entry, SHALLOW) : NULL;
+			if (!hash_value) {
+				/* Readability is only checked when a file is opened */
+				if (file_entry->type == INACCESSIBLE) {
+					++file_info.protected_files;
+					fprintf(stderr, "[WARNING] '%s' (protected file)\n", entry_path(file_entry));
+				}
+				continue;
+			}
 			#ifndef NDEBUG
-			printf("[SHASH] %s\t*%s\n", file_entry->path, hash_value);
+			printf("[SHASH] %s\t*%s\n", entry_path(file_entry),
+				format_digest(hex_buffer, hash_value, sizeof(uint64_t)));
 			#endif
-			/* Check to see if we might have seen this file before */
-			if (bloom_filter_query(file_info.shash_filter, hash_value)) {
-				/* Get the full hash of the new file */
-				hash_value = hash_entry(file_entry, FULL);
-				#ifndef NDEBUG
-				printf("[+HASH] %s\t*%s\n", file_entry->path, hash_value);
-				#endif
-				archive(&file_info, file_entry);
-				/* Check to see if bloom failed us */
-				trie_entry = trie_lookup(file_info.shash_trie, file_entry->shash);
-				if (trie_entry == TRIE_NULL) {
-					#ifndef NDEBUG
-					printf("[DEBUG] '%s' (false positive)\n", file_entry->path);
-					#endif
-					trie_insert(file_info.shash_trie, file_entry->shash, file_entry);
-				} else {
-					/* Get the full hash of the old file */
-					hash_value = hash_entry(trie_entry, FULL);
-					#ifndef NDEBUG
-					if (hash_value) {
-						printf("[-HASH] %s\t*%s\n", trie_entry->path, hash_value);
-					}
-					#endif
-					archive(&file_info, trie_entry);
+			/* Filter the shallow hashes a batch at a time */
+			batch[batch_len++] = file_entry;
+			if (batch_len == FILTER_BATCH_SIZE) {
+				if (!filter_batch(&file_info, &file_pool, batch, batch_len)) {
+					fprintf(stderr, "[FATAL] out of memory\n");
+					pool_destroy(&file_pool);
+					destroy_info(&file_info);
+					return (EXIT_FAILURE);
 				}
-			} else {
-				/* Add a record of this shash to the filter */
-				bloom_filter_insert(file_info.shash_filter, hash_value);
-				trie_insert(file_info.shash_trie, hash_value, file_entry);
+				batch_len = 0;
+			}
+		}
+		if (!filter_batch(&file_info, &file_pool, batch, batch_len)) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			pool_destroy(&file_pool);
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+		stats_stop(STATS_FILTER);
+		/* Sample the candidates, so only groups that survive every stage
+		 * need a full hash (each stage runs in parallel, like the last) */
+		for (stage = 0; stages[stage] != NONE; ++stage) {
+			#ifndef NDEBUG
+			job = file_pool.num_jobs;
+			#endif
+			eliminated = pool_prune(&file_pool, stages[stage], num_workers);
+			if (eliminated < 0) {
+				fprintf(stderr, "[FATAL] out of memory\n");
+				pool_destroy(&file_pool);
+				destroy_info(&file_info);
+				return (EXIT_FAILURE);
+			}
+			#ifndef NDEBUG
+			printf("[DEBUG] '%s' stage eliminated %ld / %lu candidates\n",
+				stage_name(stages[stage]), eliminated, (unsigned long)(job));
+			#endif
+		}
+		stats_stop(STATS_SAMPLE);
+		/* Compare small groups outright, which can stop reading them as
+		 * soon as they differ (and hashes those that never do) */
+		#ifndef NDEBUG
+		job = file_pool.num_jobs;
+		#endif
+		eliminated = pool_compare(&file_pool, num_workers);
+		if (eliminated < 0) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			pool_destroy(&file_pool);
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+		#ifndef NDEBUG
+		printf("[DEBUG] 'compare' stage eliminated %ld / %lu candidates\n",
+			eliminated, (unsigned long)(job));
+		printf("[DEBUG] '%lu %lu %lu' (groups compared, files matched, bytes skipped)\n",
+			(unsigned long)(compare_groups), (unsigned long)(compare_matched),
+			(unsigned long)(compare_skipped));
+		#endif
+		stats_stop(STATS_COMPARE);
+		/* Get the full hash of every candidate (perhaps in parallel),
+		 * grouping them as they finish */
+		file_pool.depth = FULL;
+		file_pool.archive = file_info.hash_shards;
+		pool_run(&file_pool, num_workers);
+		if (file_pool.failed) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			pool_destroy(&file_pool);
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+		#ifndef NDEBUG
+		printf("[DEBUG] '%lu %lu %lu %lu' (read/map/stream/tree full hashes)\n",
+			(unsigned long)(hash_strategy_count[HASH_READ]),
+			(unsigned long)(hash_strategy_count[HASH_MAP]),
+			(unsigned long)(hash_strategy_count[HASH_STREAM]),
+			(unsigned long)(hash_strategy_count[HASH_TREE]));
+		#endif
+		#ifndef NDEBUG
+		for (job = 0; job < file_pool.num_jobs; ++job) {
+			file_entry = file_pool.jobs[job];
+			if (file_entry->hashed & FULL) {
+				printf("[+HASH] %s\t*%s\n", entry_path(file_entry), format_digest(
+					hex_buffer, file_entry->hash, digest_engine->length));
 			}
 		}
-		persist("bloom_store", &file_info);
+		#endif
+		pool_destroy(&file_pool);
+		stats_stop(STATS_FULL);
+		/* Rule out digest collisions, if asked to */
+		if (verify && verify_groups(file_info.hash_shards) < 0) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+		stats_stop(STATS_VERIFY);
+	}
+	/* The index answers for every file, not only those with a duplicate,
+	 * so the rest need a full hash (which the cache keeps for next time) */
+	if (indexed && num_files(&file_info) > 0) {
+		if (!hash_remaining(&file_info, num_workers)) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+		stats_stop(STATS_INDEX);
 	}
+	if (cache_file && num_files(&file_info) > 0 && !cache_save(cache_file, &file_info,
+				started, argv + optind, num_roots)) {
+		fprintf(stderr, "[WARNING] '%s' (cache not saved)\n", cache_file);
+	}
+	stats_stop(STATS_CACHE);
+	if (indexed && num_files(&file_info) > 0 && persist(INDEX_DEFAULT_FILE, &file_info)) {
+		fprintf(stderr, "[WARNING] '%s' (index not written)\n", INDEX_DEFAULT_FILE);
+	}
+	stats_stop(STATS_INDEX);
+	release_hash_window();
 
 	/* Step 5: Output results and cleanup before exit */
+	num_groups = 0;
+	if (file_info.hash_shards) {
+		groups = shards_groups(file_info.hash_shards, &num_groups);
+		if (!groups) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+	}
+	/* Groups of one are files that merely survived every filter */
+	for (i = num_sets = 0; i < num_groups; ++i) {
+		num_sets += (groups[i]->num_members > 1);
+	}
 	printf("[EXTRA] Found %lu sets of duplicates...\n",
-		(unsigned long)(slist_length(file_info.duplicates)));
-	slist_iterate(&file_info.duplicates, &slist_iterator);
-	for (total_files = total_wasted = bytes_wasted = 0;
-		slist_iter_has_more(&slist_iterator);
-		total_wasted += bytes_wasted)
+		(unsigned long)(num_sets));
+	for (total_files = total_wasted = i = 0;
+		i < num_groups;
+		total_wasted += bytes_wasted, ++i)
 	{
-		Set *set = slist_iter_next(&slist_iterator);
-		int size = set_num_entries(set);
-		if (size < 2) { continue; }
-		printf("[EXTRA] %lu files (w/ same hash):\n", (unsigned long)(size));
-		set_iterate(set, &set_iterator);
-		for (bytes_wasted = 0;
-			set_iter_has_more(&set_iterator);
-			bytes_wasted += file_entry->size,
-			++total_files)
-		{
-			file_entry = set_iter_next(&set_iterator);
+		group = groups[i];
+		bytes_wasted = 0;
+		if (group->num_members < 2) { continue; }
+		printf("[EXTRA] %lu files (w/ same hash):\n",
+			(unsigned long)(group->num_members));
+		/* Sort each set, so that the report does not depend on timing */
+		set_entries = malloc(group->num_members * sizeof(struct file_entry_t *));
+		if (!set_entries) {
+			fprintf(stderr, "[FATAL] out of memory\n");
+			free(groups);
+			destroy_info(&file_info);
+			return (EXIT_FAILURE);
+		}
+		for (job = 0, file_entry = group->members; file_entry;
+				file_entry = file_entry->duplicate) {
+			set_entries[job++] = file_entry;
+		}
+		qsort(set_entries, group->num_members,
+			sizeof(struct file_entry_t *), &compare_paths);
+		for (job = 0; job < group->num_members; ++job, ++total_files) {
+			file_entry = set_entries[job];
+			bytes_wasted += file_entry->size;
 			printf("\t%s (%lu bytes)\n",
-				file_entry->path,
+				entry_path(file_entry),
 				(unsigned long)(file_entry->size));
 		}
+		free(set_entries);
 	}
+	free(groups);
+	stats_count(STATS_FILES, total_files);
 	printf("[EXTRA] %lu bytes in %lu files (wasted)\n",
 		(unsigned long)(total_wasted),
 		(unsigned long)(total_files));
+	if (page_mode != PAGE_NORMAL) {
+		printf("[EXTRA] %lu bytes read from disk, %lu from cache (full hashes)\n",
+			(unsigned long)(page_bytes_read),
+			(unsigned long)(page_bytes_cached));
+	}
+	/* Hard links share storage, so they are not wasted (only listed) */
+	if (slist_length(file_info.linked_files) > 0) {
+		printf("[EXTRA] Found %lu sets of hard links...\n",
+			(unsigned long)(slist_length(file_info.linked_files)));
+		slist_iterate(&file_info.linked_files, &slist_iterator);
+		while (slist_iter_has_more(&slist_iterator)) {
+			file_entry = slist_iter_next(&slist_iterator);
+			for (job = 0, group_entry = file_entry; group_entry;
+					group_entry = group_entry->link, ++job);
+			printf("[EXTRA] %lu paths (w/ same file):\n", (unsigned long)(job));
+			for (group_entry = file_entry; group_entry; group_entry = group_entry->link) {
+				printf("\t%s (%lu bytes)\n",
+					entry_path(group_entry),
+					(unsigned long)(group_entry->size));
+			}
+		}
+	}
+	#ifndef NDEBUG
+	printf("[DEBUG] '%lu / %lu' (arena bytes used) '%ld' (peak KiB)\n",
+		(unsigned long)(file_info.arena.used),
+		(unsigned long)(file_info.arena.reserved),
+		peak_memory());
+	#endif
+	stats_stop(STATS_REPORT);
+	if (stats_file && !stats_write(stats_file)) {
+		fprintf(stderr, "[WARNING] '%s' (stats not written)\n", stats_file);
+	}
 	destroy_info(&file_info);
 	return (EXIT_SUCCESS);
 }
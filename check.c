@@ -0,0 +1,474 @@
+/* For mkdtemp and nftw */
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_filter.h"
+#include "file_queue.h"
+#include "file_watch.h"
+
+#include "persist.h"
+
+/* Checks of the daemon's parts that need neither GTK nor a session:
+ * each command sets up what it needs (in a directory of its own), says
+ * what it got that it did not expect, and fails if anything was off */
+#define CHECK_MAX_EVENTS 16
+/* Directories made, and moved out of a watched tree, one after another */
+#define CHECK_CHURN      2000
+/* Keys a scalable filter is sized for at first, is given (enough for six
+ * slices), and is then asked about (none of which it was given) */
+#define CHECK_FIRST_KEYS  ((uint64_t)(1000))
+#define CHECK_KEYS        ((uint64_t)(50000))
+#define CHECK_OTHER_KEYS  ((uint64_t)(1000000))
+#define CHECK_RATE        0.001
+
+/* What a watch dispatched, in order */
+struct check_events_t
+{
+	char paths[CHECK_MAX_EVENTS][PATH_MAX_LEN];
+	enum watch_event_t types[CHECK_MAX_EVENTS];
+	size_t num_events;
+};
+
+void
+check_record(const char *path, enum watch_event_t type, void *data)
+{
+	struct check_events_t *events = (struct check_events_t *)(data);
+	if (events->num_events < CHECK_MAX_EVENTS) {
+		snprintf(events->paths[events->num_events], PATH_MAX_LEN, "%s", path);
+		events->types[events->num_events] = type;
+	}
+	++events->num_events;
+}
+
+int
+check_count(const char *what, size_t got, size_t expected)
+{
+	if (got != expected) {
+		fprintf(stderr, "[FAILED] %s: %lu (expected %lu)\n", what,
+				(unsigned long)(got), (unsigned long)(expected));
+		return 0;
+	}
+	return 1;
+}
+
+/* Returns zero (and says why) unless the events are exactly these paths
+ * (NULL-terminated, in any order, since directories are read in no
+ * particular one), each of this type; the events are then cleared */
+int
+check_dispatched(const char *what, struct check_events_t *events,
+		enum watch_event_t type, const char *root, ...)
+{
+	int status = 1;
+	size_t i, num_expected = 0;
+	unsigned char matched[CHECK_MAX_EVENTS];
+	va_list names;
+	const char *name;
+	char path[PATH_MAX_LEN];
+	memset(matched, 0, sizeof(matched));
+	va_start(names, root);
+	while ((name = va_arg(names, const char *))) {
+		snprintf(path, PATH_MAX_LEN, "%s/%s", root, name);
+		for (i = 0; i < events->num_events && i < CHECK_MAX_EVENTS; ++i) {
+			if (!matched[i] && !strcmp(events->paths[i], path) && events->types[i] == type) {
+				break;
+			}
+		}
+		if (i < events->num_events && i < CHECK_MAX_EVENTS) {
+			matched[i] = 1;
+		} else {
+			fprintf(stderr, "[FAILED] %s: '%s' was not dispatched\n", what, path);
+			status = 0;
+		}
+		++num_expected;
+	}
+	va_end(names);
+	for (i = 0; i < events->num_events && i < CHECK_MAX_EVENTS; ++i) {
+		if (!matched[i]) {
+			fprintf(stderr, "[FAILED] %s: '%s' was dispatched\n", what, events->paths[i]);
+			status = 0;
+		}
+	}
+	status &= check_count(what, events->num_events, num_expected);
+	events->num_events = 0;
+	return status;
+}
+
+int
+check_touch(const char *root, const char *name)
+{
+	char path[PATH_MAX_LEN];
+	FILE *stream;
+	snprintf(path, PATH_MAX_LEN, "%s/%s", root, name);
+	if (!(stream = fopen(path, "w"))) {
+		return 0;
+	}
+	fputs(name, stream);
+	return fclose(stream) == 0;
+}
+
+int
+check_rename(const char *root, const char *from, const char *to)
+{
+	char source[PATH_MAX_LEN], target[PATH_MAX_LEN];
+	snprintf(source, PATH_MAX_LEN, "%s/%s", root, from);
+	snprintf(target, PATH_MAX_LEN, "%s/%s", root, to);
+	return rename(source, target) == 0;
+}
+
+/* A nested tree moved out of a watched one is no longer watched (all
+ * of it, however deep), and moved back in, it is watched again, with
+ * what is in it dispatched, and directories that come and go do not
+ * grow the tables (inotify queues events as they happen, so each step is
+ * read at once) */
+int
+check_watch(const char *root)
+{
+	int status = 1;
+	char path[PATH_MAX_LEN], name[32];
+	struct file_watch_t watch;
+	struct check_events_t events;
+	const char *dirs[] = { "in", "in/a", "in/a/b", "in/a/b/c", "out", NULL };
+	size_t i, names_used;
+	events.num_events = 0;
+	for (i = 0; dirs[i]; ++i) {
+		snprintf(path, PATH_MAX_LEN, "%s/%s", root, dirs[i]);
+		if (mkdir(path, S_IRWXU)) {
+			perror(path);
+			return 0;
+		}
+	}
+	if (!check_touch(root, "in/a/b/c/old") || !watch_init(&watch)) {
+		perror(root);
+		return 0;
+	}
+	snprintf(path, PATH_MAX_LEN, "%s/in", root);
+	if (!watch_add(&watch, path, WATCH_ROOT, &check_record, &events)) {
+		perror(path);
+		watch_destroy(&watch);
+		return 0;
+	}
+	status &= check_count("watched", watch.num_dirs, 4);
+	status &= check_dispatched("added", &events, WATCH_WRITTEN, root, "in/a/b/c/old", NULL);
+	/* Out: nothing below it is watched, so writes there go unseen */
+	status &= check_rename(root, "in/a", "out/a");
+	status &= watch_read(&watch, &check_record, &events) >= 0;
+	status &= check_count("watched after moving out", watch.num_dirs, 1);
+	status &= check_touch(root, "out/a/b/c/unseen");
+	status &= watch_read(&watch, &check_record, &events) >= 0;
+	status &= check_dispatched("moved out", &events, WATCH_WRITTEN, root, NULL);
+	/* In (under another name): watched again, and its files dispatched */
+	status &= check_rename(root, "out/a", "in/z");
+	status &= watch_read(&watch, &check_record, &events) >= 0;
+	status &= check_count("watched after moving in", watch.num_dirs, 4);
+	status &= check_dispatched("moved in", &events, WATCH_WRITTEN, root,
+			"in/z/b/c/old", "in/z/b/c/unseen", NULL);
+	status &= check_touch(root, "in/z/b/c/new");
+	status &= watch_read(&watch, &check_record, &events) >= 0;
+	status &= check_dispatched("written", &events, WATCH_WRITTEN, root, "in/z/b/c/new", NULL);
+	/* Churn: the kernel never gives a descriptor back, but the tables
+	 * only hold what is watched (and names half dead, at most) */
+	names_used = watch.names_used;
+	for (i = 0; i < CHECK_CHURN && status; ++i) {
+		snprintf(name, sizeof(name), "in/d%lu", (unsigned long)(i));
+		snprintf(path, PATH_MAX_LEN, "%s/%s", root, name);
+		status &= !mkdir(path, S_IRWXU);
+		status &= watch_read(&watch, &check_record, &events) >= 0;
+		snprintf(path, PATH_MAX_LEN, "out/d%lu", (unsigned long)(i));
+		status &= check_rename(root, name, path);
+		status &= watch_read(&watch, &check_record, &events) >= 0;
+	}
+	status &= check_count("watched after churning", watch.num_dirs, 4);
+	if (watch.dirs_used > 5 || watch.names_used > 2 * names_used + sizeof(name)) {
+		fprintf(stderr, "[FAILED] churned: %lu slots, %lu bytes of names\n",
+				(unsigned long)(watch.dirs_used), (unsigned long)(watch.names_used));
+		status = 0;
+	}
+	status &= check_touch(root, "in/z/b/c/newer");
+	status &= watch_read(&watch, &check_record, &events) >= 0;
+	status &= check_dispatched("churned", &events, WATCH_WRITTEN, root, "in/z/b/c/newer", NULL);
+	watch_destroy(&watch);
+	return status;
+}
+
+/* Events for one file merge (the last one wins), each file is dispatched
+ * once it has been quiet for a window, or held for the most windows,
+ * in the order the files were first seen, and a batch at a time (the
+ * clock is made up, so none of this depends on timing) */
+int
+check_queue(void)
+{
+	int status = 1;
+	struct file_queue_t queue;
+	struct check_events_t events;
+	events.num_events = 0;
+	if (!queue_init(&queue, 100)) {
+		return 0;
+	}
+	status &= check_count("nothing pending", queue_wait(&queue, 0), 0);
+	status &= queue_push(&queue, "q/a", WATCH_WRITTEN, 0);
+	status &= queue_push(&queue, "q/b", WATCH_WRITTEN, 10);
+	status &= queue_push(&queue, "q/a", WATCH_REMOVED, 50);
+	status &= check_count("merged", queue.num_pending, 2);
+	status &= check_count("wait for b", queue_wait(&queue, 60), 50);
+	status &= check_count("flushed early", queue_flush(&queue, 109, QUEUE_BATCH_SIZE,
+				&check_record, &events), 0);
+	status &= check_count("flushed b", queue_flush(&queue, 110, QUEUE_BATCH_SIZE,
+				&check_record, &events), 1);
+	status &= check_dispatched("b settled", &events, WATCH_WRITTEN, "q", "b", NULL);
+	/* However busy a is, it is held for eight windows at most */
+	status &= queue_push(&queue, "q/a", WATCH_WRITTEN, 400);
+	status &= queue_push(&queue, "q/a", WATCH_REMOVED, 790);
+	status &= check_count("wait for a", queue_wait(&queue, 790), 10);
+	status &= check_count("flushed a early", queue_flush(&queue, 799, QUEUE_BATCH_SIZE,
+				&check_record, &events), 0);
+	status &= check_count("flushed a", queue_flush(&queue, 800, QUEUE_BATCH_SIZE,
+				&check_record, &events), 1);
+	status &= check_dispatched("a held", &events, WATCH_REMOVED, "q", "a", NULL);
+	/* First seen, first dispatched (d's later event does not reorder it),
+	 * and no more than the limit at once */
+	status &= queue_push(&queue, "q/c", WATCH_WRITTEN, 1000);
+	status &= queue_push(&queue, "q/d", WATCH_WRITTEN, 1000);
+	status &= queue_push(&queue, "q/e", WATCH_WRITTEN, 1000);
+	status &= queue_push(&queue, "q/c", WATCH_WRITTEN, 1001);
+	status &= check_count("flushed a batch", queue_flush(&queue, 2000, 2,
+				&check_record, &events), 2);
+	if (events.num_events != 2 || strcmp(events.paths[0], "q/c") || strcmp(events.paths[1], "q/d")) {
+		fprintf(stderr, "[FAILED] batch: not c, then d\n");
+		status = 0;
+	}
+	events.num_events = 0;
+	status &= check_count("left over", queue.num_pending, 1);
+	status &= check_count("flushed the rest", queue_flush(&queue, 2000, 2,
+				&check_record, &events), 1);
+	status &= check_dispatched("rest", &events, WATCH_WRITTEN, "q", "e", NULL);
+	status &= check_count("pushed", queue.num_pushed, 9);
+	status &= check_count("dispatched", queue.num_dispatched, 5);
+	queue_destroy(&queue);
+	/* A window too long to keep deadlines small is cut short */
+	if (!queue_init(&queue, UINT64_MAX)) {
+		return 0;
+	}
+	status &= check_count("longest window", queue.window, QUEUE_MAX_WINDOW);
+	status &= queue_push(&queue, "q/f", WATCH_WRITTEN, 1);
+	status &= check_count("longest wait", queue_wait(&queue, 1), QUEUE_MAX_WINDOW);
+	queue_destroy(&queue);
+	return status;
+}
+
+/* Distinct, well spread keys (as shallow hashes are) from a counter */
+inline uint64_t
+check_key(uint64_t i)
+{
+	uint64_t key = i + 0x9E3779B97F4A7C15ULL;
+	key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+	return key ^ (key >> 31);
+}
+
+/* A scalable filter grown well past its first slice still finds every
+ * key it was given, and is wrong about others no more often than the
+ * rate it was given overall */
+int
+check_scalable(void)
+{
+	int status = 1;
+	uint64_t i, key, num_missed = 0, num_wrong = 0;
+	double rate;
+	struct file_scalable_t filter;
+	if (!scalable_init(&filter, CHECK_FIRST_KEYS, CHECK_RATE)) {
+		return 0;
+	}
+	for (i = 0; i < CHECK_KEYS; ++i) {
+		key = check_key(i);
+		status &= scalable_insert(&filter, (unsigned char *)(&key));
+	}
+	status &= check_count("slices", filter.num_slices, 6);
+	for (i = 0; i < CHECK_KEYS; ++i) {
+		key = check_key(i);
+		num_missed += !scalable_query(&filter, (unsigned char *)(&key));
+	}
+	status &= check_count("missed", num_missed, 0);
+	for (i = CHECK_KEYS; i < CHECK_KEYS + CHECK_OTHER_KEYS; ++i) {
+		key = check_key(i);
+		num_wrong += scalable_query(&filter, (unsigned char *)(&key));
+	}
+	rate = (double)(num_wrong) / CHECK_OTHER_KEYS;
+	if (rate > CHECK_RATE) {
+		fprintf(stderr, "[FAILED] rate: %g (expected at most %g)\n", rate, CHECK_RATE);
+		status = 0;
+	}
+	scalable_destroy(&filter);
+	return status;
+}
+
+/* The smallest index persist could write: one block of filter, and one
+ * digest that owns one entry, named "a" */
+struct check_index_t
+{
+	struct index_header_t header;
+	unsigned char padding[INDEX_ALIGNMENT - sizeof(struct index_header_t) % INDEX_ALIGNMENT];
+	unsigned char filter[INDEX_ALIGNMENT];
+	struct index_digest_t digest;
+	unsigned char digest_padding[INDEX_ALIGNMENT - sizeof(struct index_digest_t) % INDEX_ALIGNMENT];
+	struct index_entry_t entry;
+	unsigned char entry_padding[INDEX_ALIGNMENT - sizeof(struct index_entry_t) % INDEX_ALIGNMENT];
+	char names[INDEX_ALIGNMENT];
+};
+
+void
+check_index_layout(struct check_index_t *layout)
+{
+	struct index_header_t *header = &layout->header;
+	memset(layout, 0, sizeof(struct check_index_t));
+	memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+	header->version = INDEX_VERSION;
+	header->byte_order = INDEX_BYTE_ORDER;
+	header->digest_length = DIGEST_MAX_LENGTH;
+	header->filter_blocks = 1;
+	header->filter_lanes = FILTER_LANES;
+	header->filter_hash = INDEX_FILTER_XXH64;
+	header->filter_offset = offsetof(struct check_index_t, filter);
+	header->num_digests = 1;
+	header->digests_offset = offsetof(struct check_index_t, digest);
+	header->num_entries = 1;
+	header->entries_offset = offsetof(struct check_index_t, entry);
+	header->names_size = 2;
+	header->names_offset = offsetof(struct check_index_t, names);
+	header->file_size = sizeof(struct check_index_t);
+	layout->digest.num_entries = 1;
+	layout->names[0] = 'a';
+}
+
+/* Write an index, and map it (returns whether recover took it) */
+int
+check_recover(const char *path, const struct check_index_t *layout,
+		struct file_index_t *index)
+{
+	FILE *stream = fopen(path, "wb");
+	if (!stream) {
+		return 0;
+	}
+	fwrite(layout, sizeof(struct check_index_t), 1, stream);
+	return !fclose(stream) && !recover((char *)(path), index);
+}
+
+/* An index is refused if its sections are out of place (misaligned, out
+ * of the file, or so large they overflow) or its names run off the end,
+ * and a run of entries or a path out of place is not used */
+int
+check_index(const char *root)
+{
+	int status = 1;
+	uint64_t num_entries;
+	char path[PATH_MAX_LEN];
+	struct check_index_t layout;
+	struct file_index_t index;
+	snprintf(path, PATH_MAX_LEN, "%s/%s", root, INDEX_DEFAULT_FILE);
+	check_index_layout(&layout);
+	if (!check_recover(path, &layout, &index)) {
+		fprintf(stderr, "[FAILED] recover: a usable index was refused\n");
+		return 0;
+	}
+	status &= index_entries(&index, &index.digests[0], &num_entries) != NULL;
+	status &= check_count("entries", num_entries, 1);
+	status &= index_name(&index, &index.entries[0]) != NULL
+		&& !strcmp(index_name(&index, &index.entries[0]), "a");
+	release_index(&index);
+	/* Runs and paths out of place (checked as they are used) */
+	layout.digest.first_entry = 1;
+	layout.entry.name_offset = 2;
+	status &= check_recover(path, &layout, &index);
+	status &= index_entries(&index, &index.digests[0], &num_entries) == NULL;
+	status &= check_count("entries out of place", num_entries, 0);
+	status &= index_name(&index, &index.entries[0]) == NULL;
+	release_index(&index);
+	layout.digest.first_entry = 0;
+	layout.digest.num_entries = UINT64_MAX;
+	status &= check_recover(path, &layout, &index);
+	status &= index_entries(&index, &index.digests[0], &num_entries) == NULL;
+	release_index(&index);
+	/* Headers out of place (each refused) */
+	check_index_layout(&layout);
+	layout.header.filter_blocks = 0;
+	status &= !check_recover(path, &layout, &index);
+	check_index_layout(&layout);
+	layout.header.filter_offset += sizeof(uint32_t);
+	status &= !check_recover(path, &layout, &index);
+	check_index_layout(&layout);
+	layout.header.num_entries = UINT64_MAX / sizeof(struct index_entry_t) + 2;
+	status &= !check_recover(path, &layout, &index);
+	check_index_layout(&layout);
+	layout.header.names_offset = UINT64_MAX - INDEX_ALIGNMENT + 1;
+	status &= !check_recover(path, &layout, &index);
+	check_index_layout(&layout);
+	layout.header.names_size = 1;
+	status &= !check_recover(path, &layout, &index);
+	if (!status) {
+		fprintf(stderr, "[FAILED] recover: an index out of place was used\n");
+	}
+	unlink(path);
+	return status;
+}
+
+int
+check_remove(const char *path, const struct stat *status, int flag, struct FTW *ftw)
+{
+	(void)(status);
+	(void)(flag);
+	(void)(ftw);
+	return remove(path);
+}
+
+/* Remove what a check left behind (children first) */
+void
+check_clean(const char *root)
+{
+	if (nftw(root, &check_remove, 16, FTW_DEPTH | FTW_PHYS)) {
+		fprintf(stderr, "[WARNING] '%s' (not removed)\n", root);
+	}
+}
+
+void
+usage(const char *program)
+{
+	fprintf(stderr, "usage: %s watch | queue | scalable | index\n", program);
+	fprintf(stderr, "\twatch\tmove a nested tree out of a watched one, and back in\n");
+	fprintf(stderr, "\tqueue\tmerge events, and dispatch them once due\n");
+	fprintf(stderr, "\tscalable\tgrow a filter, and measure its false positives\n");
+	fprintf(stderr, "\tindex\tmap indexes that are out of place\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int status;
+	char root[] = "/tmp/bloom_check.XXXXXX";
+	if (argc != 2) {
+		usage(argv[0]);
+		return (EXIT_FAILURE);
+	}
+	if (!strcmp(argv[1], "watch") || !strcmp(argv[1], "index")) {
+		if (!mkdtemp(root)) {
+			perror(root);
+			return (EXIT_FAILURE);
+		}
+		status = (argv[1][0] == 'w') ? check_watch(root) : check_index(root);
+		check_clean(root);
+	} else if (!strcmp(argv[1], "queue")) {
+		status = check_queue();
+	} else if (!strcmp(argv[1], "scalable")) {
+		status = check_scalable();
+	} else {
+		usage(argv[0]);
+		return (EXIT_FAILURE);
+	}
+	printf("[CHECK] %s %s\n", argv[1], status ? "passed" : "failed");
+	return status ? (EXIT_SUCCESS) : (EXIT_FAILURE);
+}
@@ -0,0 +1,137 @@
+#ifndef FILE_ARENA_H
+#define FILE_ARENA_H
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#define ARENA_BLOCK_SIZE ((size_t)(0x100000))
+#define ARENA_ALIGNMENT  ((size_t)(16))
+
+/* Blocks are carved up front to back, and never freed one by one; the
+ * header is padded so that data starts on an ARENA_ALIGNMENT boundary
+ * (as does the block, see arena_alloc), like every allocation in it */
+struct arena_block_t
+{
+	struct arena_block_t *next;
+	size_t used, size;
+	unsigned char data[] __attribute__ ((aligned(ARENA_ALIGNMENT)));
+};
+
+/* An arena owns every entry (and path) of a scan session; it is not
+ * locked, so each thread allocates from its own and merges it later */
+struct file_arena_t
+{
+	struct arena_block_t *blocks;
+	/* Bytes reserved from the heap, and bytes handed out */
+	size_t reserved, used;
+};
+
+inline void
+clear_arena(struct file_arena_t *arena)
+{
+	assert(arena);
+	arena->blocks = NULL;
+	arena->reserved = arena->used = 0;
+}
+
+/* Returns NULL if no memory is available */
+void *
+arena_alloc(struct file_arena_t *arena, size_t size)
+{
+	void *memory, *allocated;
+	size_t block_size;
+	struct arena_block_t *block;
+	assert(arena);
+	size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+	block = arena->blocks;
+	if (!block || block->size - block->used < size) {
+		/* Oversized requests get a block of their own */
+		block_size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+		if (posix_memalign(&allocated, ARENA_ALIGNMENT,
+					sizeof(struct arena_block_t) + block_size)) {
+			return NULL;
+		}
+		block = allocated;
+		block->used = 0;
+		block->size = block_size;
+		/* Keep the block with the most room at the front */
+		if (arena->blocks && size > ARENA_BLOCK_SIZE) {
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			block->next = arena->blocks;
+			arena->blocks = block;
+		}
+		arena->reserved += sizeof(struct arena_block_t) + block_size;
+	}
+	memory = block->data + block->used;
+	assert(((uintptr_t)(memory) & (ARENA_ALIGNMENT - 1)) == 0);
+	block->used += size;
+	arena->used += size;
+	return memory;
+}
+
+/* Copy a string (of at most length characters) into the arena */
+char *
+arena_strndup(struct file_arena_t *arena, const char *string, size_t length)
+{
+	char *copy;
+	length = strnlen(string, length);
+	copy = arena_alloc(arena, length + 1);
+	if (copy) {
+		memcpy(copy, string, length);
+		copy[length] = '\0';
+	}
+	return copy;
+}
+
+/* Hand every block of one arena to another (which then owns them) */
+void
+arena_merge(struct file_arena_t *arena, struct file_arena_t *other)
+{
+	struct arena_block_t *last;
+	assert(arena && other);
+	if (!other->blocks) {
+		return;
+	}
+	for (last = other->blocks; last->next; last = last->next);
+	/* Blocks that were in use stay behind the current front block */
+	if (arena->blocks) {
+		last->next = arena->blocks->next;
+		arena->blocks->next = other->blocks;
+	} else {
+		last->next = NULL;
+		arena->blocks = other->blocks;
+	}
+	arena->reserved += other->reserved;
+	arena->used += other->used;
+	clear_arena(other);
+}
+
+/* Free everything allocated from the arena at once */
+void
+destroy_arena(struct file_arena_t *arena)
+{
+	struct arena_block_t *block, *next;
+	assert(arena);
+	for (block = arena->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	clear_arena(arena);
+}
+
+/* The high-water mark of this process (in KiB), or zero if unknown */
+inline long
+peak_memory(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		return 0;
+	}
+	return usage.ru_maxrss;
+}
+
+#endif /* FILE_ARENA_H */
@@ -0,0 +1,312 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libcalg-1.0/libcalg/slist.h>
+
+#include <gdbm.h>
+
+#include "file_digest.h"
+#include "file_entry.h"
+#include "file_hash.h"
+#include "file_info.h"
+#include "file_log.h"
+
+#define CACHE_VERSION      3
+#define CACHE_DEFAULT_FILE "bloom_cache"
+/* Files changed this recently might change again within the same
+ * timestamp, so their digests are not trusted later (see cache_save) */
+#define CACHE_RACY_NSEC    ((int64_t)(2000000000))
+
+/* Digests are remembered across runs, keyed by what identifies a file
+ * and what changes whenever its contents do (all fixed-width fields) */
+struct cache_key_t
+{
+	uint64_t dev, ino, size;
+	int64_t mtime, ctime;
+};
+
+/* Files with a tree digest have the digests of their chunks appended,
+ * then every value ends with the (absolute) path the file was found at */
+struct cache_value_t
+{
+	uint32_t version, hashed, engine, path_length;
+	uint64_t shash;
+	/* When the last scan to see this file started */
+	int64_t scanned;
+	unsigned char hash[DIGEST_MAX_LENGTH];
+};
+
+inline void
+cache_key(const struct file_entry_t *file_entry, struct cache_key_t *key)
+{
+	memset(key, 0, sizeof(struct cache_key_t));
+	key->dev = (uint64_t)(file_entry->dev);
+	key->ino = (uint64_t)(file_entry->ino);
+	key->size = (uint64_t)(file_entry->size);
+	key->mtime = file_entry->mtime;
+	key->ctime = file_entry->ctime;
+}
+
+/* Fill in the digests of every file in a list whose metadata is
+ * unchanged (returns how many) */
+long
+cache_load_list(GDBM_FILE gdbmf, SListEntry **list)
+{
+	long reused = 0;
+	int leaves_offset = (int)(sizeof(struct cache_value_t)), leaves_length;
+	datum key, value;
+	SListIterator slist_iterator;
+	struct file_entry_t *file_entry;
+	struct cache_key_t cache_key_data;
+	struct cache_value_t cache_value;
+	key.dptr = (char *)(&cache_key_data);
+	key.dsize = sizeof(struct cache_key_t);
+	slist_iterate(list, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		file_entry = slist_iter_next(&slist_iterator);
+		cache_key(file_entry, &cache_key_data);
+		leaves_length = (int)(tree_num_chunks(file_entry->size) * digest_engine->length);
+		value = gdbm_fetch(gdbmf, key);
+		if (!value.dptr) {
+			continue;
+		}
+		if (value.dsize >= (int)(sizeof(struct cache_value_t))) {
+			memcpy(&cache_value, value.dptr, sizeof(struct cache_value_t));
+			if (cache_value.version == CACHE_VERSION && (cache_value.hashed & SHALLOW)) {
+				file_entry->shash = file_entry->sample = cache_value.shash;
+				file_entry->hashed |= SHALLOW;
+				/* Full digests only count if made by the same engine */
+				if ((cache_value.hashed & FULL)
+						&& cache_value.engine == (uint32_t)(digest_engine - digest_engines)) {
+					memcpy(file_entry->hash, cache_value.hash, DIGEST_MAX_LENGTH);
+					file_entry->hashed |= FULL;
+					if (value.dsize == leaves_offset + leaves_length
+								+ (int)(cache_value.path_length)
+							&& choose_strategy(file_entry->size) == HASH_TREE
+							&& tree_alloc(file_entry)) {
+						memcpy(file_entry->leaves, value.dptr + leaves_offset, leaves_length);
+					}
+				}
+				++reused;
+			}
+		}
+		free(value.dptr);
+	}
+	return reused;
+}
+
+/* Fill in the digests of every file whose metadata is unchanged, so that
+ * hash_entry can skip them (returns how many, or -1) */
+long
+cache_load(const char *cache_file, struct file_info_t *file_info)
+{
+	long reused;
+	GDBM_FILE gdbmf;
+	if (!cache_file || !file_info) {
+		return -1;
+	}
+	if (access(cache_file, F_OK)) {
+		return 0;
+	}
+	gdbmf = gdbm_open((char *)(cache_file), 0, GDBM_READER, 0, log_message);
+	if (!gdbmf) {
+		#ifndef NDEBUG
+		fprintf(stderr, "[ERROR] %s (open cache failed)\n", cache_file);
+		#endif
+		return -1;
+	}
+	reused = cache_load_list(gdbmf, &file_info->good_files)
+		+ cache_load_list(gdbmf, &file_info->unique_files);
+	gdbm_close(gdbmf);
+	return reused;
+}
+
+/* Store the digests of every file in a list (returns zero on failure) */
+int
+cache_store_list(GDBM_FILE gdbmf, SListEntry **list, const char *cwd, time_t started,
+		struct cache_value_t **cache_value, size_t *max_length)
+{
+	char path[PATH_MAX_LEN];
+	int path_length;
+	datum key, value;
+	SListIterator slist_iterator;
+	struct file_entry_t *file_entry;
+	struct cache_key_t cache_key_data;
+	size_t length, leaves_length;
+	int64_t racy = started * (int64_t)(1000000000) - CACHE_RACY_NSEC;
+	key.dptr = (char *)(&cache_key_data);
+	key.dsize = sizeof(struct cache_key_t);
+	slist_iterate(list, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		file_entry = slist_iter_next(&slist_iterator);
+		if (!(file_entry->hashed & SHALLOW) || file_entry->type != REGULAR
+				|| file_entry->mtime >= racy || file_entry->ctime >= racy
+				|| (path_length = absolute_path(cwd, entry_path(file_entry), path)) < 0) {
+			continue;
+		}
+		leaves_length = ((file_entry->hashed & FULL) && file_entry->leaves) ?
+			tree_num_chunks(file_entry->size) * digest_engine->length : 0;
+		length = sizeof(struct cache_value_t) + leaves_length + (size_t)(path_length) + 1;
+		/* Grow the value geometrically (it only needs to fit the largest) */
+		if (length > *max_length) {
+			free(*cache_value);
+			for (; *max_length < length; *max_length *= 2);
+			if (!(*cache_value = malloc(*max_length))) {
+				return 0;
+			}
+		}
+		cache_key(file_entry, &cache_key_data);
+		memset(*cache_value, 0, sizeof(struct cache_value_t));
+		(*cache_value)->version = CACHE_VERSION;
+		(*cache_value)->hashed = file_entry->hashed & (SHALLOW | FULL);
+		(*cache_value)->engine = (uint32_t)(digest_engine - digest_engines);
+		(*cache_value)->path_length = (uint32_t)(path_length) + 1;
+		(*cache_value)->shash = file_entry->shash;
+		(*cache_value)->scanned = (int64_t)(started);
+		if (file_entry->hashed & FULL) {
+			memcpy((*cache_value)->hash, file_entry->hash, DIGEST_MAX_LENGTH);
+		}
+		memcpy(*cache_value + 1, file_entry->leaves, leaves_length);
+		memcpy((unsigned char *)(*cache_value + 1) + leaves_length, path,
+				(size_t)(path_length) + 1);
+		value.dptr = (char *)(*cache_value);
+		value.dsize = (int)(length);
+		/* Hard links were collapsed (see collapse_links), so keys are unique */
+		if (gdbm_store(gdbmf, key, value, GDBM_REPLACE)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Whether a cached file is under one of the roots of this scan, but was
+ * not seen by it, and is no longer there as it was cached */
+int
+cache_stale(const struct cache_key_t *key, const char *path,
+		char **roots, size_t num_roots)
+{
+	size_t i, length;
+	struct cache_key_t current_key;
+	struct file_entry_t current;
+	for (i = 0; i < num_roots; ++i) {
+		length = strlen(roots[i]);
+		if (!strncmp(path, roots[i], length)
+				&& (path[length] == '/' || path[length] == '\0')) {
+			break;
+		}
+	}
+	if (i == num_roots) {
+		return 0;
+	}
+	memset(&current, 0, sizeof(struct file_entry_t));
+	if (stat_entry(path, &current) != REGULAR) {
+		return 1;
+	}
+	cache_key(&current, &current_key);
+	return memcmp(key, &current_key, sizeof(struct cache_key_t)) != 0;
+}
+
+/* Update the cache with the digests of this scan, in place, then drop
+ * the files under its roots that have since changed or gone away (and
+ * anything cached by another version); files elsewhere are left alone,
+ * so scans of different trees share one cache (returns zero on failure) */
+int
+cache_save(const char *cache_file, struct file_info_t *file_info, time_t started,
+		char **roots, size_t num_roots)
+{
+	int status, drop;
+	char cwd[PATH_MAX_LEN], **absolute;
+	GDBM_FILE gdbmf;
+	datum key, next, value, *stale = NULL, *grown;
+	struct cache_value_t *cache_value;
+	size_t i, num_stale = 0, max_stale = 0, max_length = sizeof(struct cache_value_t);
+	if (!cache_file || !file_info || !getcwd(cwd, PATH_MAX_LEN)) {
+		return 0;
+	}
+	absolute = calloc(num_roots + 1, sizeof(char *));
+	cache_value = malloc(max_length);
+	gdbmf = absolute && cache_value ?
+		gdbm_open((char *)(cache_file), 0, GDBM_WRCREAT, S_IRUSR | S_IWUSR, log_message)
+		: NULL;
+	if (!gdbmf) {
+		#ifndef NDEBUG
+		fprintf(stderr, "[ERROR] %s (open cache failed)\n", cache_file);
+		#endif
+		free(absolute);
+		free(cache_value);
+		return 0;
+	}
+	status = 1;
+	for (i = 0; i < num_roots; ++i) {
+		if (!(absolute[i] = malloc(PATH_MAX_LEN))) {
+			status = 0;
+		} else if (absolute_path(cwd, roots[i], absolute[i]) < 0) {
+			absolute[i][0] = '\0';
+		}
+	}
+	status = status && cache_store_list(gdbmf, &file_info->good_files, cwd, started,
+			&cache_value, &max_length)
+		&& cache_store_list(gdbmf, &file_info->unique_files, cwd, started,
+			&cache_value, &max_length);
+	/* Collect the stale keys first (deleting them would upset the walk) */
+	for (key = gdbm_firstkey(gdbmf); status && key.dptr; key = next) {
+		value = gdbm_fetch(gdbmf, key);
+		drop = 0;
+		if (value.dptr && value.dsize >= (int)(sizeof(struct cache_value_t))) {
+			memcpy(cache_value, value.dptr, sizeof(struct cache_value_t));
+			drop = cache_value->version != CACHE_VERSION
+				|| key.dsize != (int)(sizeof(struct cache_key_t))
+				|| (cache_value->scanned != (int64_t)(started)
+					&& cache_value->path_length > 0
+					&& (size_t)(value.dsize) >= sizeof(struct cache_value_t)
+						+ cache_value->path_length
+					&& cache_stale((const struct cache_key_t *)(key.dptr),
+						value.dptr + value.dsize - cache_value->path_length,
+						absolute, num_roots));
+		} else {
+			drop = 1;
+		}
+		free(value.dptr);
+		next = gdbm_nextkey(gdbmf, key);
+		if (drop && num_stale == max_stale) {
+			max_stale = max_stale ? 2 * max_stale : 64;
+			grown = realloc(stale, max_stale * sizeof(datum));
+			if (grown) {
+				stale = grown;
+			} else {
+				free(next.dptr);
+				next.dptr = NULL;
+				drop = status = 0;
+			}
+		}
+		if (drop) {
+			stale[num_stale++] = key;
+		} else {
+			free(key.dptr);
+		}
+	}
+	for (i = 0; i < num_stale; ++i) {
+		gdbm_delete(gdbmf, stale[i]);
+		free(stale[i].dptr);
+	}
+	#ifndef NDEBUG
+	printf("[DEBUG] Dropped %lu stale digests (cache)\n", (unsigned long)(num_stale));
+	#endif
+	free(stale);
+	for (i = 0; i < num_roots; ++i) {
+		free(absolute[i]);
+	}
+	free(absolute);
+	free(cache_value);
+	gdbm_close(gdbmf);
+	return status;
+}
+
+#endif /* FILE_CACHE_H */
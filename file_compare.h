@@ -0,0 +1,292 @@
+#ifndef FILE_COMPARE_H
+#define FILE_COMPARE_H
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "file_digest.h"
+#include "file_entry.h"
+#include "file_hash.h"
+#include "file_page.h"
+#include "file_table.h"
+
+/* Groups this small are compared directly instead of hashed: reading
+ * them in lockstep stops at the first chunk where they differ, and
+ * files that never do are hashed once, from the chunks they share */
+#define COMPARE_MAX_MEMBERS 3
+/* Chunks start small (most files that differ do so early), then grow */
+#define COMPARE_MIN_CHUNK   ((off_t)(0x4000))
+#define COMPARE_MAX_CHUNK   (HASH_WINDOW_SIZE / 4)
+
+/* Groups compared, members found to match, and bytes never read */
+size_t compare_groups, compare_matched, compare_skipped;
+
+/* Read one chunk of each open file into this thread's window (returns
+ * n, or the index of the first file that could not be read) */
+size_t
+compare_read(const int *fds, size_t n, off_t offset, off_t length)
+{
+	size_t i;
+	off_t resident;
+	unsigned char vector[COMPARE_MAX_CHUNK / 0x1000];
+	for (i = 0; i < n; ++i) {
+		resident = (page_mode == PAGE_NEUTRAL) ?
+			page_resident(fds[i], offset, length, vector) : -1;
+		if (read_fully(fds[i], hash_window + i * COMPARE_MAX_CHUNK, length) != length) {
+			return i;
+		}
+		if (page_mode == PAGE_NEUTRAL) {
+			page_account(length, resident);
+			if (resident >= 0) {
+				page_release(fds[i], offset, length, vector);
+			}
+		}
+	}
+	return n;
+}
+
+inline void
+compare_close(const int *fds, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		if (fds[i] >= 0) {
+			close_entry(fds[i]);
+		}
+	}
+}
+
+/* Compare a group of (at most three) files of the same size a chunk at
+ * a time, for as long as two of them agree; those that match to the
+ * end are given the digest of their contents, and marked VERIFIED, and
+ * the rest are left unhashed (returns how many matched, or -1 if some
+ * file could not be read, in which case hashing will report it) */
+int
+compare_group(struct file_entry_t **members, size_t n)
+{
+	size_t i, j, num_active;
+	int fds[COMPARE_MAX_MEMBERS], equal[COMPARE_MAX_MEMBERS];
+	struct file_entry_t *active[COMPARE_MAX_MEMBERS];
+	off_t offset, length, chunk = COMPARE_MIN_CHUNK, size;
+	unsigned char *leaves = NULL;
+	if (n < 2 || n > COMPARE_MAX_MEMBERS || !ensure_window()) {
+		return -1;
+	}
+	if (!hash_context) {
+		hash_context = EVP_MD_CTX_new();
+	}
+	if (!hash_context
+			|| !EVP_DigestInit_ex(hash_context, (*digest_engine->evp)(), NULL)) {
+		return -1;
+	}
+	for (i = 0; i < n; ++i) {
+		fds[i] = -1;
+	}
+	for (i = 0; i < n; ++i) {
+		if ((fds[i] = open_entry(members[i], O_RDONLY)) < 0) {
+			compare_close(fds, n);
+			return -1;
+		}
+		active[i] = members[i];
+	}
+	stats_count(STATS_FILES, n);
+	num_active = n;
+	size = members[0]->size;
+	/* Huge files get the same tree digest that hashing would give them */
+	if (choose_strategy(size) == HASH_TREE
+			&& !(leaves = malloc(tree_num_chunks(size) * digest_engine->length))) {
+		compare_close(fds, n);
+		return -1;
+	}
+	for (offset = 0; offset < size; offset += length) {
+		length = (size - offset < chunk) ? size - offset : chunk;
+		if (compare_read(fds, num_active, offset, length) != num_active) {
+			compare_close(fds, num_active);
+			free(leaves);
+			return -1;
+		}
+		/* Keep whichever files still agree with another (with three
+		 * members at most, these can only ever be one set) */
+		for (i = 0; i < num_active; ++i) {
+			equal[i] = 0;
+		}
+		for (i = 0; i < num_active; ++i) {
+			for (j = i + 1; j < num_active; ++j) {
+				if (!memcmp(hash_window + i * COMPARE_MAX_CHUNK,
+							hash_window + j * COMPARE_MAX_CHUNK, length)) {
+					equal[i] = equal[j] = 1;
+				}
+			}
+		}
+		for (i = j = 0; i < num_active; ++i) {
+			if (!equal[i]) {
+				close_entry(fds[i]);
+				continue;
+			}
+			/* Chunks follow their files (so the first is still shared) */
+			if (i != j) {
+				memcpy(hash_window + j * COMPARE_MAX_CHUNK,
+						hash_window + i * COMPARE_MAX_CHUNK, length);
+			}
+			active[j] = active[i];
+			fds[j++] = fds[i];
+		}
+		__sync_fetch_and_add(&compare_skipped,
+				(size_t)((num_active - j) * (size - offset - length)));
+		num_active = j;
+		if (num_active < 2) {
+			compare_close(fds, num_active);
+			__sync_fetch_and_add(&compare_skipped,
+					(size_t)(num_active * (size - offset - length)));
+			__sync_fetch_and_add(&compare_groups, 1);
+			free(leaves);
+			return 0;
+		}
+		if (leaves) {
+			tree_update(leaves, size, offset, hash_window, length);
+		} else {
+			EVP_DigestUpdate(hash_context, hash_window, length);
+		}
+		if (chunk < COMPARE_MAX_CHUNK) {
+			chunk *= 2;
+		}
+	}
+	compare_close(fds, num_active);
+	if (leaves ? !tree_root(leaves, size, active[0]->hash)
+			: !EVP_DigestFinal_ex(hash_context, active[0]->hash, NULL)) {
+		free(leaves);
+		return -1;
+	}
+	for (i = 0; i < num_active; ++i) {
+		if (i > 0) {
+			memcpy(active[i]->hash, active[0]->hash, DIGEST_MAX_LENGTH);
+		}
+		/* Each keeps its own copy of the chunks' digests */
+		if (leaves) {
+			free(active[i]->leaves);
+			if (i + 1 == num_active) {
+				active[i]->leaves = leaves;
+			} else if ((active[i]->leaves = malloc(tree_num_chunks(size)
+							* digest_engine->length))) {
+				memcpy(active[i]->leaves, leaves, tree_num_chunks(size) * digest_engine->length);
+			}
+		}
+		active[i]->hashed |= FULL | VERIFIED;
+	}
+	__sync_fetch_and_add(&compare_groups, 1);
+	__sync_fetch_and_add(&compare_matched, num_active);
+	return (int)(num_active);
+}
+
+#define COMPARE_LHS_FAILED (-1)
+#define COMPARE_RHS_FAILED (-2)
+
+/* Compare two files of the same size byte for byte (returns one if
+ * they are equal, zero if not, and COMPARE_LHS_FAILED or _RHS_FAILED
+ * for whichever could not be read; the window must already exist) */
+int
+compare_files(const struct file_entry_t *lhs, const struct file_entry_t *rhs)
+{
+	int fds[2], status = 1;
+	size_t num_read;
+	off_t offset, length, size = lhs->size;
+	if (lhs->size != rhs->size) {
+		return 0;
+	}
+	assert(hash_window);
+	if ((fds[0] = open_entry(lhs, O_RDONLY)) < 0) {
+		return COMPARE_LHS_FAILED;
+	}
+	if ((fds[1] = open_entry(rhs, O_RDONLY)) < 0) {
+		compare_close(fds, 1);
+		return COMPARE_RHS_FAILED;
+	}
+	for (offset = 0; status == 1 && offset < size; offset += length) {
+		length = (size - offset < COMPARE_MAX_CHUNK) ? size - offset : COMPARE_MAX_CHUNK;
+		num_read = compare_read(fds, 2, offset, length);
+		if (num_read < 2) {
+			status = (num_read == 0) ? COMPARE_LHS_FAILED : COMPARE_RHS_FAILED;
+		} else if (memcmp(hash_window, hash_window + COMPARE_MAX_CHUNK, length)) {
+			status = 0;
+		}
+	}
+	compare_close(fds, 2);
+	return status;
+}
+
+/* Unlink a member from its set, with a warning (a file that cannot be
+ * read is no longer taken to be regular, so nothing else relies on it) */
+void
+verify_drop(struct file_group_t *group, struct file_entry_t **member, int unreadable)
+{
+	struct file_entry_t *file_entry = *member;
+	fprintf(stderr, "[WARNING] '%s' (%s)\n", entry_path(file_entry),
+			unreadable ? "read failed" : "digest collision");
+	if (unreadable && file_entry->type == REGULAR) {
+		file_entry->type = INVALID;
+	}
+	file_entry->hashed &= ~(FULL | VERIFIED);
+	*member = file_entry->duplicate;
+	--group->num_members;
+}
+
+/* Compare every member of each set of duplicates (unless compare_group
+ * has already) to the first, so that a digest collision cannot pass for
+ * a duplicate; members that differ, or cannot be read, are dropped from
+ * the set, with a warning; if the first cannot be read, the next member
+ * takes its place (those already compared matched it, so each other) and
+ * the rest are compared to that (returns how many, or -1 on failure) */
+long
+verify_groups(struct file_shards_t *shards)
+{
+	size_t i, num_groups;
+	long dropped = 0;
+	struct file_group_t **groups;
+	struct file_entry_t *first, **next;
+	if (!shards || !ensure_window() || !(groups = shards_groups(shards, &num_groups))) {
+		return -1;
+	}
+	for (i = 0; i < num_groups; ++i) {
+		stats_count(STATS_FILES, groups[i]->num_members);
+		first = groups[i]->members;
+		for (next = &first->duplicate; *next; ) {
+			/* Files verified together had the same size and samples */
+			if ((*next)->hashed & first->hashed & VERIFIED
+					&& (*next)->size == first->size
+					&& (*next)->sample == first->sample) {
+				next = &(*next)->duplicate;
+				continue;
+			}
+			switch (compare_files(first, *next)) {
+			case 1:
+				next = &(*next)->duplicate;
+				break;
+			case 0:
+				verify_drop(groups[i], next, 0);
+				++dropped;
+				break;
+			case COMPARE_RHS_FAILED:
+				verify_drop(groups[i], next, 1);
+				++dropped;
+				break;
+			default:
+				verify_drop(groups[i], &groups[i]->members, 1);
+				++dropped;
+				if (next == &first->duplicate) {
+					next = &groups[i]->members->duplicate;
+				}
+				first = groups[i]->members;
+				break;
+			}
+		}
+	}
+	free(groups);
+	release_hash_window();
+	return dropped;
+}
+
+#endif /* FILE_COMPARE_H */
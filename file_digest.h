@@ -0,0 +1,147 @@
+#ifndef FILE_DIGEST_H
+#define FILE_DIGEST_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+/* Large enough for any of the engines below */
+#define DIGEST_MAX_LENGTH 32
+
+/* Prefilter stages use a fast, non-cryptographic 64-bit hash
+ * (XXH64), while the final stage uses one of these engines */
+struct digest_engine_t
+{
+	const char *name;
+	size_t length;
+	const EVP_MD *(*evp)(void);
+};
+
+const struct digest_engine_t digest_engines[] = {
+	{ "md5",     16, &EVP_md5       },
+	{ "sha256",  32, &EVP_sha256    },
+	{ "blake2s", 32, &EVP_blake2s256 },
+	{ NULL,       0, NULL           }
+};
+
+/* The engine used for full hashes (selected once, before hashing) */
+const struct digest_engine_t *digest_engine = &digest_engines[0];
+
+/* Returns zero if there is no engine by that name */
+inline int
+select_digest(const char *name)
+{
+	const struct digest_engine_t *engine;
+	for (engine = digest_engines; engine->name; ++engine) {
+		if (!strcmp(engine->name, name)) {
+			digest_engine = engine;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Hex is only needed for display (digests are kept in binary) */
+inline char *
+format_digest(char *buffer, const unsigned char *digest, size_t length)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+	for (i = 0; i < length; ++i) {
+		buffer[2 * i] = hex[digest[i] >> 4];
+		buffer[2 * i + 1] = hex[digest[i] & 0xF];
+	}
+	buffer[2 * length] = '\0';
+	return buffer;
+}
+
+/* XXH64 (see https://github.com/Cyan4973/xxHash) */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+inline uint64_t
+xxh_read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint32_t
+xxh_read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint64_t
+xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = XXH_ROTL64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+inline uint64_t
+xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* Chain calls by passing the previous result as the seed */
+uint64_t
+xxh64(const unsigned char *p, size_t length, uint64_t seed)
+{
+	uint64_t h, v1, v2, v3, v4;
+	const unsigned char *end = p + length, *limit;
+	if (length >= 32) {
+		limit = end - 32;
+		v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		v2 = seed + XXH_PRIME64_2;
+		v3 = seed;
+		v4 = seed - XXH_PRIME64_1;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p)); p += 8;
+			v2 = xxh_round(v2, xxh_read64(p)); p += 8;
+			v3 = xxh_round(v3, xxh_read64(p)); p += 8;
+			v4 = xxh_round(v4, xxh_read64(p)); p += 8;
+		} while (p <= limit);
+		h = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7)
+			+ XXH_ROTL64(v3, 12) + XXH_ROTL64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+	h += (uint64_t)(length);
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)(xxh_read32(p)) * XXH_PRIME64_1;
+		h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		h ^= (*p) * XXH_PRIME64_5;
+		h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+#endif /* FILE_DIGEST_H */
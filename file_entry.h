@@ -1,9 +1,18 @@
 #ifndef FILE_ENTRY_H
 #define FILE_ENTRY_H
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "file_digest.h"
+#include "file_stats.h"
+
 #define PATH_MAX_LEN 0x7FF7
 #define DEFAULT_SIZE (off_t)(-1)
 
@@ -17,64 +26,160 @@ enum file_entry_type_t
 	OTHER        = 0x8
 };
 
-/* A file entry consists of a path, a hash of the file
- * (potentially a full or short hash) and its type */
+/* A file entry consists of a name (within its parent), a hash of the
+ * file (potentially a full or short hash) and its type; digests are
+ * stored inline, and hashed marks which are valid */
 struct file_entry_t
 {
-	char *path, *hash, *shash;
+	/* The directory this was found in (NULL for paths given to us) */
+	struct file_entry_t *parent;
+	/* The next member of its group (see file_table.h) */
+	struct file_entry_t *duplicate;
+	/* The next path to the same file, if hard linked (see collapse_links) */
+	struct file_entry_t *link;
 	enum file_entry_type_t type;
 	off_t size;
+	/* Identity, and modification and change times (in nanoseconds) */
+	dev_t dev;
+	ino_t ino;
+	int64_t mtime, ctime;
+	unsigned int hashed;
+	/* Short hash, and the chain of any sampling stages after it */
+	uint64_t shash, sample;
+	unsigned char hash[DIGEST_MAX_LENGTH];
+	/* The digest of each chunk, for files with a tree digest (see
+	 * hash_tree), or NULL */
+	unsigned char *leaves;
+	/* The last part of the path (or all of it, without a parent) */
+	char name[];
 };
 
+/* Paths are rebuilt from the names of every ancestor when needed */
+static __thread char entry_path_buffer[PATH_MAX_LEN];
+
+/* Write the full path of an entry into a buffer of PATH_MAX_LEN
+ * (returns its length, or zero if the path would not fit) */
+size_t
+build_path(const struct file_entry_t *file_entry, char *buffer)
+{
+	size_t length, offset, total;
+	const struct file_entry_t *e;
+	/* Measure first, then fill the buffer back to front */
+	for (total = 0, e = file_entry; e; e = e->parent) {
+		total += strnlen(e->name, PATH_MAX_LEN) + (e->parent ? 1 : 0);
+		if (total >= PATH_MAX_LEN) {
+			buffer[0] = '\0';
+			return 0;
+		}
+	}
+	buffer[offset = total] = '\0';
+	for (e = file_entry; e; e = e->parent) {
+		length = strlen(e->name);
+		offset -= length;
+		memcpy(buffer + offset, e->name, length);
+		if (e->parent) {
+			buffer[--offset] = '/';
+		}
+	}
+	return total;
+}
+
+/* The absolute form of a path (without trailing slashes), written into
+ * a buffer of PATH_MAX_LEN (returns its length, or -1 if too long) */
+int
+absolute_path(const char *cwd, const char *path, char *buffer)
+{
+	int length = snprintf(buffer, PATH_MAX_LEN, "%s%s%s",
+			(path[0] == '/') ? "" : cwd, (path[0] == '/') ? "" : "/", path);
+	if (length < 0 || length >= PATH_MAX_LEN) {
+		return -1;
+	}
+	for (; length > 0 && buffer[length - 1] == '/'; --length);
+	buffer[length] = '\0';
+	return length;
+}
+
+/* The full path of an entry, for display (valid until the next call
+ * from this thread, so use build_path for more than one at a time) */
+static inline const char *
+entry_path(const struct file_entry_t *file_entry)
+{
+	build_path(file_entry, entry_path_buffer);
+	return entry_path_buffer;
+}
+
+/* Fill in a (cleared, see new_entry) entry for the name in a directory
+ * (or AT_FDCWD); d_type (from readdir, or DT_UNKNOWN) can spare the
+ * stat entirely, and whether a file is readable is only learned once
+ * it is opened (see hash_entry) */
 inline enum file_entry_type_t
-stat_entry(const char *path, struct file_entry_t *file_entry)
+stat_entry_at(int dirfd, const char *name, unsigned char d_type,
+		struct file_entry_t *file_entry)
 {
-	size_t path_len;
-	struct stat status;
 	enum file_entry_type_t type;
-	/* stat the file at this path */
-	if (!path || lstat(path, &status)) {
+	#ifdef STATX_TYPE
+	struct statx status;
+	#else
+	struct stat status;
+	#endif
+	/* Only regular files (and those readdir cannot tell) are looked up */
+	if (name && (d_type == DT_UNKNOWN || d_type == DT_REG)) {
+		stats_count(STATS_SYSCALLS, 1);
+	}
+	if (!name) {
+		type = INVALID;
+	} else if (d_type == DT_DIR) {
+		type = DIRECTORY;
+	} else if (d_type != DT_UNKNOWN && d_type != DT_REG) {
+		type = OTHER;
+	#ifdef STATX_TYPE
+	/* One call, for only the fields we use, without walking the path */
+	} else if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW,
+				STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME | STATX_CTIME,
+				&status)) {
+		type = INVALID;
+	} else if (S_ISREG(status.stx_mode)) {
+		type = REGULAR;
+		if (file_entry) {
+			file_entry->size = status.stx_size;
+			file_entry->dev = makedev(status.stx_dev_major, status.stx_dev_minor);
+			file_entry->ino = status.stx_ino;
+			file_entry->mtime = status.stx_mtime.tv_sec * (int64_t)(1000000000)
+				+ status.stx_mtime.tv_nsec;
+			file_entry->ctime = status.stx_ctime.tv_sec * (int64_t)(1000000000)
+				+ status.stx_ctime.tv_nsec;
+		}
+	} else {
+		type = S_ISDIR(status.stx_mode) ? DIRECTORY : OTHER;
+	}
+	#else
+	} else if (fstatat(dirfd, name, &status, AT_SYMLINK_NOFOLLOW)) {
 		type = INVALID;
-	} else if (access(path, R_OK)) {
-		type = INACCESSIBLE;
 	} else if (S_ISREG(status.st_mode)) {
 		type = REGULAR;
-	} else if (S_ISDIR(status.st_mode)) {
-		type = DIRECTORY;
+		if (file_entry) {
+			file_entry->size = status.st_size;
+			file_entry->dev = status.st_dev;
+			file_entry->ino = status.st_ino;
+			file_entry->mtime = status.st_mtim.tv_sec * (int64_t)(1000000000)
+				+ status.st_mtim.tv_nsec;
+			file_entry->ctime = status.st_ctim.tv_sec * (int64_t)(1000000000)
+				+ status.st_ctim.tv_nsec;
+		}
 	} else {
-		type = OTHER;
+		type = S_ISDIR(status.st_mode) ? DIRECTORY : OTHER;
 	}
-	/* If appropriate, fill in the entry */
+	#endif
 	if (file_entry) {
-		memset(file_entry, 0, sizeof(struct file_entry_t));
-		file_entry->hash = file_entry->shash = NULL;
-		file_entry->size = (type == REGULAR) ? status.st_size : (DEFAULT_SIZE);
 		file_entry->type = type;
-		if (path) {
-			/* Assure ourselves that the path is terminal */
-			path_len = strnlen(path, PATH_MAX_LEN) + 1;
-			file_entry->path = malloc(path_len * sizeof(char));
-			memset(file_entry->path, '\0', path_len * sizeof(char));
-			memcpy(file_entry->path, path, path_len * sizeof(char));
-		}
 	}
 	return type;
 }
 
-inline void
-destroy_entry(struct file_entry_t *file_entry)
+inline enum file_entry_type_t
+stat_entry(const char *path, struct file_entry_t *file_entry)
 {
-	/* Free all dynamically-allocated memory in this entry */
-	if (file_entry) {
-		if (file_entry->hash) {
-			free(file_entry->hash);
-		}
-		if (file_entry->shash) {
-			free(file_entry->shash);
-		}
-		free(file_entry->path);
-		free(file_entry);
-	}
+	return stat_entry_at(AT_FDCWD, path, DT_UNKNOWN, file_entry);
 }
 
 #endif /* FILE_ENTRY_H */
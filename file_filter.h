@@ -0,0 +1,342 @@
+#ifndef FILE_FILTER_H
+#define FILE_FILTER_H
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILTER_X86
+#include <immintrin.h>
+#endif
+
+/* A blocked Bloom filter: each key sets (and tests) one bit in every
+ * 32-bit lane of a single 64-byte block, so a query touches one cache
+ * line; keys are shallow hashes, whose bits are already well mixed */
+#define FILTER_LANES      16
+#define FILTER_BLOCK_SIZE (FILTER_LANES * sizeof(uint32_t))
+#define FILTER_BLOCK_BITS (8 * FILTER_BLOCK_SIZE)
+#define FILTER_PREFETCH   16
+#define FILTER_BATCH_SIZE 64
+
+struct file_filter_t
+{
+	uint32_t *blocks;
+	size_t num_blocks;
+};
+
+/* Odd multipliers, one per lane (each maps a key to a bit) */
+static const uint32_t filter_salts[FILTER_LANES] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+	0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU,
+	0x165667b1U, 0xd3a2646dU, 0xfd7046c5U, 0xb55a4f09U
+};
+
+/* The high half of a key picks the block, the low half the bits */
+inline uint32_t *
+filter_block(const struct file_filter_t *filter, uint64_t key)
+{
+	return filter->blocks + FILTER_LANES
+		* (size_t)(((key >> 32) * (uint64_t)(filter->num_blocks)) >> 32);
+}
+
+int
+filter_test_scalar(const uint32_t *block, uint32_t key)
+{
+	size_t i;
+	for (i = 0; i < FILTER_LANES; ++i) {
+		if (!(block[i] & ((uint32_t)(1) << ((key * filter_salts[i]) >> 27)))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#ifdef FILTER_X86
+__attribute__((target("sse4.1"))) int
+filter_test_sse41(const uint32_t *block, uint32_t key)
+{
+	size_t i;
+	__m128i bits, mask, keys = _mm_set1_epi32((int)(key));
+	for (i = 0; i < FILTER_LANES; i += 4) {
+		bits = _mm_srli_epi32(_mm_mullo_epi32(keys,
+					_mm_loadu_si128((const __m128i *)(filter_salts + i))), 27);
+		/* There is no variable shift, so build 2^bits as a float
+		 * (2^31 converts to 0x80000000, which happens to be right) */
+		mask = _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(
+					_mm_add_epi32(bits, _mm_set1_epi32(127)), 23)));
+		if (!_mm_testc_si128(_mm_load_si128((const __m128i *)(block + i)), mask)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+__attribute__((target("avx2"))) int
+filter_test_avx2(const uint32_t *block, uint32_t key)
+{
+	__m256i keys = _mm256_set1_epi32((int)(key)), one = _mm256_set1_epi32(1);
+	__m256i lo = _mm256_sllv_epi32(one, _mm256_srli_epi32(_mm256_mullo_epi32(keys,
+				_mm256_loadu_si256((const __m256i *)(filter_salts))), 27));
+	__m256i hi = _mm256_sllv_epi32(one, _mm256_srli_epi32(_mm256_mullo_epi32(keys,
+				_mm256_loadu_si256((const __m256i *)(filter_salts + 8))), 27));
+	return _mm256_testc_si256(_mm256_load_si256((const __m256i *)(block)), lo)
+		&& _mm256_testc_si256(_mm256_load_si256((const __m256i *)(block + 8)), hi);
+}
+#endif
+
+/* Queries use the widest version this processor supports */
+int (*filter_test)(const uint32_t *, uint32_t) = &filter_test_scalar;
+
+inline void
+filter_select(void)
+{
+	#ifdef FILTER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		filter_test = &filter_test_avx2;
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		filter_test = &filter_test_sse41;
+	}
+	#endif
+}
+
+/* Expected false-positive rate of a filter with this many bits, once it
+ * holds n keys; each block's load is (roughly) Poisson distributed */
+double
+filter_false_positive(size_t num_bits, size_t n)
+{
+	size_t j;
+	double load, term, rate = 0.0;
+	if (num_bits < FILTER_BLOCK_BITS) {
+		return 1.0;
+	}
+	load = (double)(n) * FILTER_BLOCK_BITS / num_bits;
+	/* Sum over the number of keys, j, that share a block */
+	for (j = 0, term = exp(-load); j < 1000 && (j < load || term > 1e-12); ++j) {
+		rate += term * pow(1.0 - pow(1.0 - 1.0 / 32, (double)(j)), FILTER_LANES);
+		term *= load / (j + 1);
+	}
+	return rate;
+}
+
+/* Bits for n keys at this false-positive rate: a blocked filter needs
+ * more than a classic one, since keys crowd into some blocks more than
+ * others; so start from the classic size, then grow by an eighth until
+ * the rate is met */
+size_t
+filter_bits(size_t n, double rate)
+{
+	size_t num_bits = ceil(-log(rate) / log(2.0)) * n;
+	while (filter_false_positive(num_bits, n) > rate) {
+		num_bits += num_bits / 8 + FILTER_BLOCK_BITS;
+	}
+	return num_bits;
+}
+
+/* Returns NULL if no memory is available (rounds up to whole blocks) */
+struct file_filter_t *
+filter_new(size_t num_bits)
+{
+	void *blocks;
+	struct file_filter_t *filter = malloc(sizeof(struct file_filter_t));
+	if (!filter) {
+		return NULL;
+	}
+	filter->num_blocks = (num_bits + FILTER_BLOCK_BITS - 1) / FILTER_BLOCK_BITS;
+	if (filter->num_blocks == 0) {
+		filter->num_blocks = 1;
+	}
+	if (posix_memalign(&blocks, FILTER_BLOCK_SIZE, filter->num_blocks * FILTER_BLOCK_SIZE)) {
+		free(filter);
+		return NULL;
+	}
+	filter->blocks = blocks;
+	memset(filter->blocks, 0, filter->num_blocks * FILTER_BLOCK_SIZE);
+	filter_select();
+	return filter;
+}
+
+inline void
+filter_free(struct file_filter_t *filter)
+{
+	free(filter->blocks);
+	free(filter);
+}
+
+/* Keys are (binary) shallow hashes */
+inline uint64_t
+filter_key(const unsigned char *key)
+{
+	uint64_t value;
+	memcpy(&value, key, sizeof(uint64_t));
+	return value;
+}
+
+void
+filter_insert(struct file_filter_t *filter, const unsigned char *key)
+{
+	size_t i;
+	uint64_t value = filter_key(key);
+	uint32_t *block = filter_block(filter, value);
+	for (i = 0; i < FILTER_LANES; ++i) {
+		block[i] |= (uint32_t)(1) << (((uint32_t)(value) * filter_salts[i]) >> 27);
+	}
+}
+
+inline int
+filter_query(const struct file_filter_t *filter, const unsigned char *key)
+{
+	uint64_t value = filter_key(key);
+	return (*filter_test)(filter_block(filter, value), (uint32_t)(value));
+}
+
+/* Query many keys at once, fetching blocks well ahead of testing them,
+ * so that the cache misses overlap (results are zero or one per key) */
+void
+filter_query_batch(const struct file_filter_t *filter,
+		const uint64_t *keys, size_t n, unsigned char *results)
+{
+	size_t i;
+	for (i = 0; i < n && i < FILTER_PREFETCH; ++i) {
+		__builtin_prefetch(filter_block(filter, keys[i]));
+	}
+	for (i = 0; i < n; ++i) {
+		if (i + FILTER_PREFETCH < n) {
+			__builtin_prefetch(filter_block(filter, keys[i + FILTER_PREFETCH]));
+		}
+		results[i] = (unsigned char)((*filter_test)(
+				filter_block(filter, keys[i]), (uint32_t)(keys[i])));
+	}
+}
+
+/* Filters are persisted as their raw blocks */
+inline size_t
+filter_size(const struct file_filter_t *filter)
+{
+	return filter->num_blocks * FILTER_BLOCK_SIZE;
+}
+
+inline void
+filter_read(const struct file_filter_t *filter, unsigned char *buffer)
+{
+	memcpy(buffer, filter->blocks, filter_size(filter));
+}
+
+/* Load at most length bytes (returns zero if the sizes differ) */
+inline int
+filter_load(struct file_filter_t *filter, const unsigned char *buffer, size_t length)
+{
+	size_t size = filter_size(filter);
+	memcpy(filter->blocks, buffer, (length < size) ? length : size);
+	return length == size;
+}
+
+/* A scalable filter, for when the number of keys is not known up front:
+ * once a slice holds as many keys as it was sized for, another (twice as
+ * large, at half the rate) is added, so the rates sum to less than twice
+ * the first, and nothing is ever rebuilt; a key is in the filter if it is
+ * in any slice (the largest are tested first, as they hold the most) */
+#define SCALABLE_GROWTH     2
+#define SCALABLE_TIGHTENING 0.5
+#define SCALABLE_MAX_SLICES 32
+
+struct file_scalable_t
+{
+	struct file_filter_t *slices[SCALABLE_MAX_SLICES];
+	size_t num_slices;
+	/* Keys the newest slice was sized for, and keys it holds */
+	size_t capacity, count;
+	/* The newest slice's false-positive rate */
+	double rate;
+};
+
+/* Add a slice (returns zero, and leaves the filter as it was, if no
+ * memory is available, or it already has SCALABLE_MAX_SLICES) */
+int
+scalable_grow(struct file_scalable_t *filter)
+{
+	struct file_filter_t *slice;
+	size_t capacity = filter->capacity;
+	double rate = filter->rate;
+	if (filter->num_slices == SCALABLE_MAX_SLICES) {
+		return 0;
+	}
+	if (filter->num_slices > 0) {
+		capacity *= SCALABLE_GROWTH;
+		rate *= SCALABLE_TIGHTENING;
+	}
+	slice = filter_new(filter_bits(capacity, rate));
+	if (!slice) {
+		return 0;
+	}
+	filter->slices[filter->num_slices++] = slice;
+	filter->capacity = capacity;
+	filter->rate = rate;
+	filter->count = 0;
+	return 1;
+}
+
+/* Sized for n keys at first, and for a false-positive rate of at most
+ * rate overall (returns zero if no memory is available) */
+int
+scalable_init(struct file_scalable_t *filter, size_t n, double rate)
+{
+	memset(filter, 0, sizeof(struct file_scalable_t));
+	filter->capacity = n ? n : 1;
+	filter->rate = rate * (1.0 - SCALABLE_TIGHTENING);
+	return scalable_grow(filter);
+}
+
+void
+scalable_destroy(struct file_scalable_t *filter)
+{
+	size_t i;
+	for (i = 0; i < filter->num_slices; ++i) {
+		filter_free(filter->slices[i]);
+	}
+	memset(filter, 0, sizeof(struct file_scalable_t));
+}
+
+/* Returns zero if a slice was needed, but none could be added (the key
+ * is then added to the newest slice, though it is full, so it is still
+ * found, but the rate overall is no longer kept; another slice is tried
+ * for with each key after that) */
+int
+scalable_insert(struct file_scalable_t *filter, const unsigned char *key)
+{
+	int grown = 1;
+	if (filter->count >= filter->capacity) {
+		grown = scalable_grow(filter);
+	}
+	filter_insert(filter->slices[filter->num_slices - 1], key);
+	++filter->count;
+	return grown;
+}
+
+inline int
+scalable_query(const struct file_scalable_t *filter, const unsigned char *key)
+{
+	size_t i;
+	for (i = filter->num_slices; i > 0; --i) {
+		if (filter_query(filter->slices[i - 1], key)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Bytes of every slice */
+inline size_t
+scalable_size(const struct file_scalable_t *filter)
+{
+	size_t i, size = 0;
+	for (i = 0; i < filter->num_slices; ++i) {
+		size += filter_size(filter->slices[i]);
+	}
+	return size;
+}
+
+#endif /* FILE_FILTER_H */
@@ -1,130 +1,567 @@
 #ifndef FILE_HASH_H
 #define FILE_HASH_H
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 
-#include <openssl/md5.h>
+#include <openssl/evp.h>
 
+#include "file_digest.h"
 #include "file_entry.h"
 #include "file_info.h"
+#include "file_page.h"
 
+/* Sampling stages (HEAD, TAIL, SAMPLE) sit between SHALLOW and FULL:
+ * each one reads a little more of the file than the last; VERIFIED
+ * marks a full hash whose group was also compared byte for byte */
 enum hash_depth_t {
-	NONE    = 0x0,
-	SHALLOW = 0x1,
-	FULL    = 0x2
+	NONE     = 0x0,
+	SHALLOW  = 0x1,
+	FULL     = 0x2,
+	HEAD     = 0x4,
+	TAIL     = 0x8,
+	SAMPLE   = 0x10,
+	VERIFIED = 0x20
 };
 
-char *
-hash_entry(struct file_entry_t *file_entry, enum hash_depth_t depth)
+/* How the contents of a file were read for a full hash:
+ * small files are read whole into a reused buffer,
+ * medium files are mapped, and large files are streamed
+ * through the same buffer (so memory use stays bounded);
+ * huge files are split into chunks, hashed in parallel */
+enum hash_strategy_t {
+	HASH_READ   = 0x0,
+	HASH_MAP    = 0x1,
+	HASH_STREAM = 0x2,
+	HASH_TREE   = 0x3,
+	HASH_STRATEGIES
+};
+
+#define HASH_WINDOW_SIZE  ((off_t)(0x100000))
+/* Windows are aligned for O_DIRECT (see hash_contents) */
+#define HASH_WINDOW_ALIGN ((size_t)(0x1000))
+#define HASH_MAP_LIMIT    ((off_t)(0x4000000))
+/* Files this large get a tree digest: the digest of the digests of each
+ * chunk (each chunk is mapped, and chunks are hashed independently) */
+#define TREE_CHUNK_SIZE   HASH_MAP_LIMIT
+#define TREE_MIN_SIZE     (4 * TREE_CHUNK_SIZE)
+
+#define SHALLOW_SIZE      ((off_t)(16))
+#define SAMPLE_MAX_SIZE   HASH_WINDOW_SIZE
+#define SAMPLE_POINTS     4
+#define SAMPLE_POINT_SIZE ((off_t)(0x1000))
+
+/* Bytes read from each end of a file by the HEAD and TAIL stages */
+off_t sample_size = (off_t)(0x10000);
+
+/* Number of full hashes computed using each strategy */
+size_t hash_strategy_count[HASH_STRATEGIES];
+
+/* Each thread reads into its own window (allocated on first use),
+ * and reuses its own digest context */
+static __thread unsigned char *hash_window = NULL;
+static __thread EVP_MD_CTX *hash_context = NULL;
+
+/* Each thread also keeps its last parent directory open, since its
+ * jobs are (mostly) siblings, and opens entries relative to it */
+static __thread const struct file_entry_t *open_parent = NULL;
+static __thread int open_parent_fd = -1;
+
+static inline void
+release_hash_window(void)
 {
-	int fd;
-	off_t pivot;
-	char *hash_storage = NULL;
-	unsigned char hash_buffer[MD5_DIGEST_LENGTH], *file_buffer;
-	if (!file_entry || (fd = open(file_entry->path, O_RDONLY)) < 0) {
-		#ifndef NDEBUG
-		fprintf(stderr, "[ERROR] '%s' (open failed)\n", file_entry->path);
+	free(hash_window);
+	hash_window = NULL;
+	EVP_MD_CTX_free(hash_context);
+	hash_context = NULL;
+	if (open_parent_fd >= 0) {
+		close(open_parent_fd);
+		stats_count(STATS_SYSCALLS, 1);
+	}
+	open_parent = NULL;
+	open_parent_fd = -1;
+}
+
+/* Allocate this thread's window, if it has none yet */
+static inline int
+ensure_window(void)
+{
+	void *window;
+	if (!hash_window) {
+		if (posix_memalign(&window, HASH_WINDOW_ALIGN, HASH_WINDOW_SIZE)) {
+			return 0;
+		}
+		hash_window = window;
+	}
+	return 1;
+}
+
+/* Open an entry relative to its parent (sets errno on failure) */
+int
+open_entry(const struct file_entry_t *file_entry, int flags)
+{
+	stats_count(STATS_SYSCALLS, 1);
+	if (!file_entry->parent) {
+		return open(file_entry->name, flags);
+	}
+	if (file_entry->parent != open_parent) {
+		if (open_parent_fd >= 0) {
+			close(open_parent_fd);
+			stats_count(STATS_SYSCALLS, 1);
+		}
+		open_parent = NULL;
+		open_parent_fd = -1;
+		if (!build_path(file_entry->parent, entry_path_buffer)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		#ifdef O_PATH
+		open_parent_fd = open(entry_path_buffer, O_PATH | O_DIRECTORY);
+		#else
+		open_parent_fd = open(entry_path_buffer, O_RDONLY | O_DIRECTORY);
 		#endif
-		return NULL;
+		stats_count(STATS_SYSCALLS, 1);
+		if (open_parent_fd < 0) {
+			return -1;
+		}
+		open_parent = file_entry->parent;
 	}
+	return openat(open_parent_fd, file_entry->name, flags);
+}
 
-	switch (depth) {
-		/* A shallow hash reads only the first part of the file */
-		case SHALLOW:
-			/* Entries should not be hashed twice */
-			if (file_entry->shash) { break; }
-			/* Read a small part of the file and compute the hash of that */
-			file_buffer = malloc(MD5_DIGEST_LENGTH);
-			if (!file_buffer) {
-				#ifndef NDEBUG
-				fprintf(stderr, "[ERROR] '%s' (buffer failed)\n", file_entry->path);
-				#endif
-				break;
-			}
-			memset(file_buffer, 0, MD5_DIGEST_LENGTH);
-			pivot = (file_entry->size < MD5_DIGEST_LENGTH) ?
-				file_entry->size : MD5_DIGEST_LENGTH;
-			if (read(fd, file_buffer, MD5_DIGEST_LENGTH) < pivot) {
-				#ifndef NDEBUG
-				fprintf(stderr, "[ERROR] '%s' (read failed)\n", file_entry->path);
-				#endif
-				break;
-			}
-			MD5(file_buffer, MD5_DIGEST_LENGTH, hash_buffer);
-			free(file_buffer);
-			hash_storage = file_entry->shash = malloc(2 * MD5_DIGEST_LENGTH + 1);
-			break;
+inline enum hash_strategy_t
+choose_strategy(off_t size)
+{
+	if (size >= TREE_MIN_SIZE) {
+		return HASH_TREE;
+	}
+	if (size <= HASH_WINDOW_SIZE) {
+		return HASH_READ;
+	}
+	return (size <= HASH_MAP_LIMIT) ? HASH_MAP : HASH_STREAM;
+}
 
-		/* A full hash is computed for the entire file */
-		case FULL:
-			/* Entries should not be hashed twice */
-			if (file_entry->hash) { break; }
-			/* FIXME make it only mmap files of appropriate size */
-			file_buffer = mmap(NULL, file_entry->size, PROT_READ, MAP_SHARED, fd, 0);
-			if (file_buffer == (MAP_FAILED)) {
-				#ifndef NDEBUG
-				fprintf(stderr, "[ERROR] '%s' (map failed)\n", file_entry->path);
-				#endif
-				break;
-			}
-			MD5(file_buffer, file_entry->size, hash_buffer);
-			if (munmap(file_buffer, file_entry->size)) {
-				#ifndef NDEBUG
-				fprintf(stderr, "[WARNING] '%s' (unmap failed)\n", file_entry->path);
-				#endif
-			}
-			hash_storage = file_entry->hash = malloc(2 * MD5_DIGEST_LENGTH + 1);
+/* Close a file that was opened to be read (as counted by open_entry) */
+inline int
+close_entry(int fd)
+{
+	stats_count(STATS_SYSCALLS, 1);
+	return close(fd);
+}
+
+/* Move to an offset in a file (returns zero on failure) */
+inline int
+seek_entry(int fd, off_t offset)
+{
+	stats_count(STATS_SYSCALLS, 1);
+	return lseek(fd, offset, SEEK_SET) == offset;
+}
+
+/* Read until the buffer is full, or the file ends (returns bytes read) */
+ssize_t
+read_fully(int fd, unsigned char *buffer, size_t length)
+{
+	ssize_t n = 0;
+	size_t calls = 0, total = 0;
+	while (total < length) {
+		n = read(fd, buffer + total, length - total);
+		++calls;
+		if (n <= 0) {
 			break;
+		}
+		total += n;
+	}
+	stats_count(STATS_SYSCALLS, calls);
+	stats_count(STATS_BYTES, total);
+	return (n < 0) ? (ssize_t)(-1) : (ssize_t)(total);
+}
 
-		default:
-			#ifndef NDEBUG
-			fprintf(stderr, "[WARNING] '%X' (unknown depth)\n", depth);
-			#endif
+/* Where one read of a stage lands in a file: HEAD and TAIL read once,
+ * SAMPLE spreads a few small reads evenly across it, and SHALLOW reads
+ * only the first few bytes (returns zero past the last read) */
+inline int
+sample_span(const struct file_entry_t *file_entry, enum hash_depth_t depth,
+		int point, off_t *offset, off_t *length)
+{
+	off_t size = file_entry->size;
+	switch (depth) {
+	case SHALLOW:
+		*offset = 0;
+		*length = (size < SHALLOW_SIZE) ? size : SHALLOW_SIZE;
+		return point == 0;
+	case HEAD:
+	case TAIL:
+		*length = (size < sample_size) ? size : sample_size;
+		*offset = (depth == HEAD) ? 0 : size - *length;
+		return point == 0;
+	case SAMPLE:
+		*offset = size / (SAMPLE_POINTS + 1) * (point + 1);
+		*length = (size - *offset < SAMPLE_POINT_SIZE) ?
+			size - *offset : SAMPLE_POINT_SIZE;
+		return point < SAMPLE_POINTS;
+	default:
+		return 0;
+	}
+}
+
+/* Fold one read of a stage into the entry (see sample_span) */
+inline void
+sample_update(struct file_entry_t *file_entry, enum hash_depth_t depth,
+		const unsigned char *buffer, off_t length)
+{
+	if (depth == SHALLOW) {
+		file_entry->shash = xxh64(buffer, length, 0);
+		/* Sampling stages refine the shallow hash */
+		file_entry->sample = file_entry->shash;
+	} else {
+		file_entry->sample = xxh64(buffer, length, file_entry->sample);
+	}
+}
+
+/* Read as read_fully does, from a file opened with O_DIRECT: each
+ * request is a whole number of blocks, so only the last can be short */
+ssize_t
+read_direct(int fd, unsigned char *buffer, size_t length)
+{
+	ssize_t n = 0;
+	size_t request, calls = 0, total = 0;
+	while (total < length) {
+		request = (length - total + HASH_WINDOW_ALIGN - 1) & ~(HASH_WINDOW_ALIGN - 1);
+		n = read(fd, buffer + total, request);
+		++calls;
+		if (n < 0) {
+			break;
+		}
+		total += n;
+		if ((size_t)(n) < request) {
 			break;
+		}
+	}
+	stats_count(STATS_SYSCALLS, calls);
+	stats_count(STATS_BYTES, total);
+	if (n < 0) {
+		return (ssize_t)(-1);
 	}
+	return (ssize_t)((total < length) ? total : length);
+}
 
-	/* Close the file */
-	if (close(fd)) {
-	#ifndef NDEBUG
-		fprintf(stderr, "[WARNING] '%s' (close failed)\n", file_entry->path);
+/* Stop the page cache from keeping a file we are about to stream (this
+ * can fail, on file systems without O_DIRECT; returns zero if so) */
+inline int
+bypass_cache(int fd)
+{
+	#ifdef O_DIRECT
+	int flags = fcntl(fd, F_GETFL);
+	stats_count(STATS_SYSCALLS, (flags < 0) ? 1 : 2);
+	return flags >= 0 && !fcntl(fd, F_SETFL, flags | O_DIRECT);
+	#else
+	(void)(fd);
+	return 0;
 	#endif
-	}
+}
 
-	/* Convert the hash to ASCII */
-	if (hash_storage) {
-		for (pivot = 0; pivot < MD5_DIGEST_LENGTH; ++pivot) {
-			snprintf(hash_storage, 3, "%02x", hash_buffer[pivot]);
-			++hash_storage; ++hash_storage;
+/* Hash part of a file into the entry's sample digest, which chains
+ * the digests of any earlier stages (returns zero on failure) */
+int
+hash_sample(int fd, struct file_entry_t *file_entry, enum hash_depth_t depth)
+{
+	int point;
+	off_t offset, length;
+	uint64_t sample = file_entry->sample;
+	if (!ensure_window()) {
+		return 0;
+	}
+	page_sample(fd);
+	for (point = 0; sample_span(file_entry, depth, point, &offset, &length); ++point) {
+		/* Files are opened for each stage, so the first read needs no seek */
+		if (((point > 0 || offset > 0) && !seek_entry(fd, offset))
+				|| read_fully(fd, hash_window, length) != length) {
+			/* Leave no partial chain behind */
+			file_entry->sample = sample;
+			return 0;
 		}
-		return (depth == FULL) ? file_entry->hash : file_entry->shash;
+		sample_update(file_entry, depth, hash_window, length);
 	}
-	return NULL;
+	return point > 0;
 }
 
-DIR *
-traverse(struct file_info_t *file_info, DIR *directory, char *buffer, size_t offset) 
+/* Compute the digest of part of a file, or all of it, which starts at
+ * a page boundary (returns zero on failure); see page_mode for how this
+ * treats the page cache */
+int
+hash_contents(int fd, off_t start, off_t size, unsigned char *hash_buffer)
 {
-	size_t d_name_len;
-	struct dirent *dir_entry;
-	/* Try to open up a directory handle */
-	if (directory) {
-		/* For each entry in the directory */
-		while ((dir_entry = readdir(directory))) {
-			/* Fill in the file name */
-			memset(buffer + offset, '\0', PATH_MAX_LEN - offset);
-			d_name_len = strnlen(dir_entry->d_name, PATH_MAX_LEN - offset);
-			/* Avoid overflows, and ignore dotfiles */
-			if (offset + d_name_len == PATH_MAX_LEN || dir_entry->d_name[0] == '.') {
-				continue;
+	int direct = 0;
+	ssize_t n;
+	off_t offset, window, resident = -1;
+	unsigned char *file_buffer;
+	enum hash_strategy_t strategy = choose_strategy(size);
+	if (strategy == HASH_TREE || (strategy != HASH_MAP && !ensure_window())) {
+		return 0;
+	}
+	if (!hash_context) {
+		hash_context = EVP_MD_CTX_new();
+	}
+	if (!hash_context
+			|| !EVP_DigestInit_ex(hash_context, (*digest_engine->evp)(), NULL)) {
+		return 0;
+	}
+	/* Note which pages were cached, so that only the others are dropped */
+	if (page_mode == PAGE_NEUTRAL && strategy != HASH_STREAM) {
+		resident = page_resident(fd, start, size, page_vector);
+		page_account(size, resident);
+	}
+	/* Files are opened for each hash, so reading from the start needs no seek */
+	if (strategy != HASH_MAP && start > 0 && !seek_entry(fd, start)) {
+		return 0;
+	}
+	switch (strategy) {
+	case HASH_READ:
+		if (read_fully(fd, hash_window, size) != size) {
+			return 0;
+		}
+		EVP_DigestUpdate(hash_context, hash_window, size);
+		break;
+	case HASH_MAP:
+		file_buffer = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, start);
+		stats_count(STATS_SYSCALLS, 1);
+		if (file_buffer == (MAP_FAILED)) {
+			return 0;
+		}
+		/* Advice and unmapping (every byte mapped is read) */
+		stats_count(STATS_SYSCALLS, 2);
+		stats_count(STATS_BYTES, size);
+		madvise(file_buffer, size, MADV_SEQUENTIAL);
+		EVP_DigestUpdate(hash_context, file_buffer, size);
+		if (munmap(file_buffer, size)) {
+			#ifndef NDEBUG
+			fprintf(stderr, "[WARNING] '%d' (unmap failed)\n", fd);
+			#endif
+		}
+		break;
+	case HASH_STREAM:
+		/* Large files skip the cache entirely, if they can */
+		if (page_mode == PAGE_NEUTRAL && !(direct = bypass_cache(fd))) {
+			posix_fadvise(fd, start, size, POSIX_FADV_SEQUENTIAL);
+			stats_count(STATS_SYSCALLS, 1);
+		}
+		for (offset = start; offset < start + size; offset += window) {
+			window = (start + size - offset < HASH_WINDOW_SIZE) ?
+				start + size - offset : HASH_WINDOW_SIZE;
+			if (page_mode == PAGE_NEUTRAL) {
+				resident = direct ? 0 : page_resident(fd, offset, window, page_vector);
+				page_account(window, resident);
 			}
-			/* Construct the full path; it will be terminated */
-			memcpy(buffer + offset, dir_entry->d_name, d_name_len);
-			if (!record(buffer, file_info)) {
-				return directory;
+			n = direct ? read_direct(fd, hash_window, window)
+				: read_fully(fd, hash_window, window);
+			if (n != window) {
+				return 0;
 			}
+			EVP_DigestUpdate(hash_context, hash_window, window);
+			if (page_mode == PAGE_NEUTRAL && !direct && resident >= 0) {
+				page_release(fd, offset, window, page_vector);
+			}
+		}
+		resident = -1;
+		break;
+	default:
+		return 0;
+	}
+	if (resident >= 0) {
+		page_release(fd, start, size, page_vector);
+	}
+	return EVP_DigestFinal_ex(hash_context, hash_buffer, NULL);
+}
+
+inline size_t
+tree_num_chunks(off_t size)
+{
+	return (size_t)((size + TREE_CHUNK_SIZE - 1) / TREE_CHUNK_SIZE);
+}
+
+/* Make room for the digest of each chunk of a file (kept with its entry
+ * once hashed, so the cache can keep them too; returns zero on failure) */
+inline int
+tree_alloc(struct file_entry_t *file_entry)
+{
+	if (!file_entry->leaves) {
+		file_entry->leaves = malloc(tree_num_chunks(file_entry->size) * digest_engine->length);
+	}
+	return file_entry->leaves != NULL;
+}
+
+/* Hash one chunk of a file, opening it for just that (so that any number
+ * of threads can hash chunks of the same file at once) */
+int
+tree_hash_chunk(struct file_entry_t *file_entry, size_t chunk)
+{
+	int fd, status;
+	off_t start = (off_t)(chunk) * TREE_CHUNK_SIZE;
+	off_t size = (file_entry->size - start < TREE_CHUNK_SIZE) ?
+		file_entry->size - start : TREE_CHUNK_SIZE;
+	if ((fd = open_entry(file_entry, O_RDONLY)) < 0) {
+		return 0;
+	}
+	status = hash_contents(fd, start, size,
+			file_entry->leaves + chunk * digest_engine->length);
+	close_entry(fd);
+	return status;
+}
+
+/* Fold part of a file, read in order, into the digests of its chunks
+ * (this thread's context holds the digest of the unfinished chunk) */
+void
+tree_update(unsigned char *leaves, off_t size, off_t offset,
+		const unsigned char *buffer, off_t length)
+{
+	off_t n;
+	while (length > 0) {
+		n = TREE_CHUNK_SIZE - offset % TREE_CHUNK_SIZE;
+		if (n > length) {
+			n = length;
+		}
+		EVP_DigestUpdate(hash_context, buffer, n);
+		offset += n;
+		buffer += n;
+		length -= n;
+		if (offset % TREE_CHUNK_SIZE == 0 || offset == size) {
+			EVP_DigestFinal_ex(hash_context,
+					leaves + (offset - 1) / TREE_CHUNK_SIZE * digest_engine->length, NULL);
+			EVP_DigestInit_ex(hash_context, (*digest_engine->evp)(), NULL);
 		}
 	}
-	return NULL;
+}
+
+/* The digest of a tree is that of its chunks' digests, in order */
+static inline int
+tree_root(const unsigned char *leaves, off_t size, unsigned char *hash_buffer)
+{
+	if (!hash_context) {
+		hash_context = EVP_MD_CTX_new();
+	}
+	return hash_context
+		&& EVP_DigestInit_ex(hash_context, (*digest_engine->evp)(), NULL)
+		&& EVP_DigestUpdate(hash_context, leaves, tree_num_chunks(size) * digest_engine->length)
+		&& EVP_DigestFinal_ex(hash_context, hash_buffer, NULL);
+}
+
+/* Compute the tree digest of a file one chunk after another (see
+ * pool_run, which spreads the chunks of huge files across workers) */
+int
+hash_tree(int fd, struct file_entry_t *file_entry)
+{
+	size_t chunk, num_chunks = tree_num_chunks(file_entry->size);
+	off_t start, size;
+	if (!tree_alloc(file_entry)) {
+		return 0;
+	}
+	for (chunk = 0; chunk < num_chunks; ++chunk) {
+		start = (off_t)(chunk) * TREE_CHUNK_SIZE;
+		size = (file_entry->size - start < TREE_CHUNK_SIZE) ?
+			file_entry->size - start : TREE_CHUNK_SIZE;
+		if (!hash_contents(fd, start, size,
+					file_entry->leaves + chunk * digest_engine->length)) {
+			return 0;
+		}
+	}
+	return tree_root(file_entry->leaves, file_entry->size, file_entry->hash);
+}
+
+/* Whether an entry still has to be read to hash it at this depth */
+inline int
+hash_pending(struct file_entry_t *file_entry, enum hash_depth_t depth)
+{
+	/* Once the head covers the whole file, later stages learn nothing */
+	if ((depth & (TAIL | SAMPLE)) && (file_entry->hashed & HEAD)
+			&& file_entry->size <= sample_size) {
+		file_entry->hashed |= depth;
+	}
+	/* Nor is there any point in sampling a file whose full hash is known
+	 * (it came from the cache); see pool_prune, which keeps such files */
+	if ((depth & (HEAD | TAIL | SAMPLE)) && (file_entry->hashed & FULL)) {
+		return 0;
+	}
+	return !(file_entry->hashed & depth);
+}
+
+/* Start reading a file that is about to be fully hashed (in the
+ * background), counting what was cached already */
+void
+prefetch_entry(const struct file_entry_t *file_entry)
+{
+	int fd = open_entry(file_entry, O_RDONLY);
+	if (fd >= 0) {
+		page_prefetch(fd, file_entry->size);
+		close_entry(fd);
+	}
+}
+
+/* Returns the (binary) digest of the entry at this depth, or NULL;
+ * SHALLOW and sampling stages yield a uint64_t, FULL yields
+ * digest_engine->length bytes */
+unsigned char *
+hash_entry(struct file_entry_t *file_entry, enum hash_depth_t depth)
+{
+	int fd, status = 0;
+	if (!file_entry) {
+		return NULL;
+	}
+	/* Entries should not be hashed twice */
+	if (hash_pending(file_entry, depth)) {
+		/* This is where we learn whether the file is readable */
+		if ((fd = open_entry(file_entry, O_RDONLY)) < 0) {
+			#ifndef NDEBUG
+			fprintf(stderr, "[ERROR] '%s' (open failed)\n", entry_path(file_entry));
+			#endif
+			file_entry->type = (errno == EACCES) ? INACCESSIBLE : INVALID;
+			return NULL;
+		}
+		switch (depth) {
+			/* A full hash is computed for the entire file */
+			case FULL:
+				status = (choose_strategy(file_entry->size) == HASH_TREE) ?
+					hash_tree(fd, file_entry)
+					: hash_contents(fd, 0, file_entry->size, file_entry->hash);
+				if (status) {
+					__sync_fetch_and_add(&hash_strategy_count[choose_strategy(file_entry->size)], 1);
+				}
+				break;
+			/* A shallow hash reads only the first part of the file */
+			case SHALLOW:
+			case HEAD:
+			case TAIL:
+			case SAMPLE:
+				status = hash_sample(fd, file_entry, depth);
+				break;
+			default:
+				#ifndef NDEBUG
+				fprintf(stderr, "[WARNING] '%X' (unknown depth)\n", depth);
+				#endif
+				break;
+		}
+		/* Close the file */
+		if (close_entry(fd)) {
+			#ifndef NDEBUG
+			fprintf(stderr, "[WARNING] '%s' (close failed)\n", entry_path(file_entry));
+			#endif
+		}
+		if (!status) {
+			#ifndef NDEBUG
+			fprintf(stderr, "[ERROR] '%s' (read failed)\n", entry_path(file_entry));
+			#endif
+			return NULL;
+		}
+		file_entry->hashed |= depth;
+		stats_count(STATS_FILES, 1);
+	}
+	switch (depth) {
+	case SHALLOW:
+		return (unsigned char *)(&file_entry->shash);
+	case FULL:
+		return file_entry->hash;
+	default:
+		return (unsigned char *)(&file_entry->sample);
+	}
 }
 
 #endif /* FILE_HASH_H */
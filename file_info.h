@@ -3,29 +3,59 @@
 #include <assert.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include <libcalg-1.0/libcalg/bloom-filter.h>
-#include <libcalg-1.0/libcalg/hash-string.h>
-#include <libcalg-1.0/libcalg/set.h>
 #include <libcalg-1.0/libcalg/slist.h>
-#include <libcalg-1.0/libcalg/trie.h>
 
+#include "file_arena.h"
 #include "file_entry.h"
+#include "file_filter.h"
+#include "file_table.h"
 
 typedef unsigned int bloom_size_t;
 
 struct file_info_t
 {
 	/* Store which files we will index */
-	SListEntry *file_stack, *bad_files, *good_files, *duplicates;
-	/* Store an index of the hashes */
-	Trie *hash_trie, *shash_trie;
+	SListEntry *file_stack, *bad_files, *good_files;
+	/* Store files that cannot have duplicates (unique size) */
+	SListEntry *unique_files;
+	/* Store the first path to each hard linked file (the rest are
+	 * chained to it, and hashed along with it) */
+	SListEntry *linked_files;
+	/* Store an index of the hashes (full hashes group duplicates, while
+	 * shallow hashes only map to the first file seen with each) */
+	struct file_shards_t *hash_shards;
+	struct file_table_t *shash_table;
 	bloom_size_t table_size;
-	BloomFilter *shash_filter;
+	struct file_filter_t *shash_filter;
 	/* Store statistical metadata */
 	size_t total_files, invalid_files, protected_files, irregular_files;
+	size_t unique_files_count, linked_files_count;
+	/* Owns every entry (and path) of this session */
+	struct file_arena_t arena;
 };
 
+/* Allocate a cleared entry (named within its parent, if any) from an
+ * arena, or from the heap if arena is NULL (the caller then frees it);
+ * returns NULL if no memory is available */
+struct file_entry_t *
+new_entry(struct file_arena_t *arena, struct file_entry_t *parent,
+		const char *name, size_t length)
+{
+	struct file_entry_t *file_entry;
+	file_entry = arena ? arena_alloc(arena, sizeof(struct file_entry_t) + length + 1)
+		: malloc(sizeof(struct file_entry_t) + length + 1);
+	if (file_entry) {
+		memset(file_entry, 0, sizeof(struct file_entry_t));
+		file_entry->parent = parent;
+		file_entry->size = DEFAULT_SIZE;
+		memcpy(file_entry->name, name, length);
+		file_entry->name[length] = '\0';
+	}
+	return file_entry;
+}
+
 /* Returns an entry if the path could be recorded */
 struct file_entry_t *
 record(const char *file_path, struct file_info_t *file_info)
@@ -33,12 +63,13 @@ record(const char *file_path, struct file_info_t *file_info)
 	struct file_entry_t *file_entry = NULL;
 	/* Require both parts to be valid */
 	if (file_path && file_info) {
-		/* This will be freed when the lists are destroyed */
-		file_entry = malloc(sizeof(struct file_entry_t));
+		/* This will be freed along with the arena */
+		file_entry = new_entry(&file_info->arena, NULL,
+				file_path, strnlen(file_path, PATH_MAX_LEN - 1));
 		/* Catch any storage issues at this stage */
 		if (file_entry) {
 			/* Check that this path is valid (fill the entry) */
-			stat_entry(file_path, file_entry);
+			stat_entry(file_entry->name, file_entry);
 			switch (file_entry->type) {
 			case DIRECTORY:
 				/* Directories go on the stack instead */
@@ -61,6 +92,58 @@ record(const char *file_path, struct file_info_t *file_info)
 
 /* Utilities */
 
+/* Paths compare as strings, but siblings only need their names */
+static __thread char compare_buffer[2][PATH_MAX_LEN];
+
+int
+compare_paths(const void *lhs, const void *rhs)
+{
+	const struct file_entry_t *l = *(struct file_entry_t * const *)(lhs);
+	const struct file_entry_t *r = *(struct file_entry_t * const *)(rhs);
+	if (l->parent == r->parent) {
+		return strncmp(l->name, r->name, PATH_MAX_LEN);
+	}
+	build_path(l, compare_buffer[0]);
+	build_path(r, compare_buffer[1]);
+	return strncmp(compare_buffer[0], compare_buffer[1], PATH_MAX_LEN);
+}
+
+/* Sort a list of entries in place (returns zero on failure) */
+int
+sort_list(SListEntry **list, int (*compare)(const void *, const void *))
+{
+	size_t i, n;
+	SListEntry *e;
+	struct file_entry_t **entries;
+	n = slist_length(*list);
+	if (n < 2) {
+		return 1;
+	}
+	entries = malloc(n * sizeof(struct file_entry_t *));
+	if (!entries) {
+		return 0;
+	}
+	for (i = 0, e = *list; e; e = slist_next(e)) {
+		entries[i++] = slist_data(e);
+	}
+	qsort(entries, n, sizeof(struct file_entry_t *), compare);
+	/* Rebuild the list back to front */
+	slist_free(*list);
+	*list = NULL;
+	for (i = n; i > 0; --i) {
+		if (!slist_prepend(list, entries[i - 1])) {
+			/* Keep what is left, so that it can still be freed */
+			while (--i > 0) {
+				slist_prepend(list, entries[i - 1]);
+			}
+			free(entries);
+			return 0;
+		}
+	}
+	free(entries);
+	return 1;
+}
+
 inline void
 clear_info(struct file_info_t *file_info)
 {
@@ -68,26 +151,18 @@ clear_info(struct file_info_t *file_info)
 	file_info->file_stack =
 	file_info->bad_files =
 	file_info->good_files = 
-	file_info->duplicates = NULL;
-	file_info->hash_trie =
-	file_info->shash_trie = NULL;
+	file_info->unique_files =
+	file_info->linked_files = NULL;
+	file_info->hash_shards = NULL;
+	file_info->shash_table = NULL;
 	file_info->shash_filter = NULL;
 	file_info->total_files =
 	file_info->invalid_files =
 	file_info->protected_files =
-	file_info->irregular_files = 0;
-}
-
-inline void
-free_file_entry(void *file_entry)
-{
-	destroy_entry((struct file_entry_t *)(file_entry));
-}
-
-inline void
-free_hash_set(void *set)
-{
-	set_free((Set *)(set));
+	file_info->irregular_files =
+	file_info->unique_files_count =
+	file_info->linked_files_count = 0;
+	clear_arena(&file_info->arena);
 }
 
 inline void
@@ -107,23 +182,37 @@ destroy_list(SListEntry *list_entry, void (*destructor)(void *))
 void
 destroy_info(struct file_info_t *file_info)
 {
+	SListIterator slist_iterator;
+	struct file_entry_t *file_entry;
 	assert(file_info);
 	/* Purge table data */
-	if (file_info->hash_trie) {
-		trie_free(file_info->hash_trie);
+	if (file_info->hash_shards) {
+		shards_free(file_info->hash_shards);
 	}
-	if (file_info->shash_trie) {
-		trie_free(file_info->shash_trie);
+	if (file_info->shash_table) {
+		table_free(file_info->shash_table);
 	}
 	if (file_info->shash_filter) {
-		bloom_filter_free(file_info->shash_filter);
-	}
-	/* Purge duplicate lists */
-	destroy_list(file_info->duplicates, &free_hash_set);
-	/* Purge file data */
-	destroy_list(file_info->file_stack, &free_file_entry);
-	destroy_list(file_info->bad_files, &free_file_entry);
-	destroy_list(file_info->good_files, &free_file_entry);
+		filter_free(file_info->shash_filter);
+	}
+	/* Purge file data (the entries go with the arena, in bulk, except
+	 * for the digests of their chunks; unique files are indexed too) */
+	slist_iterate(&file_info->good_files, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		file_entry = slist_iter_next(&slist_iterator);
+		free(file_entry->leaves);
+	}
+	slist_iterate(&file_info->unique_files, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		file_entry = slist_iter_next(&slist_iterator);
+		free(file_entry->leaves);
+	}
+	slist_free(file_info->file_stack);
+	slist_free(file_info->bad_files);
+	slist_free(file_info->good_files);
+	slist_free(file_info->unique_files);
+	slist_free(file_info->linked_files);
+	destroy_arena(&file_info->arena);
 	/* Purge session data */
 	clear_info(file_info);
 }
@@ -145,6 +234,162 @@ num_files(const struct file_info_t *file_info)
 	return file_info->total_files - errors;
 }
 
+/* Files that may have duplicates (i.e. those that need hashing) */
+inline size_t
+num_candidates(const struct file_info_t *file_info)
+{
+	size_t files = num_files(file_info);
+	assert(file_info->unique_files_count + file_info->linked_files_count <= files);
+	return files - file_info->unique_files_count - file_info->linked_files_count;
+}
+
+#define LINK_OTHER 1
+#define LINK_FIRST 2
+
+/* Where an entry was in the good list, so that ties keep that order */
+struct file_link_t
+{
+	struct file_entry_t *file_entry;
+	size_t position;
+};
+
+int
+compare_inodes(const void *lhs, const void *rhs)
+{
+	const struct file_link_t *l = (const struct file_link_t *)(lhs);
+	const struct file_link_t *r = (const struct file_link_t *)(rhs);
+	if (l->file_entry->dev != r->file_entry->dev) {
+		return (l->file_entry->dev > r->file_entry->dev) ? 1 : -1;
+	}
+	if (l->file_entry->ino != r->file_entry->ino) {
+		return (l->file_entry->ino > r->file_entry->ino) ? 1 : -1;
+	}
+	return (l->position > r->position) - (l->position < r->position);
+}
+
+/* Chain every path to the same file (device and inode) to the first
+ * one in the good list, and take the rest out of it, so that each file
+ * is hashed (and reported as a duplicate) once; the first paths are
+ * kept in linked_files, in order (returns zero on failure) */
+int
+collapse_links(struct file_info_t *file_info)
+{
+	size_t i, j, n;
+	unsigned char *linked;
+	SListIterator slist_iterator;
+	struct file_link_t *links;
+	struct file_entry_t *file_entry;
+	assert(file_info);
+	n = slist_length(file_info->good_files);
+	if (n < 2) {
+		return 1;
+	}
+	links = malloc(n * sizeof(struct file_link_t));
+	linked = calloc(n, sizeof(unsigned char));
+	if (!links || !linked) {
+		free(links);
+		free(linked);
+		return 0;
+	}
+	i = 0;
+	slist_iterate(&file_info->good_files, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		links[i].file_entry = slist_iter_next(&slist_iterator);
+		links[i].position = i;
+		++i;
+	}
+	/* Bucket the files by inode, in list order within each bucket */
+	qsort(links, n, sizeof(struct file_link_t), &compare_inodes);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n
+				&& links[j].file_entry->dev == links[i].file_entry->dev
+				&& links[j].file_entry->ino == links[i].file_entry->ino; ++j) {
+			links[j - 1].file_entry->link = links[j].file_entry;
+			linked[links[j].position] = LINK_OTHER;
+		}
+		if (j - i > 1) {
+			file_info->linked_files_count += j - i - 1;
+			linked[links[i].position] = LINK_FIRST;
+		}
+	}
+	free(links);
+	/* Keep the first path of each, and remember those with links */
+	i = 0;
+	slist_iterate(&file_info->good_files, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		file_entry = slist_iter_next(&slist_iterator);
+		switch (linked[i++]) {
+		case LINK_OTHER:
+			slist_iter_remove(&slist_iterator);
+			break;
+		case LINK_FIRST:
+			if (!slist_prepend(&file_info->linked_files, file_entry)) {
+				free(linked);
+				return 0;
+			}
+			break;
+		}
+	}
+	free(linked);
+	/* These were prepended, so put them back in order */
+	return sort_list(&file_info->linked_files, &compare_paths);
+}
+
+int
+compare_sizes(const void *lhs, const void *rhs)
+{
+	off_t l = *(const off_t *)(lhs), r = *(const off_t *)(rhs);
+	return (l > r) - (l < r);
+}
+
+/* Move files with a unique size out of the good list, since two files
+ * of different sizes cannot be duplicates (returns zero on failure) */
+int
+prune_sizes(struct file_info_t *file_info)
+{
+	off_t *sizes, *match;
+	size_t i, n;
+	SListIterator slist_iterator;
+	struct file_entry_t *file_entry;
+	assert(file_info);
+	n = slist_length(file_info->good_files);
+	if (n == 0) {
+		return 1;
+	}
+	/* Bucket the sizes by sorting them */
+	sizes = malloc(n * sizeof(off_t));
+	if (!sizes) {
+		return 0;
+	}
+	i = 0;
+	slist_iterate(&file_info->good_files, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		file_entry = slist_iter_next(&slist_iterator);
+		sizes[i++] = file_entry->size;
+	}
+	qsort(sizes, n, sizeof(off_t), &compare_sizes);
+	/* Singleton buckets have no equal neighbor */
+	slist_iterate(&file_info->good_files, &slist_iterator);
+	while (slist_iter_has_more(&slist_iterator)) {
+		file_entry = slist_iter_next(&slist_iterator);
+		match = bsearch(&file_entry->size, sizes, n, sizeof(off_t), &compare_sizes);
+		assert(match);
+		i = match - sizes;
+		if ((i > 0 && sizes[i - 1] == *match)
+				|| (i + 1 < n && sizes[i + 1] == *match)) {
+			continue;
+		}
+		if (!slist_prepend(&file_info->unique_files, file_entry)) {
+			free(sizes);
+			return 0;
+		}
+		slist_iter_remove(&slist_iterator);
+		++file_info->unique_files_count;
+	}
+	free(sizes);
+	return 1;
+}
+
 /* Problem size, n, determines:
  * size of optimal filter, m
  * optimal number of hash functions, k
@@ -169,23 +414,29 @@ num_files(const struct file_info_t *file_info)
  * One million elements would require < 2.3 MB.
  */
 
+/* Bits for n keys at the rate p (see filter_bits) */
+inline size_t
+optimal_bits(size_t n)
+{
+	return filter_bits(n, PR_FP);
+}
+
 inline void
 optimize_filter(struct file_info_t *file_info)
 {
-	double k = -log(PR_FP);
 	/* Ensure preconditions */
-	assert(file_info && k >= 1.0);
+	assert(file_info && -log(PR_FP) >= 1.0);
 	if (file_info->shash_filter) {
-		bloom_filter_free(file_info->shash_filter);
+		filter_free(file_info->shash_filter);
 	}
-	/* these filter parameters minimize false-positives */
-	file_info->table_size = ceil(k / LN2) * num_files(file_info);
-	/* ignore all case, since we are storing hashes */
-	file_info->shash_filter = bloom_filter_new(
-			file_info->table_size, string_nocase_hash, ceil(k));
+	/* these filter parameters minimize false-positives; keys are
+	 * (binary) shallow hashes */
+	file_info->shash_filter = filter_new(optimal_bits(num_candidates(file_info)));
+	file_info->table_size = file_info->shash_filter ?
+		(bloom_size_t)(8 * filter_size(file_info->shash_filter)) : 0;
 	#ifndef NDEBUG
-	printf("[DEBUG] '%d %0.1f' (bloom filter parameters)\n",
-			file_info->table_size, k);
+	printf("[DEBUG] '%u %0.1f' (bloom filter parameters)\n",
+			file_info->table_size, -log(PR_FP));
 	#endif
 }
 
@@ -0,0 +1,251 @@
+#ifndef FILE_LIVE_H
+#define FILE_LIVE_H
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libcalg-1.0/libcalg/trie.h>
+
+#include "file_digest.h"
+#include "file_entry.h"
+#include "file_filter.h"
+#include "file_hash.h"
+#include "file_info.h"
+#include "file_table.h"
+
+#include "persist.h"
+
+/* Files expected to land between scans (the filter and the tables start
+ * out sized for this many, and grow as needed) */
+#define LIVE_EXPECTED_FILES ((size_t)(0x10000))
+
+/* The index a daemon keeps resident: the one the last scan persisted
+ * (mapped, if there was one), and every file that has landed since */
+struct file_live_t
+{
+	struct file_index_t index;
+	/* The entry for each path (a path that lands again, or goes away,
+	 * has its old entry unlinked from the tables, and freed) */
+	Trie *paths;
+	/* As in a scan, the filter fronts a table of shallow hashes, and
+	 * only files that pass it are fully hashed, then grouped by their
+	 * full hash; how many files will land is not known, so the filter is
+	 * scalable; it cannot forget, so the keys of files that went away
+	 * stay in it, which costs a probe of the table when they come back
+	 * (and counts toward its growth, which keeps the rate it was given) */
+	struct file_scalable_t shash_filter;
+	/* Every live entry is a member of the first (which owns them, each
+	 * allocated on its own) and those with a full hash of the second */
+	struct file_table_t *shash_table, *hash_table;
+	size_t num_files;
+};
+
+/* Map the index (if any; files are then hashed the same way as those in
+ * it) and make room for live files (returns zero on failure) */
+int
+live_init(struct file_live_t *live, char *index_file)
+{
+	size_t i;
+	memset(live, 0, sizeof(struct file_live_t));
+	if (index_file && recover(index_file, &live->index)) {
+		fprintf(stderr, "[WARNING] '%s' (cannot recover index)\n", index_file);
+	}
+	if (live->index.map) {
+		for (i = 0; digest_engines[i].name && i < live->index.header->engine; ++i);
+		if (!digest_engines[i].name
+				|| digest_engines[i].length != live->index.header->digest_length) {
+			fprintf(stderr, "[WARNING] '%s' (unknown digest)\n", index_file);
+			release_index(&live->index);
+		} else {
+			digest_engine = &digest_engines[i];
+		}
+	}
+	filter_select();
+	live->paths = trie_new();
+	scalable_init(&live->shash_filter, LIVE_EXPECTED_FILES, PR_FP);
+	live->shash_table = table_new(offsetof(struct file_entry_t, shash),
+			sizeof(uint64_t), LIVE_EXPECTED_FILES);
+	live->hash_table = table_new(offsetof(struct file_entry_t, hash),
+			digest_engine->length, LIVE_EXPECTED_FILES);
+	return live->paths && live->shash_filter.num_slices > 0
+		&& live->shash_table && live->hash_table;
+}
+
+void
+live_destroy(struct file_live_t *live)
+{
+	size_t i;
+	struct file_entry_t *file_entry, *next;
+	release_index(&live->index);
+	if (live->paths) {
+		trie_free(live->paths);
+	}
+	scalable_destroy(&live->shash_filter);
+	if (live->shash_table) {
+		for (i = 0; i < live->shash_table->num_slots; ++i) {
+			for (file_entry = live->shash_table->slots[i].members; file_entry;
+					file_entry = next) {
+				next = file_entry->duplicate;
+				free(file_entry->leaves);
+				free(file_entry);
+			}
+		}
+		table_free(live->shash_table);
+	}
+	if (live->hash_table) {
+		table_free(live->hash_table);
+	}
+	release_hash_window();
+}
+
+/* Unlink an entry from the tables (if it is in them), and free it */
+void
+live_drop(struct file_live_t *live, struct file_entry_t *file_entry)
+{
+	if (file_entry->hashed & SHALLOW) {
+		table_remove(live->shash_table, file_entry);
+	}
+	if (file_entry->hashed & FULL) {
+		table_remove(live->hash_table, file_entry);
+	}
+	free(file_entry->leaves);
+	free(file_entry);
+}
+
+/* A path was deleted, moved away, or is about to be hashed again */
+void
+live_forget(struct file_live_t *live, const char *path)
+{
+	struct file_entry_t *file_entry = trie_lookup(live->paths, (char *)(path));
+	if (file_entry) {
+		trie_remove(live->paths, (char *)(path));
+		live_drop(live, file_entry);
+		--live->num_files;
+	}
+}
+
+/* Fully hash a live file, and group it (returns zero if it is gone) */
+inline int
+live_hash(struct file_live_t *live, struct file_entry_t *file_entry)
+{
+	if (file_entry->type != REGULAR) {
+		return 0;
+	}
+	if (file_entry->hashed & FULL) {
+		return 1;
+	}
+	if (!hash_entry(file_entry, FULL)) {
+		file_entry->type = INVALID;
+		return 0;
+	}
+	return table_insert(live->hash_table, file_entry, 0) != NULL;
+}
+
+/* Print one duplicate of a file (the file first, if this is the first) */
+inline void
+live_report(FILE *out, const struct file_entry_t *file_entry, long num_matches,
+		const char *path)
+{
+	if (num_matches == 0) {
+		fprintf(out, "[DUPLICATE] %s (%lu bytes)\n", file_entry->name,
+				(unsigned long)(file_entry->size));
+	}
+	fprintf(out, "\t%s\n", path);
+}
+
+/* Index a file that has just been written, and report (to out) any other
+ * file with the same contents that is still there (files are not always
+ * forgotten one by one, as when their directory is moved away): in the
+ * index, or among the files that landed since (returns how many, or -1 if
+ * out of memory); links to the same file are not duplicates */
+long
+live_add(struct file_live_t *live, const char *path, FILE *out)
+{
+	long num_matches = 0;
+	int seen;
+	uint64_t i, num_entries = 0;
+	unsigned char *key;
+	struct stat status;
+	struct file_entry_t *file_entry, *member;
+	struct file_group_t *group;
+	const struct index_entry_t *entries = NULL;
+	const char *name;
+	live_forget(live, path);
+	file_entry = new_entry(NULL, NULL, path, strnlen(path, PATH_MAX_LEN - 1));
+	if (!file_entry) {
+		return -1;
+	}
+	/* Empty files are all the same, and not worth reporting */
+	if (stat_entry(file_entry->name, file_entry) != REGULAR || file_entry->size == 0
+			|| !hash_entry(file_entry, SHALLOW)) {
+		live_drop(live, file_entry);
+		return 0;
+	}
+	key = (unsigned char *)(&file_entry->shash);
+	seen = scalable_query(&live->shash_filter, key)
+		&& table_find(live->shash_table, key) != NULL;
+	/* A filter that cannot grow still holds the key, only it lets more
+	 * through to the table (said once, as its newest slice overflows) */
+	if (!seen && !scalable_insert(&live->shash_filter, key)
+			&& live->shash_filter.count == live->shash_filter.capacity + 1) {
+		fprintf(stderr, "[WARNING] '%s' (filter full, more files will be probed)\n", path);
+	}
+	if (!table_insert(live->shash_table, file_entry, 0)) {
+		live_drop(live, file_entry);
+		return -1;
+	}
+	if (!trie_insert(live->paths, file_entry->name, file_entry)) {
+		live_drop(live, file_entry);
+		return -1;
+	}
+	++live->num_files;
+	if (seen) {
+		/* Files that landed with this shallow hash were fully hashed as
+		 * they did, except one that had it to itself until now */
+		group = table_find(live->shash_table, key);
+		for (member = group->members; member; member = member->duplicate) {
+			if (member != file_entry) {
+				live_hash(live, member);
+			}
+		}
+	} else if (!live->index.map || !filter_query(&live->index.filter, key)) {
+		/* Unless the index might hold a match, this file is unique */
+		return 0;
+	}
+	if (!live_hash(live, file_entry)) {
+		return (file_entry->type == REGULAR) ? -1 : 0;
+	}
+	/* Files in the index are reported if they are still there (but not
+	 * when they have since landed here, which supersedes them) */
+	if (live->index.map) {
+		entries = index_entries(&live->index,
+				index_find(&live->index, file_entry->hash), &num_entries);
+	}
+	for (i = 0; i < num_entries; ++i) {
+		name = index_name(&live->index, &entries[i]);
+		if (!name || (entries[i].dev == file_entry->dev && entries[i].ino == file_entry->ino)
+				|| trie_lookup(live->paths, (char *)(name))
+				|| stat(name, &status) || (off_t)(entries[i].size) != status.st_size) {
+			continue;
+		}
+		live_report(out, file_entry, num_matches++, name);
+	}
+	group = table_find(live->hash_table, file_entry->hash);
+	for (member = group ? group->members : NULL; member; member = member->duplicate) {
+		if (member == file_entry || member->type != REGULAR
+				|| (member->dev == file_entry->dev && member->ino == file_entry->ino)
+				|| stat(member->name, &status) || status.st_ino != member->ino
+				|| status.st_size != member->size) {
+			continue;
+		}
+		live_report(out, file_entry, num_matches++, member->name);
+	}
+	if (num_matches > 0) {
+		fflush(out);
+	}
+	return num_matches;
+}
+
+#endif /* FILE_LIVE_H */
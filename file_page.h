@@ -0,0 +1,130 @@
+#ifndef FILE_PAGE_H
+#define FILE_PAGE_H
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "file_stats.h"
+
+/* How full hashes treat the page cache: NORMAL gives no hints, while
+ * AGGRESSIVE asks the kernel to read upcoming files ahead of time, and
+ * NEUTRAL drops whatever pages it brought in (or bypasses the cache)
+ * so that a scan leaves resident memory much as it found it */
+enum page_mode_t {
+	PAGE_NORMAL     = 0x0,
+	PAGE_AGGRESSIVE = 0x1,
+	PAGE_NEUTRAL    = 0x2
+};
+
+/* Residency is checked this much of a file at a time */
+#define PAGE_CHUNK_SIZE    ((off_t)(0x4000000))
+#define PAGE_VECTOR_SIZE   ((size_t)(PAGE_CHUNK_SIZE / 0x1000))
+/* How many jobs ahead (and how much of each) are read ahead */
+#define PAGE_PREFETCH_JOBS 16
+#define PAGE_PREFETCH_SIZE PAGE_CHUNK_SIZE
+
+enum page_mode_t page_mode = PAGE_NORMAL;
+
+/* Bytes that full hashes found already cached, and those they had to
+ * read from disk (only counted when page_mode is not NORMAL) */
+size_t page_bytes_cached, page_bytes_read;
+
+/* One byte per page of a chunk, as mincore reports them */
+static __thread unsigned char page_vector[PAGE_VECTOR_SIZE];
+
+inline off_t
+page_size(void)
+{
+	return (off_t)(sysconf(_SC_PAGESIZE));
+}
+
+/* Count the bytes of part of a file that are in the page cache (offset
+ * is a page boundary, and length at most PAGE_CHUNK_SIZE); the vector,
+ * if not NULL, keeps which pages were (returns -1 on failure) */
+off_t
+page_resident(int fd, off_t offset, off_t length, unsigned char *vector)
+{
+	void *map;
+	off_t i, num_pages, resident = 0, size = page_size();
+	if (length <= 0) {
+		return 0;
+	}
+	num_pages = (length + size - 1) / size;
+	if (!vector) {
+		vector = page_vector;
+	}
+	/* Mapping touches nothing, it only lets mincore see the file */
+	map = mmap(NULL, (size_t)(length), PROT_READ, MAP_SHARED, fd, offset);
+	stats_count(STATS_SYSCALLS, (map == MAP_FAILED) ? 1 : 3);
+	if (map == MAP_FAILED) {
+		return (off_t)(-1);
+	}
+	if (mincore(map, (size_t)(length), vector)) {
+		munmap(map, (size_t)(length));
+		return (off_t)(-1);
+	}
+	munmap(map, (size_t)(length));
+	for (i = 0; i < num_pages; ++i) {
+		resident += (vector[i] & 1) ? size : 0;
+	}
+	return (resident < length) ? resident : length;
+}
+
+/* Drop the pages of part of a file that page_resident found missing,
+ * now that they have been read (clean pages only; see fadvise) */
+void
+page_release(int fd, off_t offset, off_t length, const unsigned char *vector)
+{
+	size_t calls = 0;
+	off_t i, start, num_pages, size = page_size();
+	num_pages = (length + size - 1) / size;
+	for (i = 0; i < num_pages; i = start) {
+		for (; i < num_pages && (vector[i] & 1); ++i);
+		for (start = i; start < num_pages && !(vector[start] & 1); ++start);
+		if (start > i) {
+			posix_fadvise(fd, offset + i * size, (start - i) * size, POSIX_FADV_DONTNEED);
+			++calls;
+		}
+	}
+	stats_count(STATS_SYSCALLS, calls);
+}
+
+/* Samples are small reads, which should not pull in the rest of the
+ * file (as readahead would) when leaving the cache as it was found */
+inline void
+page_sample(int fd)
+{
+	if (page_mode == PAGE_NEUTRAL) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+		stats_count(STATS_SYSCALLS, 1);
+	}
+}
+
+inline void
+page_account(off_t length, off_t resident)
+{
+	if (resident < 0) {
+		resident = 0;
+	}
+	__sync_fetch_and_add(&page_bytes_cached, (size_t)(resident));
+	__sync_fetch_and_add(&page_bytes_read, (size_t)(length - resident));
+}
+
+/* Count what of a file is cached, then have the kernel start reading
+ * (the start of) the rest, without waiting for it */
+void
+page_prefetch(int fd, off_t size)
+{
+	off_t offset, length;
+	for (offset = 0; offset < size; offset += length) {
+		length = (size - offset < PAGE_CHUNK_SIZE) ? size - offset : PAGE_CHUNK_SIZE;
+		page_account(length, page_resident(fd, offset, length, NULL));
+	}
+	posix_fadvise(fd, 0, (size < PAGE_PREFETCH_SIZE) ? size : PAGE_PREFETCH_SIZE,
+			POSIX_FADV_WILLNEED);
+	stats_count(STATS_SYSCALLS, 1);
+}
+
+#endif /* FILE_PAGE_H */
@@ -0,0 +1,513 @@
+#ifndef FILE_POOL_H
+#define FILE_POOL_H
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcalg-1.0/libcalg/compare-pointer.h>
+#include <libcalg-1.0/libcalg/hash-pointer.h>
+#include <libcalg-1.0/libcalg/set.h>
+
+#include "file_compare.h"
+#include "file_entry.h"
+#include "file_hash.h"
+#include "file_ring.h"
+#include "file_table.h"
+
+#define POOL_MIN_JOBS    64
+#define POOL_MAX_WORKERS 256
+
+/* Huge files are split into one unit of work per chunk, and the last
+ * of its chunks to finish completes the tree digest (see pool_chunk) */
+struct pool_tree_t
+{
+	size_t pending;
+	int failed;
+};
+
+struct pool_unit_t
+{
+	size_t job, chunk;
+	struct pool_tree_t *tree;
+};
+
+/* A queue of hash jobs, drained by a pool of workers
+ * (jobs are kept in the order they were first pushed) */
+struct file_pool_t
+{
+	struct file_entry_t **jobs;
+	size_t num_jobs, max_jobs, next_job;
+	enum hash_depth_t depth;
+	/* Guards against hashing an entry twice */
+	Set *queued;
+	/* Full hashes are grouped here as they finish (if not NULL) */
+	struct file_shards_t *archive;
+	int failed;
+	/* Jobs are read ahead up to here, if each is marked as needing it
+	 * (see pool_prefetch) */
+	size_t next_prefetch;
+	unsigned char *unread;
+	/* Full hashes are claimed a unit at a time, if any job is a tree
+	 * (otherwise units is NULL, and each job is a unit) */
+	struct pool_unit_t *units;
+	struct pool_tree_t *trees;
+	size_t num_units;
+};
+
+inline int
+pool_init(struct file_pool_t *pool, enum hash_depth_t depth)
+{
+	assert(pool);
+	pool->jobs = malloc(POOL_MIN_JOBS * sizeof(struct file_entry_t *));
+	pool->queued = set_new(&pointer_hash, &pointer_equal);
+	pool->num_jobs = pool->next_job = 0;
+	pool->max_jobs = POOL_MIN_JOBS;
+	pool->depth = depth;
+	pool->archive = NULL;
+	pool->failed = 0;
+	pool->next_prefetch = 0;
+	pool->unread = NULL;
+	pool->units = NULL;
+	pool->trees = NULL;
+	pool->num_units = 0;
+	return pool->jobs && pool->queued;
+}
+
+inline void
+pool_destroy(struct file_pool_t *pool)
+{
+	assert(pool);
+	if (pool->queued) {
+		set_free(pool->queued);
+	}
+	free(pool->jobs);
+	pool->jobs = NULL;
+	pool->queued = NULL;
+	pool->num_jobs = pool->max_jobs = pool->next_job = 0;
+}
+
+/* Returns zero if the job could not be queued (entries are queued once) */
+int
+pool_push(struct file_pool_t *pool, struct file_entry_t *file_entry)
+{
+	struct file_entry_t **jobs;
+	assert(pool && file_entry);
+	if (set_query(pool->queued, file_entry)) {
+		return 1;
+	}
+	/* Grow the queue geometrically */
+	if (pool->num_jobs == pool->max_jobs) {
+		jobs = realloc(pool->jobs,
+				2 * pool->max_jobs * sizeof(struct file_entry_t *));
+		if (!jobs) {
+			return 0;
+		}
+		pool->jobs = jobs;
+		pool->max_jobs *= 2;
+	}
+	if (!set_insert(pool->queued, file_entry)) {
+		return 0;
+	}
+	pool->jobs[pool->num_jobs++] = file_entry;
+	return 1;
+}
+
+/* Have the kernel read the next few jobs ahead of the workers (each
+ * is claimed by one worker, which also counts what was cached) */
+void
+pool_prefetch(struct file_pool_t *pool, size_t job)
+{
+	size_t next, last = job + PAGE_PREFETCH_JOBS;
+	if (last > pool->num_jobs) {
+		last = pool->num_jobs;
+	}
+	while ((next = __sync_add_and_fetch(&pool->next_prefetch, 0)) < last) {
+		if (__sync_bool_compare_and_swap(&pool->next_prefetch, next, next + 1)
+				&& pool->unread[next]) {
+			prefetch_entry(pool->jobs[next]);
+		}
+	}
+}
+
+/* A file that could not be read says nothing about its contents, so it
+ * is reported, and dropped, rather than taken to be unique (its type is
+ * already INACCESSIBLE if it could not be opened for that reason) */
+void
+pool_unreadable(struct file_entry_t *file_entry)
+{
+	if (file_entry->type == REGULAR) {
+		file_entry->type = INVALID;
+	}
+	fprintf(stderr, "[WARNING] '%s' (read failed)\n", entry_path(file_entry));
+}
+
+/* Hash one chunk of a tree (returns non-zero only to the worker that
+ * finishes the tree, once its digest is complete) */
+int
+pool_chunk(struct file_pool_t *pool, const struct pool_unit_t *unit)
+{
+	struct file_entry_t *file_entry = pool->jobs[unit->job];
+	if (!tree_hash_chunk(file_entry, unit->chunk)) {
+		__sync_fetch_and_or(&unit->tree->failed, 1);
+	}
+	/* The other chunks are done (their digests are visible past this) */
+	if (__sync_sub_and_fetch(&unit->tree->pending, 1) > 0) {
+		return 0;
+	}
+	if (unit->tree->failed
+			|| !tree_root(file_entry->leaves, file_entry->size, file_entry->hash)) {
+		pool_unreadable(file_entry);
+		return 0;
+	}
+	file_entry->hashed |= FULL;
+	__sync_fetch_and_add(&hash_strategy_count[HASH_TREE], 1);
+	stats_count(STATS_FILES, 1);
+	return 1;
+}
+
+/* Each worker claims the next unclaimed unit until none are left */
+void *
+pool_work(void *data)
+{
+	size_t unit, job;
+	int hashed;
+	struct file_pool_t *pool = (struct file_pool_t *)(data);
+	while ((unit = __sync_fetch_and_add(&pool->next_job, 1)) < pool->num_units) {
+		job = pool->units ? pool->units[unit].job : unit;
+		if (pool->unread) {
+			pool_prefetch(pool, job);
+		}
+		if (pool->units && pool->units[unit].tree) {
+			hashed = pool_chunk(pool, &pool->units[unit]);
+		} else {
+			hashed = hash_entry(pool->jobs[job], pool->depth) != NULL;
+			if (!hashed && pool->depth == FULL) {
+				pool_unreadable(pool->jobs[job]);
+			}
+		}
+		if (hashed && pool->depth == FULL && pool->archive) {
+			/* Queue positions keep the grouping independent of timing */
+			if (!shards_insert(pool->archive, pool->jobs[job], job)) {
+				__sync_fetch_and_or(&pool->failed, 1);
+			}
+		}
+	}
+	release_hash_window();
+	return NULL;
+}
+
+/* Split the chunks of any huge file that still needs a full hash into
+ * units of their own, so that workers share it (returns zero if there
+ * are none, or if there was no memory to split them) */
+int
+pool_split(struct file_pool_t *pool)
+{
+	size_t i, chunk, num_trees = 0, num_units = 0;
+	struct file_entry_t *file_entry;
+	for (i = 0; i < pool->num_jobs; ++i) {
+		file_entry = pool->jobs[i];
+		if (choose_strategy(file_entry->size) == HASH_TREE
+				&& hash_pending(file_entry, FULL) && tree_alloc(file_entry)) {
+			num_units += tree_num_chunks(file_entry->size);
+			++num_trees;
+		} else {
+			++num_units;
+		}
+	}
+	if (num_trees == 0) {
+		return 0;
+	}
+	pool->units = malloc(num_units * sizeof(struct pool_unit_t));
+	pool->trees = malloc(num_trees * sizeof(struct pool_tree_t));
+	if (!pool->units || !pool->trees) {
+		free(pool->units);
+		free(pool->trees);
+		pool->units = NULL;
+		pool->trees = NULL;
+		return 0;
+	}
+	for (i = num_units = num_trees = 0; i < pool->num_jobs; ++i) {
+		file_entry = pool->jobs[i];
+		if (!file_entry->leaves || !hash_pending(file_entry, FULL)) {
+			pool->units[num_units].job = i;
+			pool->units[num_units].chunk = 0;
+			pool->units[num_units++].tree = NULL;
+			continue;
+		}
+		pool->trees[num_trees].pending = tree_num_chunks(file_entry->size);
+		pool->trees[num_trees].failed = 0;
+		for (chunk = 0; chunk < pool->trees[num_trees].pending; ++chunk) {
+			pool->units[num_units].job = i;
+			pool->units[num_units].chunk = chunk;
+			pool->units[num_units++].tree = &pool->trees[num_trees];
+		}
+		++num_trees;
+	}
+	pool->num_units = num_units;
+	return 1;
+}
+
+/* Run the same work on (at most) the given number of threads, this
+ * one included, and wait for them all to finish */
+void
+pool_spawn(void *(*work)(void *), void *data, size_t num_workers)
+{
+	size_t i, num_started;
+	pthread_t workers[POOL_MAX_WORKERS];
+	if (num_workers > POOL_MAX_WORKERS) {
+		num_workers = POOL_MAX_WORKERS;
+	}
+	/* Start the workers (a single worker is just this thread) */
+	for (num_started = 0; num_workers > 1 && num_started < num_workers; ++num_started) {
+		if (pthread_create(&workers[num_started], NULL, work, data)) {
+			#ifndef NDEBUG
+			fprintf(stderr, "[WARNING] %lu worker(s) (create failed)\n",
+					(unsigned long)(num_workers - num_started));
+			#endif
+			break;
+		}
+	}
+	/* Help out (this also covers any workers that failed to start) */
+	(*work)(data);
+	for (i = 0; i < num_started; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+}
+
+/* Hash every queued job using (at most) the given number of workers;
+ * shallow and sampling stages go through an io_uring first, if there
+ * is one, which leaves the workers only what it could not hash, and the
+ * chunks of huge files are hashed by as many workers as are free */
+void
+pool_run(struct file_pool_t *pool, size_t num_workers)
+{
+	size_t i, num_left;
+	assert(pool);
+	if (pool->depth != FULL && ring_hash(pool->jobs, pool->num_jobs, pool->depth)) {
+		/* No more workers than the ring left jobs (short reads, say) */
+		for (i = num_left = 0; i < pool->num_jobs; ++i) {
+			num_left += hash_pending(pool->jobs[i], pool->depth);
+		}
+		if (num_workers > num_left) {
+			num_workers = num_left ? num_left : 1;
+		}
+	}
+	pool->next_job = pool->next_prefetch = 0;
+	/* Note which jobs need reading before any worker starts (those with
+	 * a known full hash do not), since they only learn it as they go */
+	if (pool->depth == FULL && page_mode == PAGE_AGGRESSIVE
+			&& (pool->unread = malloc(pool->num_jobs + 1))) {
+		for (i = 0; i < pool->num_jobs; ++i) {
+			pool->unread[i] = !(pool->jobs[i]->hashed & FULL);
+		}
+	}
+	pool->num_units = pool->num_jobs;
+	if (pool->depth == FULL) {
+		pool_split(pool);
+	}
+	pool_spawn(&pool_work, pool, (num_workers < pool->num_units) ? num_workers : pool->num_units);
+	free(pool->unread);
+	free(pool->units);
+	free(pool->trees);
+	pool->unread = NULL;
+	pool->units = NULL;
+	pool->trees = NULL;
+}
+
+int
+compare_samples(const void *lhs, const void *rhs)
+{
+	const struct file_entry_t *l = *(struct file_entry_t * const *)(lhs);
+	const struct file_entry_t *r = *(struct file_entry_t * const *)(rhs);
+	if (l->size != r->size) {
+		return (l->size > r->size) - (l->size < r->size);
+	}
+	return (l->sample > r->sample) - (l->sample < r->sample);
+}
+
+int
+compare_shallow(const void *lhs, const void *rhs)
+{
+	const struct file_entry_t *l = *(struct file_entry_t * const *)(lhs);
+	const struct file_entry_t *r = *(struct file_entry_t * const *)(rhs);
+	if (l->size != r->size) {
+		return (l->size > r->size) - (l->size < r->size);
+	}
+	return (l->shash > r->shash) - (l->shash < r->shash);
+}
+
+/* Run a sampling stage over every queued job, then drop the jobs that
+ * no longer match any other (returns how many, or -1 on failure);
+ * jobs with a known full hash are not sampled, so they are all kept,
+ * along with any job that has the same shallow hash as one of them */
+long
+pool_prune(struct file_pool_t *pool, enum hash_depth_t depth, size_t num_workers)
+{
+	size_t i, n, m, kept, sampled;
+	struct file_entry_t **sorted, **match, **known;
+	assert(pool && (depth & (HEAD | TAIL | SAMPLE)));
+	if (pool->num_jobs == 0) {
+		return 0;
+	}
+	pool->depth = depth;
+	pool_run(pool, num_workers);
+	/* Jobs whose sample could not be read are dropped (see pool_unreadable),
+	 * since their chain is still that of the last stage */
+	n = pool->num_jobs;
+	for (i = kept = 0; i < n; ++i) {
+		if (hash_pending(pool->jobs[i], depth)) {
+			pool_unreadable(pool->jobs[i]);
+			set_remove(pool->queued, pool->jobs[i]);
+		} else {
+			pool->jobs[kept++] = pool->jobs[i];
+		}
+	}
+	pool->num_jobs = m = kept;
+	if (m == 0) {
+		return (long)(n);
+	}
+	/* Group the jobs by sorting a copy of the queue (sampled jobs at
+	 * the front, and those with a known full hash at the back) */
+	sorted = malloc(m * sizeof(struct file_entry_t *));
+	if (!sorted) {
+		return -1;
+	}
+	for (i = sampled = 0, known = sorted + m; i < m; ++i) {
+		if (pool->jobs[i]->hashed & FULL) {
+			*--known = pool->jobs[i];
+		} else {
+			sorted[sampled++] = pool->jobs[i];
+		}
+	}
+	qsort(sorted, sampled, sizeof(struct file_entry_t *), &compare_samples);
+	qsort(known, m - sampled, sizeof(struct file_entry_t *), &compare_shallow);
+	/* Keep the (ordered) queue, minus singleton groups */
+	for (i = kept = 0; i < m; ++i) {
+		if (pool->jobs[i]->hashed & FULL) {
+			pool->jobs[kept++] = pool->jobs[i];
+			continue;
+		}
+		match = bsearch(&pool->jobs[i], sorted, sampled,
+				sizeof(struct file_entry_t *), &compare_samples);
+		assert(match);
+		if ((match > sorted && !compare_samples(match - 1, match))
+				|| (match + 1 < sorted + sampled && !compare_samples(match + 1, match))
+				|| bsearch(&pool->jobs[i], known, m - sampled,
+					sizeof(struct file_entry_t *), &compare_shallow)) {
+			pool->jobs[kept++] = pool->jobs[i];
+		}
+	}
+	free(sorted);
+	pool->num_jobs = kept;
+	return (long)(n - kept);
+}
+
+/* Small groups of candidates, each compared by one worker */
+struct pool_groups_t
+{
+	struct file_entry_t **members;
+	size_t *starts, num_groups, next_group;
+	/* What compare_group returned for each */
+	int *matched;
+};
+
+void *
+pool_compare_work(void *data)
+{
+	size_t group;
+	struct pool_groups_t *groups = (struct pool_groups_t *)(data);
+	while ((group = __sync_fetch_and_add(&groups->next_group, 1)) < groups->num_groups) {
+		groups->matched[group] = compare_group(groups->members + groups->starts[group],
+				groups->starts[group + 1] - groups->starts[group]);
+	}
+	release_hash_window();
+	return NULL;
+}
+
+/* Compare each group of (up to COMPARE_MAX_MEMBERS) queued jobs that
+ * are alike so far directly, instead of hashing them, then drop those
+ * found to match no other (returns how many, or -1 on failure); groups
+ * that might match a job with a known full hash are left to hashing */
+long
+pool_compare(struct file_pool_t *pool, size_t num_workers)
+{
+	size_t i, j, n, kept, sampled, group;
+	struct file_entry_t **sorted, **known;
+	struct pool_groups_t groups;
+	assert(pool);
+	if (pool->num_jobs == 0) {
+		return 0;
+	}
+	n = pool->num_jobs;
+	sorted = malloc(n * sizeof(struct file_entry_t *));
+	groups.starts = malloc((n + 1) * sizeof(size_t));
+	groups.matched = malloc(n * sizeof(int));
+	if (!sorted || !groups.starts || !groups.matched) {
+		free(sorted);
+		free(groups.starts);
+		free(groups.matched);
+		return -1;
+	}
+	/* Group the jobs as pool_prune does (compared groups move up front) */
+	for (i = sampled = 0, known = sorted + n; i < n; ++i) {
+		if (pool->jobs[i]->hashed & FULL) {
+			*--known = pool->jobs[i];
+		} else {
+			sorted[sampled++] = pool->jobs[i];
+		}
+	}
+	qsort(sorted, sampled, sizeof(struct file_entry_t *), &compare_samples);
+	qsort(known, n - sampled, sizeof(struct file_entry_t *), &compare_shallow);
+	groups.members = sorted;
+	groups.num_groups = groups.next_group = 0;
+	groups.starts[0] = kept = 0;
+	for (i = 0; i < sampled; i = j) {
+		for (j = i + 1; j < sampled && !compare_samples(&sorted[i], &sorted[j]); ++j);
+		if (j - i < 2 || j - i > COMPARE_MAX_MEMBERS) {
+			continue;
+		}
+		while (i < j && !bsearch(&sorted[i], known, n - sampled,
+					sizeof(struct file_entry_t *), &compare_shallow)) {
+			sorted[kept++] = sorted[i++];
+		}
+		if (i < j) {
+			kept = groups.starts[groups.num_groups];
+		} else {
+			groups.starts[++groups.num_groups] = kept;
+		}
+	}
+	pool_spawn(&pool_compare_work, &groups,
+			(num_workers < groups.num_groups) ? num_workers : groups.num_groups);
+	/* Whatever was compared, but not found to match, is unique (groups
+	 * that could not be read are left for hashing to report) */
+	for (group = 0; group < groups.num_groups; ++group) {
+		for (i = groups.starts[group]; groups.matched[group] >= 0
+				&& i < groups.starts[group + 1]; ++i) {
+			if (!(sorted[i]->hashed & FULL)) {
+				set_remove(pool->queued, sorted[i]);
+			}
+		}
+	}
+	for (i = kept = 0; i < n; ++i) {
+		if (set_query(pool->queued, pool->jobs[i])) {
+			pool->jobs[kept++] = pool->jobs[i];
+		}
+	}
+	free(groups.matched);
+	free(groups.starts);
+	free(sorted);
+	pool->num_jobs = kept;
+	return (long)(n - kept);
+}
+
+/* Pick a worker count when none was specified */
+inline size_t
+pool_default_workers(void)
+{
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	return (online > 0) ? (size_t)(online) : 1;
+}
+
+#endif /* FILE_POOL_H */
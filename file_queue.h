@@ -0,0 +1,156 @@
+#ifndef FILE_QUEUE_H
+#define FILE_QUEUE_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libcalg-1.0/libcalg/trie.h>
+
+#include "file_watch.h"
+
+/* Events for a file are held until it has been quiet this long (in
+ * milliseconds), but never for more than QUEUE_MAX_WINDOWS windows; a
+ * window is at most a minute, so deadlines (and waits) stay small */
+#define QUEUE_DEFAULT_WINDOW ((uint64_t)(250))
+#define QUEUE_MAX_WINDOW     ((uint64_t)(60000))
+#define QUEUE_MAX_WINDOWS    ((uint64_t)(8))
+/* At most this many files are dispatched at a time, so the main loop
+ * keeps reading events while a burst is worked through */
+#define QUEUE_BATCH_SIZE     ((size_t)(0x400))
+
+/* What is pending for a file: only the last thing that happened to it
+ * matters (written then deleted is deleted, deleted then written is
+ * written), and it is dispatched once the file has settled */
+struct queue_event_t
+{
+	enum watch_event_t type;
+	uint64_t first, due;
+	char path[];
+};
+
+/* Pending events, in the order their files were first seen, and the
+ * same events by path (so a file is queued once however busy it is) */
+struct file_queue_t
+{
+	Trie *paths;
+	struct queue_event_t **pending;
+	size_t num_pending, num_slots;
+	uint64_t window;
+	/* Events pushed, and events dispatched (the rest were merged) */
+	uint64_t num_pushed, num_dispatched;
+};
+
+/* Milliseconds on a clock that does not jump */
+inline uint64_t
+queue_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec) * 1000 + (uint64_t)(now.tv_nsec) / 1000000;
+}
+
+/* Returns zero on failure (the window is cut to QUEUE_MAX_WINDOW) */
+int
+queue_init(struct file_queue_t *queue, uint64_t window)
+{
+	memset(queue, 0, sizeof(struct file_queue_t));
+	queue->window = (window < QUEUE_MAX_WINDOW) ? window : QUEUE_MAX_WINDOW;
+	queue->paths = trie_new();
+	return queue->paths != NULL;
+}
+
+void
+queue_destroy(struct file_queue_t *queue)
+{
+	size_t i;
+	for (i = 0; i < queue->num_pending; ++i) {
+		free(queue->pending[i]);
+	}
+	free(queue->pending);
+	if (queue->paths) {
+		trie_free(queue->paths);
+	}
+	memset(queue, 0, sizeof(struct file_queue_t));
+}
+
+/* Milliseconds until the next event is due (zero if one is, or if
+ * nothing is pending) */
+uint64_t
+queue_wait(const struct file_queue_t *queue, uint64_t now)
+{
+	size_t i;
+	uint64_t due = UINT64_MAX;
+	for (i = 0; i < queue->num_pending; ++i) {
+		if (queue->pending[i]->due < due) {
+			due = queue->pending[i]->due;
+		}
+	}
+	return (due == UINT64_MAX || due <= now) ? 0 : due - now;
+}
+
+/* Queue what happened to a file (its deadline moves back each time;
+ * returns zero if out of memory, and the event is then lost) */
+int
+queue_push(struct file_queue_t *queue, const char *path, enum watch_event_t type,
+		uint64_t now)
+{
+	size_t length;
+	struct queue_event_t *event;
+	++queue->num_pushed;
+	event = trie_lookup(queue->paths, (char *)(path));
+	if (event) {
+		event->type = type;
+		event->due = now + queue->window;
+		if (event->due > event->first + QUEUE_MAX_WINDOWS * queue->window) {
+			event->due = event->first + QUEUE_MAX_WINDOWS * queue->window;
+		}
+		return 1;
+	}
+	if (!watch_reserve((void **)(&queue->pending), &queue->num_slots,
+				queue->num_pending, 1, sizeof(struct queue_event_t *))) {
+		return 0;
+	}
+	length = strlen(path) + 1;
+	event = malloc(sizeof(struct queue_event_t) + length);
+	if (!event) {
+		return 0;
+	}
+	memcpy(event->path, path, length);
+	event->type = type;
+	event->first = now;
+	event->due = now + queue->window;
+	if (!trie_insert(queue->paths, event->path, event)) {
+		free(event);
+		return 0;
+	}
+	queue->pending[queue->num_pending++] = event;
+	return 1;
+}
+
+/* Dispatch (at most limit of) the events that are due, oldest first, and
+ * keep the rest in order (returns how many were dispatched) */
+size_t
+queue_flush(struct file_queue_t *queue, uint64_t now, size_t limit,
+		watch_func_t dispatch, void *data)
+{
+	size_t i, kept = 0, num_dispatched = 0;
+	struct queue_event_t *event;
+	for (i = 0; i < queue->num_pending; ++i) {
+		event = queue->pending[i];
+		if (event->due > now || num_dispatched >= limit) {
+			queue->pending[kept++] = event;
+			continue;
+		}
+		/* Dispatching may queue the path again (appended, so it is kept) */
+		trie_remove(queue->paths, event->path);
+		(*dispatch)(event->path, event->type, data);
+		free(event);
+		++num_dispatched;
+	}
+	queue->num_pending = kept;
+	queue->num_dispatched += num_dispatched;
+	return num_dispatched;
+}
+
+#endif /* FILE_QUEUE_H */
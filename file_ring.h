@@ -0,0 +1,438 @@
+#ifndef FILE_RING_H
+#define FILE_RING_H
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "file_entry.h"
+#include "file_hash.h"
+
+/* Reading the first bytes (or a few samples) of many files is mostly
+ * waiting, so an io_uring keeps hundreds of opens, reads and closes in
+ * flight from one thread, and hashes each file as its reads land;
+ * without one, the caller hashes everything (see pool_run) */
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* Added along with the openat, read and close operations (Linux 5.6) */
+#ifdef IORING_FEAT_RW_CUR_POS
+#define RING_AVAILABLE
+#endif
+#endif
+
+#define RING_ENTRIES 1024
+#define RING_SLOTS   256
+/* Buffers of the files in flight are bounded by this, in total */
+#define RING_MEMORY  ((size_t)(0x1000000))
+
+/* Number of entries hashed through the ring (see pool_run) */
+size_t ring_hash_count;
+
+#ifdef RING_AVAILABLE
+
+/* What each completion was for (the low bits of its user data) */
+enum ring_op_t {
+	RING_OPEN  = 0x1,
+	RING_READ  = 0x2,
+	RING_CLOSE = 0x3
+};
+#define RING_OP_BITS 8
+
+/* The shared rings, mapped from the kernel */
+struct file_ring_t
+{
+	int fd;
+	unsigned int sq_entries, to_submit, in_flight;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_size, cq_map_size, sqes_size;
+};
+
+/* A file in flight (its path must outlive the open) */
+struct ring_slot_t
+{
+	struct file_entry_t *file_entry;
+	int fd, num_points, pending, failed;
+	char *path;
+	unsigned char *buffer;
+	off_t lengths[SAMPLE_POINTS];
+};
+
+/* Whether the kernel supports every operation used here (one probe
+ * per run; -1 means not known yet) */
+static int ring_supported = -1;
+
+inline void
+ring_destroy(struct file_ring_t *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+		munmap(ring->cq_map, ring->cq_map_size);
+	}
+	if (ring->sq_map && ring->sq_map != MAP_FAILED) {
+		munmap(ring->sq_map, ring->sq_map_size);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	memset(ring, 0, sizeof(struct file_ring_t));
+	ring->fd = -1;
+}
+
+/* Check once that openat, read and close can be queued */
+int
+ring_probe(int fd)
+{
+	int status;
+	struct io_uring_probe *probe;
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (!probe) {
+		return 0;
+	}
+	status = !syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)
+		&& probe->last_op >= IORING_OP_CLOSE
+		&& (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+		&& (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+		&& (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return status;
+}
+
+/* Returns zero if no ring could be set up (so hash the usual way) */
+int
+ring_init(struct file_ring_t *ring)
+{
+	struct io_uring_params params;
+	memset(ring, 0, sizeof(struct file_ring_t));
+	ring->fd = -1;
+	if (ring_supported == 0) {
+		return 0;
+	}
+	memset(&params, 0, sizeof(struct io_uring_params));
+	ring->fd = (int)(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+	if (ring->fd < 0 || (ring_supported < 0 && !(ring_supported = ring_probe(ring->fd)))) {
+		#ifndef NDEBUG
+		fprintf(stderr, "[WARNING] '%s' (io_uring unavailable)\n", strerror(errno));
+		#endif
+		ring_supported = 0;
+		ring_destroy(ring);
+		return 0;
+	}
+	ring->sq_entries = params.sq_entries;
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	/* Newer kernels map both rings at once */
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_size > ring->sq_map_size) {
+			ring->sq_map_size = ring->cq_map_size;
+		}
+		ring->cq_map_size = ring->sq_map_size;
+	}
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_map = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_map
+		: mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		ring_destroy(ring);
+		return 0;
+	}
+	ring->sq_head = (unsigned int *)((char *)(ring->sq_map) + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)(ring->sq_map) + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)(ring->sq_map) + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)(ring->sq_map) + params.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)(ring->cq_map) + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)(ring->cq_map) + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)(ring->cq_map) + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)(ring->cq_map) + params.cq_off.cqes);
+	return 1;
+}
+
+/* Hand queued operations to the kernel, and wait for at least this
+ * many to complete (returns zero on failure) */
+int
+ring_enter(struct file_ring_t *ring, unsigned int min_complete)
+{
+	long n;
+	do {
+		n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+				min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		stats_count(STATS_SYSCALLS, 1);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return 0;
+	}
+	ring->to_submit -= (unsigned int)(n);
+	return 1;
+}
+
+/* Claim the next submission (flushing the queue if it is full) */
+struct io_uring_sqe *
+ring_sqe(struct file_ring_t *ring, enum ring_op_t op, size_t slot, size_t point)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *ring->sq_tail, index;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries
+			&& (!ring_enter(ring, 0) || tail - __atomic_load_n(ring->sq_head,
+					__ATOMIC_ACQUIRE) == ring->sq_entries)) {
+		return NULL;
+	}
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = (((uint64_t)(slot) * SAMPLE_POINTS + point) << RING_OP_BITS) | op;
+	ring->sq_array[index] = index;
+	/* Visible to the kernel only once filled in (see ring_queue) */
+	return sqe;
+}
+
+inline void
+ring_queue(struct file_ring_t *ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	++ring->to_submit;
+	++ring->in_flight;
+}
+
+int
+ring_close(struct file_ring_t *ring, int fd)
+{
+	struct io_uring_sqe *sqe = ring_sqe(ring, RING_CLOSE, 0, 0);
+	if (!sqe) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	ring_queue(ring);
+	return 1;
+}
+
+/* Queue every read of a stage for an open file */
+void
+ring_read(struct file_ring_t *ring, struct ring_slot_t *slot, size_t index,
+		enum hash_depth_t depth)
+{
+	int point;
+	off_t offset, length, position = 0;
+	struct io_uring_sqe *sqe;
+	for (point = 0; sample_span(slot->file_entry, depth, point, &offset, &length); ++point) {
+		slot->lengths[point] = length;
+		if (length == 0) {
+			continue;
+		}
+		sqe = ring_sqe(ring, RING_READ, index, point);
+		if (!sqe) {
+			slot->failed = 1;
+			break;
+		}
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = slot->fd;
+		sqe->off = (uint64_t)(offset);
+		sqe->addr = (uint64_t)(uintptr_t)(slot->buffer + position);
+		sqe->len = (uint32_t)(length);
+		ring_queue(ring);
+		position += length;
+		++slot->pending;
+	}
+	slot->num_points = point;
+}
+
+/* Fold the reads of a finished file into its hash, in order */
+void
+ring_finish(struct ring_slot_t *slot, enum hash_depth_t depth)
+{
+	int point;
+	off_t position = 0;
+	for (point = 0; point < slot->num_points; ++point) {
+		sample_update(slot->file_entry, depth, slot->buffer + position, slot->lengths[point]);
+		position += slot->lengths[point];
+	}
+	if (slot->num_points > 0) {
+		slot->file_entry->hashed |= depth;
+		++ring_hash_count;
+		stats_count(STATS_FILES, 1);
+		stats_count(STATS_BYTES, (size_t)(position));
+	}
+}
+
+/* Bytes read from each file by a stage (at most) */
+inline size_t
+ring_slot_size(enum hash_depth_t depth)
+{
+	switch (depth) {
+	case SHALLOW: return (size_t)(SHALLOW_SIZE);
+	case HEAD:
+	case TAIL: return (size_t)(sample_size);
+	case SAMPLE: return (size_t)(SAMPLE_POINTS * SAMPLE_POINT_SIZE);
+	default: return 0;
+	}
+}
+
+/* Hash entries at a shallow or sampling depth, many at once; whatever
+ * cannot be hashed here (unreadable files, short reads) is left for
+ * hash_entry, which also reports why (returns zero if no ring) */
+int
+ring_hash(struct file_entry_t **entries, size_t num_entries, enum hash_depth_t depth)
+{
+	int status = 1;
+	char path[PATH_MAX_LEN];
+	size_t i, next, num_slots, num_free, slot_size, length, *free_slots;
+	unsigned int head, tail;
+	uint64_t data;
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	struct ring_slot_t *slots, *slot;
+	struct file_ring_t ring;
+	unsigned char *buffers;
+	if (num_entries == 0 || ring_slot_size(depth) == 0 || !ring_init(&ring)) {
+		return 0;
+	}
+	/* Give each file in flight its own buffer, within the budget */
+	slot_size = (ring_slot_size(depth) + 63) & ~(size_t)(63);
+	num_slots = RING_MEMORY / slot_size;
+	if (num_slots > RING_SLOTS) {
+		num_slots = RING_SLOTS;
+	}
+	if (num_slots > num_entries) {
+		num_slots = num_entries;
+	}
+	if (num_slots == 0) {
+		num_slots = 1;
+	}
+	slots = calloc(num_slots, sizeof(struct ring_slot_t));
+	free_slots = malloc(num_slots * sizeof(size_t));
+	buffers = malloc(num_slots * slot_size);
+	if (!slots || !free_slots || !buffers) {
+		free(slots);
+		free(free_slots);
+		free(buffers);
+		ring_destroy(&ring);
+		return 0;
+	}
+	for (i = 0; i < num_slots; ++i) {
+		slots[i].buffer = buffers + i * slot_size;
+		free_slots[i] = num_slots - 1 - i;
+	}
+	num_free = num_slots;
+	next = 0;
+	while (next < num_entries || ring.in_flight > 0) {
+		/* Open as many files as there are free slots */
+		while (num_free > 0 && next < num_entries) {
+			if (!hash_pending(entries[next], depth)) {
+				++next;
+				continue;
+			}
+			length = build_path(entries[next], path);
+			if (length == 0) {
+				++next;
+				continue;
+			}
+			i = free_slots[num_free - 1];
+			slot = &slots[i];
+			slot->file_entry = entries[next];
+			slot->fd = -1;
+			slot->pending = slot->failed = 0;
+			slot->path = malloc(length + 1);
+			sqe = slot->path ? ring_sqe(&ring, RING_OPEN, i, 0) : NULL;
+			if (!sqe) {
+				free(slot->path);
+				slot->path = NULL;
+				break;
+			}
+			memcpy(slot->path, path, length + 1);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uint64_t)(uintptr_t)(slot->path);
+			sqe->open_flags = O_RDONLY;
+			ring_queue(&ring);
+			--num_free;
+			++next;
+		}
+		if (ring.in_flight == 0) {
+			/* Nothing could be queued (out of memory) */
+			break;
+		}
+		if (!ring_enter(&ring, 1)) {
+			status = 0;
+			break;
+		}
+		/* Reap every completion that has landed */
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			cqe = &ring.cqes[head & *ring.cq_mask];
+			data = cqe->user_data;
+			--ring.in_flight;
+			if ((data & ((1 << RING_OP_BITS) - 1)) == RING_CLOSE) {
+				continue;
+			}
+			i = (size_t)((data >> RING_OP_BITS) / SAMPLE_POINTS);
+			slot = &slots[i];
+			if ((data & ((1 << RING_OP_BITS) - 1)) == RING_OPEN) {
+				free(slot->path);
+				slot->path = NULL;
+				if (cqe->res < 0) {
+					/* Let hash_entry find (and report) the problem */
+					free_slots[num_free++] = i;
+					continue;
+				}
+				slot->fd = cqe->res;
+				page_sample(slot->fd);
+				ring_read(&ring, slot, i, depth);
+			} else {
+				--slot->pending;
+				if (cqe->res != slot->lengths[(data >> RING_OP_BITS) % SAMPLE_POINTS]) {
+					slot->failed = 1;
+				}
+			}
+			if (slot->pending > 0) {
+				continue;
+			}
+			/* Every read has landed (or none were needed) */
+			if (!slot->failed) {
+				ring_finish(slot, depth);
+			}
+			if (!ring_close(&ring, slot->fd)) {
+				close_entry(slot->fd);
+			}
+			free_slots[num_free++] = i;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	ring_destroy(&ring);
+	/* The kernel may still write to these if the ring failed */
+	if (status) {
+		free(buffers);
+		free(slots);
+	}
+	free(free_slots);
+	return 1;
+}
+
+#else
+
+inline int
+ring_hash(struct file_entry_t **entries, size_t num_entries, enum hash_depth_t depth)
+{
+	(void)(entries);
+	(void)(num_entries);
+	(void)(depth);
+	return 0;
+}
+
+#endif /* RING_AVAILABLE */
+
+#endif /* FILE_RING_H */
@@ -0,0 +1,121 @@
+#ifndef FILE_STATS_H
+#define FILE_STATS_H
+#include <stdio.h>
+#include <time.h>
+
+#include "file_arena.h"
+
+/* Each step of a scan is timed (wall clock) as it runs */
+enum stats_stage_t {
+	STATS_WALK,
+	STATS_PRUNE,
+	STATS_SHALLOW,
+	STATS_FILTER,
+	STATS_SAMPLE,
+	STATS_COMPARE,
+	STATS_FULL,
+	STATS_VERIFY,
+	STATS_CACHE,
+	STATS_INDEX,
+	STATS_REPORT,
+	STATS_STAGES
+};
+
+static const char *stats_stage_names[STATS_STAGES] = {
+	"walk", "prune", "shallow", "filter", "sample",
+	"compare", "full", "verify", "cache", "index", "report"
+};
+
+/* What each stage did: files handled, bytes read, and system calls made
+ * while walking and reading files (the cache and index are written
+ * through gdbm and stdio, which are not counted); these are counted as
+ * they happen, by any thread, then charged to a stage */
+enum stats_counter_t {
+	STATS_FILES,
+	STATS_BYTES,
+	STATS_SYSCALLS,
+	STATS_COUNTERS
+};
+
+static const char *stats_counter_names[STATS_COUNTERS] = {
+	"files", "bytes", "syscalls"
+};
+
+/* Seconds spent in each stage, and when the current one started */
+double stats_seconds[STATS_STAGES];
+struct timespec stats_started;
+
+/* Running totals, what each stage was charged, and the totals then */
+size_t stats_totals[STATS_COUNTERS];
+size_t stats_counts[STATS_STAGES][STATS_COUNTERS];
+size_t stats_charged[STATS_COUNTERS];
+
+/* Shallow hash filter queries, how many might have been seen, and how
+ * many of those had not (only the main thread queries the filter) */
+size_t stats_filter_queries, stats_filter_hits, stats_filter_false;
+
+inline void
+stats_count(enum stats_counter_t counter, size_t n)
+{
+	__sync_fetch_and_add(&stats_totals[counter], n);
+}
+
+inline double
+stats_elapsed(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - since->tv_sec)
+		+ (double)(now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+inline void
+stats_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &stats_started);
+}
+
+/* Charge the time since stats_start (or the last stats_stop) to a stage,
+ * and whatever was counted since then (workers have finished by now) */
+inline void
+stats_stop(enum stats_stage_t stage)
+{
+	int i;
+	size_t total;
+	stats_seconds[stage] += stats_elapsed(&stats_started);
+	for (i = 0; i < STATS_COUNTERS; ++i) {
+		total = stats_totals[i];
+		stats_counts[stage][i] += total - stats_charged[i];
+		stats_charged[i] = total;
+	}
+	stats_start();
+}
+
+/* Write the timings and counts as one JSON object (returns zero on
+ * failure) */
+int
+stats_write(const char *stats_file)
+{
+	int i, j;
+	FILE *out = fopen(stats_file, "w");
+	if (!out) {
+		return 0;
+	}
+	fprintf(out, "{\"stages\": {");
+	for (i = 0; i < STATS_STAGES; ++i) {
+		fprintf(out, "%s\"%s\": {\"seconds\": %.6f", (i > 0) ? ", " : "",
+				stats_stage_names[i], stats_seconds[i]);
+		for (j = 0; j < STATS_COUNTERS; ++j) {
+			fprintf(out, ", \"%s\": %lu", stats_counter_names[j],
+					(unsigned long)(stats_counts[i][j]));
+		}
+		fprintf(out, "}");
+	}
+	fprintf(out, "}, \"filter\": {\"queries\": %lu, \"hits\": %lu,"
+			" \"false_positives\": %lu}, \"peak_rss_kib\": %ld}\n",
+			(unsigned long)(stats_filter_queries), (unsigned long)(stats_filter_hits),
+			(unsigned long)(stats_filter_false), peak_memory());
+	return !fclose(out);
+}
+
+#endif /* FILE_STATS_H */
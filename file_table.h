@@ -0,0 +1,314 @@
+#ifndef FILE_TABLE_H
+#define FILE_TABLE_H
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_entry.h"
+
+#define TABLE_MIN_SLOTS  16
+#define TABLE_SHARD_BITS 6
+#define TABLE_SHARDS     (1 << TABLE_SHARD_BITS)
+
+/* A group of entries with the same key (a digest, or a shallow hash);
+ * members are chained through the entries, so groups never allocate */
+struct file_group_t
+{
+	/* The first bytes of the key (a slot without members is empty) */
+	uint64_t tag;
+	/* The earliest queue position of any member (for a stable report) */
+	size_t order, num_members;
+	struct file_entry_t *members;
+};
+
+/* An open-addressing (linear probing) table of groups, keyed by the
+ * fixed-width binary digests already stored in the entries */
+struct file_table_t
+{
+	struct file_group_t *slots;
+	size_t num_slots, num_groups;
+	/* Where each key lives within an entry, and how long it is */
+	size_t key_offset, key_length;
+};
+
+/* The same, split into shards that each have their own lock, so that
+ * parallel workers rarely contend when inserting */
+struct file_shards_t
+{
+	struct file_table_t tables[TABLE_SHARDS];
+	pthread_mutex_t locks[TABLE_SHARDS];
+};
+
+inline const unsigned char *
+table_key(const struct file_table_t *table, const struct file_entry_t *file_entry)
+{
+	return (const unsigned char *)(file_entry) + table->key_offset;
+}
+
+/* Digests are already well mixed, so their first bytes are the hash */
+inline uint64_t
+table_tag(const unsigned char *key)
+{
+	uint64_t tag;
+	memcpy(&tag, key, sizeof(uint64_t));
+	return tag;
+}
+
+/* Returns zero if no memory is available (expected is a size hint) */
+int
+table_init(struct file_table_t *table,
+		size_t key_offset, size_t key_length, size_t expected)
+{
+	size_t num_slots = TABLE_MIN_SLOTS;
+	assert(table && key_length >= sizeof(uint64_t));
+	/* Stay under three quarters full, without growing */
+	while (num_slots * 3 < expected * 4) {
+		num_slots *= 2;
+	}
+	table->slots = calloc(num_slots, sizeof(struct file_group_t));
+	table->num_slots = table->slots ? num_slots : 0;
+	table->num_groups = 0;
+	table->key_offset = key_offset;
+	table->key_length = key_length;
+	return table->slots != NULL;
+}
+
+/* Find the group for a key, or else the empty slot where it belongs */
+struct file_group_t *
+table_probe(const struct file_table_t *table, const unsigned char *key)
+{
+	uint64_t tag = table_tag(key);
+	size_t mask = table->num_slots - 1, i = (size_t)(tag) & mask;
+	struct file_group_t *slot;
+	for (;; i = (i + 1) & mask) {
+		slot = &table->slots[i];
+		if (slot->num_members == 0) {
+			return slot;
+		}
+		if (slot->tag == tag && !memcmp(table_key(table, slot->members),
+					key, table->key_length)) {
+			return slot;
+		}
+	}
+}
+
+inline struct file_group_t *
+table_find(const struct file_table_t *table, const unsigned char *key)
+{
+	struct file_group_t *slot = table_probe(table, key);
+	return (slot->num_members > 0) ? slot : NULL;
+}
+
+/* Double the number of slots (returns zero on failure) */
+int
+table_grow(struct file_table_t *table)
+{
+	size_t i;
+	struct file_table_t grown = *table;
+	grown.num_slots = 2 * table->num_slots;
+	grown.slots = calloc(grown.num_slots, sizeof(struct file_group_t));
+	if (!grown.slots) {
+		return 0;
+	}
+	for (i = 0; i < table->num_slots; ++i) {
+		if (table->slots[i].num_members > 0) {
+			*table_probe(&grown, table_key(table, table->slots[i].members))
+				= table->slots[i];
+		}
+	}
+	free(table->slots);
+	*table = grown;
+	return 1;
+}
+
+/* Add an entry to the group for its key, creating the group if need be
+ * (returns the group, which may move on the next insert, or NULL) */
+struct file_group_t *
+table_insert(struct file_table_t *table, struct file_entry_t *file_entry, size_t order)
+{
+	struct file_group_t *slot;
+	assert(table && file_entry);
+	if (4 * (table->num_groups + 1) > 3 * table->num_slots && !table_grow(table)) {
+		return NULL;
+	}
+	slot = table_probe(table, table_key(table, file_entry));
+	if (slot->num_members == 0) {
+		slot->tag = table_tag(table_key(table, file_entry));
+		slot->order = order;
+		++table->num_groups;
+	} else if (order < slot->order) {
+		slot->order = order;
+	}
+	file_entry->duplicate = slot->members;
+	slot->members = file_entry;
+	++slot->num_members;
+	return slot;
+}
+
+/* Take an entry out of its group, and the group out of the table once
+ * it is empty; the groups after it in the run are shifted back, unless
+ * that would put them ahead of their home slot, so probing still finds
+ * them (returns zero if the entry was not in the table) */
+int
+table_remove(struct file_table_t *table, struct file_entry_t *file_entry)
+{
+	size_t i, j, home, mask = table->num_slots - 1;
+	struct file_entry_t **member;
+	struct file_group_t *slot = table_find(table, table_key(table, file_entry));
+	if (!slot) {
+		return 0;
+	}
+	for (member = &slot->members; *member && *member != file_entry;
+			member = &(*member)->duplicate);
+	if (!*member) {
+		return 0;
+	}
+	*member = file_entry->duplicate;
+	file_entry->duplicate = NULL;
+	if (--slot->num_members > 0) {
+		return 1;
+	}
+	--table->num_groups;
+	i = (size_t)(slot - table->slots);
+	for (j = (i + 1) & mask; table->slots[j].num_members > 0; j = (j + 1) & mask) {
+		home = (size_t)(table->slots[j].tag) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table->slots[i] = table->slots[j];
+			i = j;
+		}
+	}
+	memset(&table->slots[i], 0, sizeof(struct file_group_t));
+	return 1;
+}
+
+inline void
+table_destroy(struct file_table_t *table)
+{
+	assert(table);
+	free(table->slots);
+	table->slots = NULL;
+	table->num_slots = table->num_groups = 0;
+}
+
+/* Constructors and destructors, in the manner of libcalg */
+
+struct file_table_t *
+table_new(size_t key_offset, size_t key_length, size_t expected)
+{
+	struct file_table_t *table = malloc(sizeof(struct file_table_t));
+	if (table && !table_init(table, key_offset, key_length, expected)) {
+		free(table);
+		table = NULL;
+	}
+	return table;
+}
+
+inline void
+table_free(struct file_table_t *table)
+{
+	table_destroy(table);
+	free(table);
+}
+
+struct file_shards_t *
+shards_new(size_t key_offset, size_t key_length, size_t expected)
+{
+	size_t i;
+	int status = 1;
+	struct file_shards_t *shards = malloc(sizeof(struct file_shards_t));
+	if (!shards) {
+		return NULL;
+	}
+	for (i = 0; i < TABLE_SHARDS; ++i) {
+		pthread_mutex_init(&shards->locks[i], NULL);
+		if (!table_init(&shards->tables[i],
+					key_offset, key_length, expected / TABLE_SHARDS)) {
+			status = 0;
+		}
+	}
+	if (!status) {
+		for (i = 0; i < TABLE_SHARDS; ++i) {
+			table_destroy(&shards->tables[i]);
+			pthread_mutex_destroy(&shards->locks[i]);
+		}
+		free(shards);
+		shards = NULL;
+	}
+	return shards;
+}
+
+void
+shards_free(struct file_shards_t *shards)
+{
+	size_t i;
+	for (i = 0; i < TABLE_SHARDS; ++i) {
+		table_destroy(&shards->tables[i]);
+		pthread_mutex_destroy(&shards->locks[i]);
+	}
+	free(shards);
+}
+
+/* Safe to call from any thread (returns zero on failure); the high
+ * bits of a key pick its shard, and the low bits its slot */
+int
+shards_insert(struct file_shards_t *shards, struct file_entry_t *file_entry, size_t order)
+{
+	int status;
+	size_t shard;
+	assert(shards && file_entry);
+	shard = (size_t)(table_tag(table_key(&shards->tables[0], file_entry))
+			>> (64 - TABLE_SHARD_BITS));
+	pthread_mutex_lock(&shards->locks[shard]);
+	status = table_insert(&shards->tables[shard], file_entry, order) != NULL;
+	pthread_mutex_unlock(&shards->locks[shard]);
+	return status;
+}
+
+inline size_t
+shards_num_groups(const struct file_shards_t *shards)
+{
+	size_t i, num_groups = 0;
+	for (i = 0; i < TABLE_SHARDS; ++i) {
+		num_groups += shards->tables[i].num_groups;
+	}
+	return num_groups;
+}
+
+/* Later groups first (the order the report has always used) */
+int
+compare_orders(const void *lhs, const void *rhs)
+{
+	size_t l = (*(struct file_group_t * const *)(lhs))->order;
+	size_t r = (*(struct file_group_t * const *)(rhs))->order;
+	return (l < r) - (l > r);
+}
+
+/* Collect every group in a new array, sorted by compare_orders (returns
+ * NULL on failure); only valid until the next insert */
+struct file_group_t **
+shards_groups(const struct file_shards_t *shards, size_t *num_groups)
+{
+	size_t i, j, n = 0;
+	struct file_group_t **groups;
+	assert(shards && num_groups);
+	*num_groups = shards_num_groups(shards);
+	groups = malloc((*num_groups + 1) * sizeof(struct file_group_t *));
+	if (!groups) {
+		return NULL;
+	}
+	for (i = 0; i < TABLE_SHARDS; ++i) {
+		for (j = 0; j < shards->tables[i].num_slots; ++j) {
+			if (shards->tables[i].slots[j].num_members > 0) {
+				groups[n++] = &shards->tables[i].slots[j];
+			}
+		}
+	}
+	assert(n == *num_groups);
+	qsort(groups, n, sizeof(struct file_group_t *), &compare_orders);
+	return groups;
+}
+
+#endif /* FILE_TABLE_H */
@@ -0,0 +1,414 @@
+#ifndef FILE_WALK_H
+#define FILE_WALK_H
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <libcalg-1.0/libcalg/slist.h>
+
+#include "file_arena.h"
+#include "file_entry.h"
+#include "file_info.h"
+
+#define WALK_BUFFER_SIZE 0x40000
+#define WALK_BATCH_SIZE  256
+#define WALK_MIN_TASKS   16
+#define WALK_UNREADABLE  2
+
+/* Each worker owns a deque of directories: the owner pushes and pops
+ * at the tail (depth first), while idle workers steal from the head */
+struct walk_deque_t
+{
+	pthread_mutex_t lock;
+	struct file_entry_t **tasks;
+	size_t head, tail, capacity;
+};
+
+/* State shared by every worker in a traversal */
+struct walk_t
+{
+	struct file_info_t *file_info;
+	pthread_mutex_t info_lock;
+	struct walk_deque_t *deques;
+	size_t num_workers;
+	/* Directories queued or being read (the walk ends at zero) */
+	size_t pending;
+	int failed;
+	/* Workers that find nothing to steal wait here for more directories
+	 * to be queued, or for the walk to end */
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle;
+	size_t queued, num_idle;
+};
+
+struct walk_worker_t
+{
+	struct walk_t *walk;
+	size_t id, batch_len;
+	char *dents, path_buffer[PATH_MAX_LEN];
+	/* Entries are allocated here, then merged into the session */
+	struct file_arena_t arena;
+	/* Entries are handed to the shared lists in batches */
+	struct file_entry_t *batch[WALK_BATCH_SIZE];
+};
+
+/* Deque operations */
+
+int
+deque_push(struct walk_deque_t *deque, struct file_entry_t *task)
+{
+	int status = 1;
+	struct file_entry_t **tasks;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail == deque->capacity) {
+		/* Reclaim stolen space before growing */
+		if (deque->head > 0) {
+			memmove(deque->tasks, deque->tasks + deque->head,
+					(deque->tail - deque->head) * sizeof(struct file_entry_t *));
+			deque->tail -= deque->head;
+			deque->head = 0;
+		} else {
+			tasks = realloc(deque->tasks,
+					2 * deque->capacity * sizeof(struct file_entry_t *));
+			if (tasks) {
+				deque->tasks = tasks;
+				deque->capacity *= 2;
+			} else {
+				status = 0;
+			}
+		}
+	}
+	if (status) {
+		deque->tasks[deque->tail++] = task;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return status;
+}
+
+struct file_entry_t *
+deque_pop(struct walk_deque_t *deque, int steal)
+{
+	struct file_entry_t *task = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->head < deque->tail) {
+		task = steal ? deque->tasks[deque->head++] : deque->tasks[--deque->tail];
+		if (deque->head == deque->tail) {
+			deque->head = deque->tail = 0;
+		}
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+/* Wake one idle worker (or every worker, once the walk is over) */
+void
+walk_wake(struct walk_t *walk, int all)
+{
+	if (all || __sync_add_and_fetch(&walk->num_idle, 0) > 0) {
+		pthread_mutex_lock(&walk->idle_lock);
+		if (all) {
+			pthread_cond_broadcast(&walk->idle);
+		} else {
+			pthread_cond_signal(&walk->idle);
+		}
+		pthread_mutex_unlock(&walk->idle_lock);
+	}
+}
+
+/* Wait until a directory is queued, or the walk is over (a worker that
+ * is queueing one counts it before looking for idle workers, so either
+ * it sees this one, or this one sees what it queued) */
+void
+walk_idle(struct walk_t *walk)
+{
+	pthread_mutex_lock(&walk->idle_lock);
+	__sync_fetch_and_add(&walk->num_idle, 1);
+	while (__sync_add_and_fetch(&walk->queued, 0) == 0
+			&& __sync_add_and_fetch(&walk->pending, 0) > 0
+			&& !__sync_add_and_fetch(&walk->failed, 0)) {
+		pthread_cond_wait(&walk->idle, &walk->idle_lock);
+	}
+	__sync_fetch_and_sub(&walk->num_idle, 1);
+	pthread_mutex_unlock(&walk->idle_lock);
+}
+
+/* Hand any batched entries to the shared lists (as record would) */
+void
+walk_flush(struct walk_worker_t *worker)
+{
+	size_t i;
+	SListEntry **list;
+	struct file_info_t *file_info = worker->walk->file_info;
+	pthread_mutex_lock(&worker->walk->info_lock);
+	for (i = 0; i < worker->batch_len; ++i) {
+		list = (worker->batch[i]->type == REGULAR) ?
+			&file_info->good_files : &file_info->bad_files;
+		++file_info->total_files;
+		if (!slist_prepend(list, worker->batch[i])) {
+			__sync_fetch_and_or(&worker->walk->failed, 1);
+		}
+	}
+	pthread_mutex_unlock(&worker->walk->info_lock);
+	worker->batch_len = 0;
+}
+
+/* Keep an entry, to be handed over with the next batch */
+inline void
+walk_keep(struct walk_worker_t *worker, struct file_entry_t *file_entry)
+{
+	worker->batch[worker->batch_len++] = file_entry;
+	if (worker->batch_len == WALK_BATCH_SIZE) {
+		walk_flush(worker);
+	}
+}
+
+/* Record one name in an open directory (returns zero on failure) */
+int
+walk_entry(struct walk_worker_t *worker, struct file_entry_t *directory,
+		int dirfd, const char *name, unsigned char d_type, size_t offset)
+{
+	size_t name_len;
+	struct file_entry_t *file_entry;
+	/* Avoid overflows, and ignore dotfiles */
+	name_len = strnlen(name, PATH_MAX_LEN - offset);
+	if (offset + name_len == PATH_MAX_LEN || name[0] == '.') {
+		return 1;
+	}
+	/* Only the name is stored (the rest of the path is the parent's) */
+	file_entry = new_entry(&worker->arena, directory, name, name_len);
+	if (!file_entry) {
+		return 0;
+	}
+	stat_entry_at(dirfd, name, d_type, file_entry);
+	/* Subdirectories become tasks for this worker (or a thief) */
+	if (file_entry->type == DIRECTORY) {
+		__sync_fetch_and_add(&worker->walk->pending, 1);
+		if (!deque_push(&worker->walk->deques[worker->id], file_entry)) {
+			__sync_fetch_and_sub(&worker->walk->pending, 1);
+			return 0;
+		}
+		__sync_fetch_and_add(&worker->walk->queued, 1);
+		walk_wake(worker->walk, 0);
+		return 1;
+	}
+	walk_keep(worker, file_entry);
+	return 1;
+}
+
+#ifdef SYS_getdents64
+/* Not every libc declares this (the kernel's layout) */
+struct walk_dirent64_t
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+/* Read one directory, relative to its own descriptor (returns zero on
+ * failure, or WALK_UNREADABLE if the directory could not be opened, or
+ * could not be read to the end) */
+int
+walk_directory(struct walk_worker_t *worker, struct file_entry_t *directory)
+{
+	int fd, status = 1;
+	size_t offset;
+	#ifdef SYS_getdents64
+	long n, position;
+	struct walk_dirent64_t *dent;
+	#else
+	DIR *stream;
+	struct dirent *dent;
+	#endif
+	/* Measure the prefix of every path in this directory */
+	offset = build_path(directory, worker->path_buffer);
+	if (offset == 0 || offset + 1 >= PATH_MAX_LEN) {
+		return 1;
+	}
+	fd = open(worker->path_buffer, O_RDONLY | O_DIRECTORY);
+	stats_count(STATS_SYSCALLS, 1);
+	++offset;
+	if (fd < 0) {
+		directory->type = (errno == EACCES) ? INACCESSIBLE : INVALID;
+		return WALK_UNREADABLE;
+	}
+	errno = 0;
+	#ifdef SYS_getdents64
+	/* Use a large buffer, so that big directories take few calls */
+	while (status && (n = syscall(SYS_getdents64, fd, worker->dents, WALK_BUFFER_SIZE)) > 0) {
+		stats_count(STATS_SYSCALLS, 1);
+		for (position = 0; status && position < n; position += dent->d_reclen) {
+			dent = (struct walk_dirent64_t *)(worker->dents + position);
+			status = walk_entry(worker, directory, fd, dent->d_name, dent->d_type, offset);
+		}
+	}
+	/* What was read is kept, but the directory is reported as well */
+	if (status && n < 0) {
+		directory->type = (errno == EACCES) ? INACCESSIBLE : INVALID;
+		status = WALK_UNREADABLE;
+	}
+	/* The last call (which found the end), and closing */
+	stats_count(STATS_SYSCALLS, 2);
+	if (close(fd)) {
+		#ifndef NDEBUG
+		fprintf(stderr, "[WARNING] '%s' (close failed)\n", worker->path_buffer);
+		#endif
+	}
+	#else
+	stream = fdopendir(fd);
+	if (!stream) {
+		close(fd);
+		return 1;
+	}
+	while (status && (dent = readdir(stream))) {
+		status = walk_entry(worker, directory, dirfd(stream), dent->d_name, dent->d_type, offset);
+		errno = 0;
+	}
+	/* What was read is kept, but the directory is reported as well */
+	if (status && errno) {
+		directory->type = (errno == EACCES) ? INACCESSIBLE : INVALID;
+		status = WALK_UNREADABLE;
+	}
+	/* Calls readdir made are not seen, only closing */
+	stats_count(STATS_SYSCALLS, 1);
+	if (closedir(stream)) {
+		#ifndef NDEBUG
+		fprintf(stderr, "[WARNING] '%s' (close failed)\n", worker->path_buffer);
+		#endif
+	}
+	#endif
+	return status;
+}
+
+void *
+walk_work(void *data)
+{
+	size_t i;
+	struct walk_worker_t *worker = (struct walk_worker_t *)(data);
+	struct walk_t *walk = worker->walk;
+	struct file_entry_t *directory;
+	while (__sync_add_and_fetch(&walk->pending, 0) > 0
+			&& !__sync_add_and_fetch(&walk->failed, 0)) {
+		directory = deque_pop(&walk->deques[worker->id], 0);
+		/* Steal from the others, starting with the next worker */
+		for (i = 1; !directory && i < walk->num_workers; ++i) {
+			directory = deque_pop(&walk->deques[(worker->id + i) % walk->num_workers], 1);
+		}
+		if (!directory) {
+			walk_idle(walk);
+			continue;
+		}
+		__sync_fetch_and_sub(&walk->queued, 1);
+		switch (walk_directory(worker, directory)) {
+		case 0:
+			__sync_fetch_and_or(&walk->failed, 1);
+			break;
+		case WALK_UNREADABLE:
+			/* Keep this entry, to warn about it */
+			walk_keep(worker, directory);
+			break;
+		default:
+			/* Discard this entry (its memory stays in the arena) */
+			break;
+		}
+		if (__sync_sub_and_fetch(&walk->pending, 1) == 0) {
+			walk_wake(walk, 1);
+		}
+	}
+	/* Directories still queued after a failure are abandoned */
+	if (__sync_add_and_fetch(&walk->failed, 0)) {
+		walk_wake(walk, 1);
+	}
+	walk_flush(worker);
+	return NULL;
+}
+
+/* Explore every directory on the file stack using (at most) the given
+ * number of workers; returns zero on success, like traverse did */
+int
+walk_tree(struct file_info_t *file_info, size_t num_workers)
+{
+	size_t i, num_started;
+	pthread_t *threads;
+	struct walk_t walk;
+	struct walk_worker_t *workers;
+	struct file_entry_t *directory;
+	assert(file_info);
+	if (num_workers < 1) {
+		num_workers = 1;
+	}
+	walk.file_info = file_info;
+	walk.num_workers = num_workers;
+	walk.pending = walk.queued = walk.num_idle = 0;
+	walk.failed = 0;
+	pthread_mutex_init(&walk.info_lock, NULL);
+	pthread_mutex_init(&walk.idle_lock, NULL);
+	pthread_cond_init(&walk.idle, NULL);
+	walk.deques = calloc(num_workers, sizeof(struct walk_deque_t));
+	workers = calloc(num_workers, sizeof(struct walk_worker_t));
+	threads = calloc(num_workers, sizeof(pthread_t));
+	for (i = 0; walk.deques && workers && threads && i < num_workers; ++i) {
+		pthread_mutex_init(&walk.deques[i].lock, NULL);
+		walk.deques[i].tasks = malloc(WALK_MIN_TASKS * sizeof(struct file_entry_t *));
+		walk.deques[i].capacity = WALK_MIN_TASKS;
+		workers[i].walk = &walk;
+		workers[i].id = i;
+		workers[i].dents = malloc(WALK_BUFFER_SIZE);
+		if (!walk.deques[i].tasks || !workers[i].dents) {
+			walk.failed = 1;
+		}
+	}
+	if (!walk.deques || !workers || !threads) {
+		walk.failed = 1;
+	}
+	/* Deal the directories named so far out to the workers */
+	for (i = 0; !walk.failed && slist_length(file_info->file_stack) > 0; ++i) {
+		directory = (struct file_entry_t *)(slist_data(file_info->file_stack));
+		slist_remove_entry(&file_info->file_stack, file_info->file_stack);
+		assert(directory->type == DIRECTORY);
+		++walk.pending;
+		++walk.queued;
+		if (!deque_push(&walk.deques[i % num_workers], directory)) {
+			walk.failed = 1;
+		}
+	}
+	/* Start the workers (a single worker is just this thread) */
+	num_started = 0;
+	if (!walk.failed) {
+		for (i = 1; i < num_workers; ++i, ++num_started) {
+			if (pthread_create(&threads[i], NULL, &walk_work, &workers[i])) {
+				break;
+			}
+		}
+		walk_work(&workers[0]);
+		for (i = 1; i <= num_started; ++i) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	/* Cleanup (anything left over was abandoned) */
+	for (i = 0; walk.deques && i < num_workers; ++i) {
+		free(walk.deques[i].tasks);
+		pthread_mutex_destroy(&walk.deques[i].lock);
+		if (workers) {
+			free(workers[i].dents);
+			arena_merge(&file_info->arena, &workers[i].arena);
+		}
+	}
+	pthread_mutex_destroy(&walk.info_lock);
+	pthread_mutex_destroy(&walk.idle_lock);
+	pthread_cond_destroy(&walk.idle);
+	free(walk.deques);
+	free(workers);
+	free(threads);
+	return walk.failed;
+}
+
+#endif /* FILE_WALK_H */
@@ -0,0 +1,532 @@
+#ifndef FILE_WATCH_H
+#define FILE_WATCH_H
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "file_entry.h"
+
+/* Directories are watched for files that are written, moved or deleted,
+ * and for subdirectories coming and going (watches do not follow links,
+ * and do not outlive an unlinked file's last event) */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+		| IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+/* Events are read (and dispatched) this many bytes at a time */
+#define WATCH_BUFFER_SIZE ((size_t)(0x10000))
+#define WATCH_MIN_SLOTS   ((size_t)(0x400))
+/* The parent of a root, and the end of a chain (of children, of slots
+ * free for reuse, or of a probe); a slot that is free has no parent */
+#define WATCH_ROOT        ((int32_t)(-1))
+#define WATCH_NONE        ((int32_t)(-1))
+#define WATCH_UNUSED      ((int32_t)(-2))
+
+/* What a batch of events did to a file: it was written, or moved here
+ * (or its directory was), so it should be hashed; or it was deleted, or
+ * moved away, so it should be forgotten */
+enum watch_event_t {
+	WATCH_WRITTEN,
+	WATCH_REMOVED
+};
+
+typedef void (*watch_func_t)(const char *, enum watch_event_t, void *);
+
+/* A watched directory is its watch descriptor, its parent's slot, its
+ * first child's and next sibling's, and its name (a root's name is its
+ * whole path); the kernel hands out descriptors in a cycle, without
+ * reusing them soon, so they are mapped to slots, which are reused */
+struct watch_dir_t
+{
+	int32_t wd, parent, child, sibling;
+	uint32_t name;
+};
+
+struct file_watch_t
+{
+	int fd;
+	/* Directories (slots let go of are chained by sibling, for reuse) */
+	struct watch_dir_t *dirs;
+	size_t dirs_used, dirs_size, num_dirs;
+	int32_t free_dir;
+	/* Slots by descriptor (open addressing, no more than half full) */
+	int32_t *wds;
+	size_t wds_size;
+	/* Names of watched directories, back to back (those of directories
+	 * let go of are dead, until they are half the names) */
+	char *names;
+	size_t names_used, names_size, names_dead;
+	/* Directories still to be read while adding a tree */
+	int32_t *stack;
+	size_t stack_used, stack_size;
+	char path[PATH_MAX_LEN];
+	/* Set once the watch limit is reached (so it is only reported once) */
+	int exhausted;
+};
+
+/* Returns zero on failure (see errno) */
+int
+watch_init(struct file_watch_t *watch)
+{
+	memset(watch, 0, sizeof(struct file_watch_t));
+	watch->free_dir = WATCH_NONE;
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	return watch->fd >= 0;
+}
+
+void
+watch_destroy(struct file_watch_t *watch)
+{
+	if (watch->fd >= 0) {
+		close(watch->fd);
+	}
+	free(watch->dirs);
+	free(watch->wds);
+	free(watch->names);
+	free(watch->stack);
+	memset(watch, 0, sizeof(struct file_watch_t));
+	watch->fd = -1;
+	watch->free_dir = WATCH_NONE;
+}
+
+/* Bytes used to find the path of every watch (the kernel's own memory,
+ * about a kilobyte per watch, is not counted) */
+inline size_t
+watch_memory(const struct file_watch_t *watch)
+{
+	return watch->dirs_size * sizeof(struct watch_dir_t)
+		+ watch->wds_size * sizeof(int32_t) + watch->names_size
+		+ watch->stack_size * sizeof(int32_t);
+}
+
+/* Grow a buffer (by doubling) until it can hold this many more items */
+inline int
+watch_reserve(void **buffer, size_t *size, size_t used, size_t more, size_t item)
+{
+	void *grown;
+	size_t n = *size ? *size : WATCH_MIN_SLOTS;
+	while (used + more > n) {
+		n *= 2;
+	}
+	if (n == *size) {
+		return 1;
+	}
+	grown = realloc(*buffer, n * item);
+	if (!grown) {
+		return 0;
+	}
+	*buffer = grown;
+	*size = n;
+	return 1;
+}
+
+inline size_t
+watch_home(const struct file_watch_t *watch, int wd)
+{
+	return (size_t)((uint32_t)(wd) * UINT32_C(0x9E3779B1)) & (watch->wds_size - 1);
+}
+
+/* The slot of a watch descriptor, or WATCH_NONE */
+int32_t
+watch_lookup(const struct file_watch_t *watch, int wd)
+{
+	size_t i, mask = watch->wds_size - 1;
+	if (watch->wds_size == 0) {
+		return WATCH_NONE;
+	}
+	for (i = watch_home(watch, wd); watch->wds[i] != WATCH_NONE; i = (i + 1) & mask) {
+		if (watch->dirs[watch->wds[i]].wd == wd) {
+			return watch->wds[i];
+		}
+	}
+	return WATCH_NONE;
+}
+
+/* Map a slot's descriptor to it, first doubling the map (and mapping
+ * every slot again) if it would be more than half full */
+int
+watch_map(struct file_watch_t *watch, int32_t slot)
+{
+	size_t i, n = watch->wds_size ? watch->wds_size : WATCH_MIN_SLOTS, mask;
+	int32_t *wds;
+	int32_t j;
+	for (; 2 * (watch->num_dirs + 1) > n; n *= 2);
+	if (n != watch->wds_size) {
+		if (!(wds = malloc(n * sizeof(int32_t)))) {
+			return 0;
+		}
+		free(watch->wds);
+		watch->wds = wds;
+		watch->wds_size = n;
+		for (i = 0; i < n; ++i) {
+			watch->wds[i] = WATCH_NONE;
+		}
+		for (j = 0; (size_t)(j) < watch->dirs_used; ++j) {
+			if (watch->dirs[j].parent != WATCH_UNUSED && j != slot) {
+				watch_map(watch, j);
+			}
+		}
+	}
+	mask = watch->wds_size - 1;
+	for (i = watch_home(watch, watch->dirs[slot].wd); watch->wds[i] != WATCH_NONE;
+			i = (i + 1) & mask);
+	watch->wds[i] = slot;
+	return 1;
+}
+
+/* Take a slot's descriptor out of the map; the slots after it in the
+ * run are shifted back, unless that would put them ahead of their home,
+ * so probing still finds them (as in table_remove) */
+void
+watch_unmap(struct file_watch_t *watch, int32_t slot)
+{
+	size_t i, j, home, mask = watch->wds_size - 1;
+	for (i = watch_home(watch, watch->dirs[slot].wd); watch->wds[i] != slot;
+			i = (i + 1) & mask);
+	for (j = (i + 1) & mask; watch->wds[j] != WATCH_NONE; j = (j + 1) & mask) {
+		home = watch_home(watch, watch->dirs[watch->wds[j]].wd);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			watch->wds[i] = watch->wds[j];
+			i = j;
+		}
+	}
+	watch->wds[i] = WATCH_NONE;
+}
+
+/* Copy the names still in use into a new buffer, once at least half of
+ * them are dead (if there is no memory for it, they stay where they are) */
+void
+watch_compact(struct file_watch_t *watch)
+{
+	size_t i, length, used = 0;
+	char *names;
+	if (watch->names_dead == 0 || 2 * watch->names_dead < watch->names_used
+			|| !(names = malloc(watch->names_size))) {
+		return;
+	}
+	for (i = 0; i < watch->dirs_used; ++i) {
+		if (watch->dirs[i].parent == WATCH_UNUSED) {
+			continue;
+		}
+		length = strlen(watch->names + watch->dirs[i].name) + 1;
+		memcpy(names + used, watch->names + watch->dirs[i].name, length);
+		watch->dirs[i].name = (uint32_t)(used);
+		used += length;
+	}
+	free(watch->names);
+	watch->names = names;
+	watch->names_used = used;
+	watch->names_dead = 0;
+}
+
+/* Take a slot out of its parent's children */
+void
+watch_unlink(struct file_watch_t *watch, int32_t slot)
+{
+	int32_t *link;
+	if (watch->dirs[slot].parent < 0) {
+		return;
+	}
+	for (link = &watch->dirs[watch->dirs[slot].parent].child; *link != slot;
+			link = &watch->dirs[*link].sibling);
+	*link = watch->dirs[slot].sibling;
+}
+
+/* Record a watch, replacing its name and parent if it is already known
+ * (the kernel returns the same descriptor for a directory that is
+ * already watched); returns its slot, or WATCH_NONE on failure */
+int32_t
+watch_slot(struct file_watch_t *watch, int wd, int32_t parent, const char *name)
+{
+	size_t length = strlen(name) + 1;
+	int32_t slot = watch_lookup(watch, wd);
+	watch_compact(watch);
+	if (!watch_reserve((void **)(&watch->names), &watch->names_size,
+				watch->names_used, length, 1)) {
+		return WATCH_NONE;
+	}
+	if (slot != WATCH_NONE) {
+		watch_unlink(watch, slot);
+		watch->names_dead += strlen(watch->names + watch->dirs[slot].name) + 1;
+	} else {
+		if (watch->free_dir != WATCH_NONE) {
+			slot = watch->free_dir;
+		} else if (watch_reserve((void **)(&watch->dirs), &watch->dirs_size,
+					watch->dirs_used, 1, sizeof(struct watch_dir_t))) {
+			slot = (int32_t)(watch->dirs_used);
+		} else {
+			return WATCH_NONE;
+		}
+		watch->dirs[slot].wd = wd;
+		if (!watch_map(watch, slot)) {
+			return WATCH_NONE;
+		}
+		if (slot == watch->free_dir) {
+			watch->free_dir = watch->dirs[slot].sibling;
+		} else {
+			++watch->dirs_used;
+		}
+		watch->dirs[slot].child = WATCH_NONE;
+		++watch->num_dirs;
+	}
+	watch->dirs[slot].parent = parent;
+	watch->dirs[slot].sibling = WATCH_NONE;
+	if (parent >= 0) {
+		watch->dirs[slot].sibling = watch->dirs[parent].child;
+		watch->dirs[parent].child = slot;
+	}
+	watch->dirs[slot].name = (uint32_t)(watch->names_used);
+	memcpy(watch->names + watch->names_used, name, length);
+	watch->names_used += length;
+	return slot;
+}
+
+/* The path of a name in a watched directory (by slot), or of the
+ * directory itself if name is NULL (valid until the next call; NULL if
+ * too long) */
+const char *
+watch_path(struct file_watch_t *watch, int32_t slot, const char *name)
+{
+	int32_t chain[PATH_MAX_LEN / 2];
+	size_t depth = 0, offset = 0, length;
+	const char *part;
+	for (; slot >= 0 && depth < PATH_MAX_LEN / 2; slot = watch->dirs[slot].parent) {
+		chain[depth++] = slot;
+	}
+	while (depth > 0) {
+		part = watch->names + watch->dirs[chain[--depth]].name;
+		length = strlen(part);
+		if (offset + length + 1 >= PATH_MAX_LEN) {
+			return NULL;
+		}
+		memcpy(watch->path + offset, part, length);
+		offset += length;
+		if (depth > 0 || name) {
+			watch->path[offset++] = '/';
+		}
+	}
+	if (name) {
+		length = strlen(name);
+		if (offset + length >= PATH_MAX_LEN) {
+			return NULL;
+		}
+		memcpy(watch->path + offset, name, length);
+		offset += length;
+	}
+	watch->path[offset] = '\0';
+	return watch->path;
+}
+
+/* Stop watching a directory (by slot) and everything below it, leaves
+ * first: each step goes down first children to one that has none, and
+ * lets it go, which makes its next sibling the first child */
+void
+watch_forget(struct file_watch_t *watch, int32_t slot)
+{
+	int32_t leaf, parent;
+	if (slot < 0) {
+		return;
+	}
+	watch_unlink(watch, slot);
+	for (leaf = slot; ; leaf = parent) {
+		for (; watch->dirs[leaf].child != WATCH_NONE; leaf = watch->dirs[leaf].child);
+		parent = watch->dirs[leaf].parent;
+		if (leaf != slot) {
+			watch->dirs[parent].child = watch->dirs[leaf].sibling;
+		}
+		inotify_rm_watch(watch->fd, watch->dirs[leaf].wd);
+		watch_unmap(watch, leaf);
+		watch->names_dead += strlen(watch->names + watch->dirs[leaf].name) + 1;
+		watch->dirs[leaf].parent = WATCH_UNUSED;
+		watch->dirs[leaf].sibling = watch->free_dir;
+		watch->free_dir = leaf;
+		--watch->num_dirs;
+		if (leaf == slot) {
+			return;
+		}
+	}
+}
+
+/* The watched subdirectory (by slot) with this name, or WATCH_NONE */
+int32_t
+watch_find(const struct file_watch_t *watch, int32_t parent, const char *name)
+{
+	int32_t child;
+	for (child = watch->dirs[parent].child; child != WATCH_NONE;
+			child = watch->dirs[child].sibling) {
+		if (!strcmp(watch->names + watch->dirs[child].name, name)) {
+			return child;
+		}
+	}
+	return WATCH_NONE;
+}
+
+/* Watch one directory (returns its slot, or WATCH_NONE if it cannot be) */
+int32_t
+watch_one(struct file_watch_t *watch, const char *path, int32_t parent, const char *name)
+{
+	int32_t slot;
+	int wd = inotify_add_watch(watch->fd, path, WATCH_MASK);
+	if (wd < 0) {
+		if (errno == ENOSPC && !watch->exhausted) {
+			fprintf(stderr, "[WARNING] '%s' (out of watches, see"
+					" /proc/sys/fs/inotify/max_user_watches)\n", path);
+			watch->exhausted = 1;
+		}
+		return WATCH_NONE;
+	}
+	slot = watch_slot(watch, wd, parent, name);
+	if (slot == WATCH_NONE && watch_lookup(watch, wd) == WATCH_NONE) {
+		inotify_rm_watch(watch->fd, wd);
+	}
+	return slot;
+}
+
+/* Watch a directory and every directory below it (parent is WATCH_ROOT,
+ * or the slot of the directory it was found in); files found on the
+ * way are dispatched as written, unless dispatch is NULL (returns zero
+ * if the directory itself could not be watched) */
+int
+watch_add(struct file_watch_t *watch, const char *path, int32_t parent,
+		watch_func_t dispatch, void *data)
+{
+	int32_t slot, child;
+	DIR *stream;
+	struct dirent *dent;
+	unsigned char d_type;
+	const char *name = path;
+	char root[PATH_MAX_LEN];
+	size_t length;
+	if (parent != WATCH_ROOT) {
+		name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	} else {
+		/* Roots are kept without trailing slashes (paths add their own) */
+		length = strnlen(path, PATH_MAX_LEN - 1);
+		for (; length > 1 && path[length - 1] == '/'; --length);
+		memcpy(root, path, length);
+		root[length] = '\0';
+		name = root;
+	}
+	slot = watch_one(watch, path, parent, name);
+	if (slot == WATCH_NONE) {
+		return 0;
+	}
+	watch->stack_used = 0;
+	if (!watch_reserve((void **)(&watch->stack), &watch->stack_size, 0, 1, sizeof(int32_t))) {
+		return 1;
+	}
+	watch->stack[watch->stack_used++] = slot;
+	/* Depth first, so the stack stays small */
+	while (watch->stack_used > 0) {
+		slot = watch->stack[--watch->stack_used];
+		if (!watch_path(watch, slot, NULL) || !(stream = opendir(watch->path))) {
+			continue;
+		}
+		while ((dent = readdir(stream))) {
+			/* Hidden files and directories are skipped, as by a scan */
+			if (dent->d_name[0] == '.' || !watch_path(watch, slot, dent->d_name)) {
+				continue;
+			}
+			d_type = dent->d_type;
+			if (d_type == DT_UNKNOWN) {
+				switch (stat_entry_at(dirfd(stream), dent->d_name, DT_UNKNOWN, NULL)) {
+				case DIRECTORY: d_type = DT_DIR; break;
+				case REGULAR: d_type = DT_REG; break;
+				default: break;
+				}
+			}
+			if (d_type == DT_REG && dispatch) {
+				(*dispatch)(watch->path, WATCH_WRITTEN, data);
+			} else if (d_type == DT_DIR
+					&& (child = watch_one(watch, watch->path, slot, dent->d_name)) != WATCH_NONE
+					&& watch_reserve((void **)(&watch->stack), &watch->stack_size,
+						watch->stack_used, 1, sizeof(int32_t))) {
+				watch->stack[watch->stack_used++] = child;
+			}
+		}
+		closedir(stream);
+	}
+	return 1;
+}
+
+/* Read the events that are waiting (without blocking), and dispatch what
+ * happened to each file; the same thing happening to the same file twice
+ * in a row is dispatched once (returns how many events were read, or -1
+ * on failure) */
+long
+watch_read(struct file_watch_t *watch, watch_func_t dispatch, void *data)
+{
+	long num_events = 0;
+	ssize_t n, position;
+	int last_wd = 0;
+	int32_t slot;
+	enum watch_event_t type, last_type = WATCH_REMOVED;
+	const char *path, *last_name = NULL;
+	const struct inotify_event *event;
+	char buffer[WATCH_BUFFER_SIZE]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while ((n = read(watch->fd, buffer, WATCH_BUFFER_SIZE)) > 0) {
+		last_name = NULL;
+		for (position = 0; position < n;
+				position += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)(buffer + position);
+			++num_events;
+			if (event->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "[WARNING] events were lost (queue overflow)\n");
+				continue;
+			}
+			/* The directory is gone (or no longer watched, in which case it
+			 * was already let go of) */
+			slot = watch_lookup(watch, event->wd);
+			if (event->mask & IN_IGNORED) {
+				watch_forget(watch, slot);
+				continue;
+			}
+			if (slot == WATCH_NONE || event->len == 0 || event->name[0] == '.') {
+				continue;
+			}
+			path = watch_path(watch, slot, event->name);
+			if (!path) {
+				continue;
+			}
+			/* New directories are watched, and what is in them dispatched;
+			 * those that leave stop being watched (a directory renamed in
+			 * place is both) */
+			if (event->mask & IN_ISDIR) {
+				if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+					watch_add(watch, path, slot, dispatch, data);
+				} else if (event->mask & IN_MOVED_FROM) {
+					watch_forget(watch, watch_find(watch, slot, event->name));
+				}
+				last_name = NULL;
+				continue;
+			}
+			if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+				type = WATCH_WRITTEN;
+			} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				type = WATCH_REMOVED;
+			} else {
+				/* Files are hashed once written (and closed), not created */
+				continue;
+			}
+			if (last_name && event->wd == last_wd && type == last_type
+					&& !strcmp(event->name, last_name)) {
+				continue;
+			}
+			last_wd = event->wd;
+			last_name = event->name;
+			last_type = type;
+			(*dispatch)(path, type, data);
+		}
+	}
+	if (n < 0 && errno != EAGAIN && errno != EINTR) {
+		return -1;
+	}
+	return num_events;
+}
+
+#endif /* FILE_WATCH_H */
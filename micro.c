@@ -0,0 +1,414 @@
+/* For O_DIRECT and statx, where available (as in bloom.c) */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libcalg-1.0/libcalg/slist.h>
+
+#include "file_digest.h"
+#include "file_entry.h"
+#include "file_filter.h"
+#include "file_hash.h"
+#include "file_info.h"
+#include "file_table.h"
+
+#include "persist.h"
+
+/* Micro-benchmarks of the hot kernels, each over fixed inputs: files of
+ * fixed sizes and contents (written first, so they are cached, and
+ * this times hashing rather than the disk), and keys made by counting */
+#define MICRO_DEFAULT_KEYS    ((size_t)(0x40000))
+#define MICRO_DEFAULT_SECONDS 0.5
+#define MICRO_BLOCK_SIZE      ((size_t)(0x10000))
+
+/* One file for each full hash strategy (see choose_strategy) */
+static const struct micro_file_t
+{
+	const char *name;
+	off_t size;
+} micro_files[] = {
+	{ "read",   (off_t)(0x80000) },
+	{ "map",    (off_t)(0x1000000) },
+	{ "stream", (off_t)(0x6000000) },
+	{ "tree",   TREE_MIN_SIZE },
+	{ NULL,     (off_t)(0) }
+};
+
+static const char *micro_only = NULL;
+static double micro_seconds = MICRO_DEFAULT_SECONDS;
+static struct timespec micro_started;
+
+inline uint64_t
+micro_mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static inline int
+micro_selected(const char *name)
+{
+	return !micro_only || strstr(name, micro_only);
+}
+
+static inline void
+micro_start(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &micro_started);
+}
+
+static inline double
+micro_elapsed(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - micro_started.tv_sec)
+		+ (double)(now.tv_nsec - micro_started.tv_nsec) / 1e9;
+}
+
+void
+micro_report(const char *name, size_t ops, double seconds, double bytes)
+{
+	printf("%-28s %10lu %14.1f %16.1f\n", name, (unsigned long)(ops),
+			seconds * 1e9 / (double)(ops), bytes / seconds);
+}
+
+/* Write a file of fixed contents (returns zero on failure) */
+int
+micro_write(const char *path, off_t size)
+{
+	size_t i, length;
+	off_t offset;
+	uint64_t words[MICRO_BLOCK_SIZE / sizeof(uint64_t)];
+	FILE *out = fopen(path, "w");
+	if (!out) {
+		return 0;
+	}
+	for (offset = 0; offset < size; offset += length) {
+		length = (size - offset < (off_t)(MICRO_BLOCK_SIZE)) ?
+			(size_t)(size - offset) : MICRO_BLOCK_SIZE;
+		for (i = 0; i < MICRO_BLOCK_SIZE / sizeof(uint64_t); ++i) {
+			words[i] = micro_mix((uint64_t)(offset) / sizeof(uint64_t) + i);
+		}
+		if (fwrite(words, 1, length, out) != length) {
+			fclose(out);
+			return 0;
+		}
+	}
+	return !fclose(out);
+}
+
+/* Hash one file at a depth, over and over, for the set time */
+void
+micro_hash(struct file_entry_t *file_entry, enum hash_depth_t depth, const char *name)
+{
+	int point;
+	size_t ops;
+	off_t offset, length, bytes = 0;
+	double seconds = 0.0;
+	if (!micro_selected(name)) {
+		return;
+	}
+	if (depth == FULL) {
+		bytes = file_entry->size;
+	}
+	for (point = 0; depth != FULL && sample_span(file_entry, depth, point, &offset, &length); ++point) {
+		bytes += length;
+	}
+	micro_start();
+	for (ops = 0; ops == 0 || (seconds = micro_elapsed()) < micro_seconds; ++ops) {
+		/* Forget the last digest (stages only sample after a shallow hash) */
+		file_entry->hashed = (depth == SHALLOW) ? NONE : SHALLOW;
+		file_entry->sample = file_entry->shash;
+		if (!hash_entry(file_entry, depth)) {
+			fprintf(stderr, "[ERROR] '%s' (hash failed)\n", name);
+			return;
+		}
+	}
+	micro_report(name, ops, seconds, (double)(bytes) * (double)(ops));
+}
+
+/* Stages are timed on the file that is mapped (large enough to spread
+ * every sample out) */
+#define MICRO_STAGE_FILE 1
+
+static const struct micro_depth_t
+{
+	enum hash_depth_t depth;
+	const char *name;
+} micro_depths[] = {
+	{ SHALLOW, "hash_entry/shallow" },
+	{ HEAD,    "hash_entry/head" },
+	{ TAIL,    "hash_entry/tail" },
+	{ SAMPLE,  "hash_entry/middle" },
+	{ NONE,    NULL }
+};
+
+/* hash_entry at every depth, and (in full) with every strategy */
+int
+micro_hash_entry(struct file_info_t *file_info, const char *directory)
+{
+	size_t i, j;
+	int wanted;
+	char path[PATH_MAX_LEN], name[64];
+	struct stat status;
+	struct file_entry_t *file_entry;
+	for (i = 0; micro_files[i].name; ++i) {
+		snprintf(name, sizeof(name), "hash_entry/full/%s", micro_files[i].name);
+		wanted = micro_selected(name);
+		for (j = 0; i == MICRO_STAGE_FILE && micro_depths[j].name; ++j) {
+			wanted |= micro_selected(micro_depths[j].name);
+		}
+		if (!wanted) {
+			continue;
+		}
+		snprintf(path, PATH_MAX_LEN, "%s/%s", directory, micro_files[i].name);
+		if (!micro_write(path, micro_files[i].size) || stat(path, &status)) {
+			fprintf(stderr, "[FATAL] '%s' (cannot write)\n", path);
+			unlink(path);
+			return 0;
+		}
+		file_entry = new_entry(&file_info->arena, NULL, path, strlen(path));
+		if (!file_entry) {
+			unlink(path);
+			return 0;
+		}
+		file_entry->type = REGULAR;
+		file_entry->size = status.st_size;
+		if (i == MICRO_STAGE_FILE) {
+			hash_entry(file_entry, SHALLOW);
+			for (j = 0; micro_depths[j].name; ++j) {
+				micro_hash(file_entry, micro_depths[j].depth, micro_depths[j].name);
+			}
+		}
+		micro_hash(file_entry, FULL, name);
+		free(file_entry->leaves);
+		file_entry->leaves = NULL;
+		unlink(path);
+	}
+	release_hash_window();
+	return 1;
+}
+
+/* The filter of shallow hashes, sized by optimize_filter for all keys */
+void
+micro_filter(struct file_info_t *file_info, struct file_entry_t **entries, size_t n)
+{
+	size_t i, j, found = 0;
+	uint64_t keys[FILTER_BATCH_SIZE];
+	unsigned char maybe[FILTER_BATCH_SIZE];
+	double seconds;
+	struct file_scalable_t scalable;
+	optimize_filter(file_info);
+	if (!file_info->shash_filter) {
+		return;
+	}
+	if (micro_selected("filter_insert")) {
+		micro_start();
+		for (i = 0; i < n; ++i) {
+			filter_insert(file_info->shash_filter, (unsigned char *)(&entries[i]->shash));
+		}
+		seconds = micro_elapsed();
+		micro_report("filter_insert", n, seconds, (double)(n * sizeof(uint64_t)));
+	}
+	/* Half of the keys queried are present, half are not */
+	if (micro_selected("filter_query")) {
+		micro_start();
+		for (i = 0; i < n; ++i) {
+			keys[0] = (i & 1) ? entries[i]->shash : ~entries[i]->shash;
+			found += filter_query(file_info->shash_filter, (unsigned char *)(keys));
+		}
+		seconds = micro_elapsed();
+		micro_report("filter_query", n, seconds, (double)(n * sizeof(uint64_t)));
+	}
+	if (micro_selected("filter_query_batch")) {
+		micro_start();
+		for (i = 0; i < n; i += FILTER_BATCH_SIZE) {
+			for (j = 0; j < FILTER_BATCH_SIZE && i + j < n; ++j) {
+				keys[j] = ((i + j) & 1) ? entries[i + j]->shash : ~entries[i + j]->shash;
+			}
+			filter_query_batch(file_info->shash_filter, keys, j, maybe);
+			for (; j > 0; --j) {
+				found += maybe[j - 1];
+			}
+		}
+		seconds = micro_elapsed();
+		micro_report("filter_query_batch", n, seconds, (double)(n * sizeof(uint64_t)));
+	}
+	/* The scalable filter starts out small, and grows while inserting */
+	if (micro_selected("scalable") && scalable_init(&scalable, n / 64, PR_FP)) {
+		micro_start();
+		for (i = 0; i < n; ++i) {
+			scalable_insert(&scalable, (unsigned char *)(&entries[i]->shash));
+		}
+		seconds = micro_elapsed();
+		micro_report("scalable_insert", n, seconds, (double)(n * sizeof(uint64_t)));
+		micro_start();
+		for (i = 0; i < n; ++i) {
+			keys[0] = (i & 1) ? entries[i]->shash : ~entries[i]->shash;
+			found += scalable_query(&scalable, (unsigned char *)(keys));
+		}
+		seconds = micro_elapsed();
+		micro_report("scalable_query", n, seconds, (double)(n * sizeof(uint64_t)));
+		scalable_destroy(&scalable);
+	}
+	/* Keep the queries from being optimized away */
+	if (found > 2 * n) {
+		printf("%lu\n", (unsigned long)(found));
+	}
+}
+
+/* Grouping by digest: the table (one shard), the shards, then the index */
+void
+micro_table(struct file_info_t *file_info, struct file_entry_t **entries, size_t n,
+		const char *directory)
+{
+	size_t i, found = 0;
+	double seconds, bytes = (double)(n * digest_engine->length);
+	char path[PATH_MAX_LEN];
+	struct file_table_t *table;
+	struct file_index_t index;
+	if ((micro_selected("table_insert") || micro_selected("table_find"))
+			&& (table = table_new(offsetof(struct file_entry_t, hash),
+					digest_engine->length, n))) {
+		micro_start();
+		for (i = 0; i < n; ++i) {
+			table_insert(table, entries[i], i);
+		}
+		seconds = micro_elapsed();
+		micro_report("table_insert", n, seconds, bytes);
+		micro_start();
+		for (i = 0; i < n; ++i) {
+			found += table_find(table, entries[i]->hash) != NULL;
+		}
+		seconds = micro_elapsed();
+		micro_report("table_find", n, seconds, bytes);
+		table_free(table);
+	}
+	if ((micro_selected("shards_insert") || micro_selected("index_find"))
+			&& (file_info->hash_shards = shards_new(offsetof(struct file_entry_t, hash),
+					digest_engine->length, n))) {
+		micro_start();
+		for (i = 0; i < n; ++i) {
+			shards_insert(file_info->hash_shards, entries[i], i);
+		}
+		seconds = micro_elapsed();
+		micro_report("shards_insert", n, seconds, bytes);
+	}
+	/* Lookups in a mapped index, as bloom -q does them */
+	snprintf(path, PATH_MAX_LEN, "%s/%s", directory, INDEX_DEFAULT_FILE);
+	if (micro_selected("index_find")
+			&& !persist(path, file_info) && !recover(path, &index)) {
+		micro_start();
+		for (i = 0; i < n; ++i) {
+			found += index_find(&index, entries[i]->hash) != NULL;
+		}
+		seconds = micro_elapsed();
+		micro_report("index_find", n, seconds, bytes);
+		release_index(&index);
+	}
+	unlink(path);
+	if (found > 2 * n) {
+		printf("%lu\n", (unsigned long)(found));
+	}
+}
+
+void
+usage(const char *program)
+{
+	fprintf(stderr, "usage: %s [-n keys] [-t seconds] [-d digest] [-f name]\n", program);
+	fprintf(stderr, "\t-n keys\thow many keys the filter and tables hold (default: %lu)\n",
+			(unsigned long)(MICRO_DEFAULT_KEYS));
+	fprintf(stderr, "\t-t seconds\thow long to repeat each hash (default: %.1f)\n",
+			MICRO_DEFAULT_SECONDS);
+	fprintf(stderr, "\t-d digest\tas for bloom (default: %s)\n", digest_engine->name);
+	fprintf(stderr, "\t-f name\tonly run benchmarks whose name contains this\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int option;
+	size_t i, n = MICRO_DEFAULT_KEYS;
+	uint64_t key;
+	char name[32], directory[PATH_MAX_LEN];
+	struct file_entry_t **entries;
+	struct file_info_t file_info;
+	while ((option = getopt(argc, argv, "n:t:d:f:")) != -1) {
+		switch (option) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			micro_seconds = atof(optarg);
+			break;
+		case 'd':
+			if (!select_digest(optarg)) {
+				fprintf(stderr, "[FATAL] '%s' (unknown digest)\n", optarg);
+				return (EXIT_FAILURE);
+			}
+			break;
+		case 'f':
+			micro_only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+	if (n == 0 || micro_seconds <= 0.0) {
+		usage(argv[0]);
+		return (EXIT_FAILURE);
+	}
+	snprintf(directory, PATH_MAX_LEN, "%s/bloom_micro.XXXXXX",
+			getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(directory)) {
+		fprintf(stderr, "[FATAL] '%s' (%s)\n", directory, strerror(errno));
+		return (EXIT_FAILURE);
+	}
+	/* Keys stand in for candidates: counted shallow hashes and digests */
+	clear_info(&file_info);
+	entries = malloc(n * sizeof(struct file_entry_t *));
+	for (i = 0; entries && i < n; ++i) {
+		snprintf(name, sizeof(name), "key%lu", (unsigned long)(i));
+		if (!(entries[i] = new_entry(&file_info.arena, NULL, name, strlen(name)))
+				|| !slist_prepend(&file_info.good_files, entries[i])) {
+			break;
+		}
+		entries[i]->type = REGULAR;
+		entries[i]->size = (off_t)(i);
+		entries[i]->shash = entries[i]->sample = micro_mix(i);
+		entries[i]->hashed = SHALLOW | FULL;
+		for (option = 0; option < DIGEST_MAX_LENGTH; option += sizeof(uint64_t)) {
+			key = micro_mix(i ^ ((uint64_t)(option) << 56));
+			memcpy(entries[i]->hash + option, &key, sizeof(uint64_t));
+		}
+	}
+	if (!entries || i < n) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		free(entries);
+		destroy_info(&file_info);
+		rmdir(directory);
+		return (EXIT_FAILURE);
+	}
+	file_info.total_files = n;
+	printf("%-28s %10s %14s %16s\n", "# benchmark", "ops", "ns/op", "bytes/s");
+	option = micro_hash_entry(&file_info, directory);
+	if (option) {
+		micro_filter(&file_info, entries, n);
+		micro_table(&file_info, entries, n, directory);
+	}
+	free(entries);
+	destroy_info(&file_info);
+	rmdir(directory);
+	return option ? (EXIT_SUCCESS) : (EXIT_FAILURE);
+}
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "monitor.h"
 
@@ -12,8 +14,6 @@ static struct sigaction signal_action;
 void
 handle_signal(int signum)
 {
-	struct slist_t *current, *next;
-
 	/* Notify user */
 	#ifndef NDEBUG
 	if (signum) {
@@ -31,27 +31,17 @@ handle_signal(int signum)
 	}
 	notify_uninit();
 
-	/* Cleanup the list */
-	current = list.tail;
-	while (current) {
-		#ifndef NDEBUG
-		char *uri = g_file_get_uri(current->head->file), *state;
-		if (!current->head->file_monitor) {
-			state = "unknowned";
-		} else if (g_file_monitor_is_cancelled(current->head->file_monitor)) {
-			state = "cancelled";
-		} else {
-			state = "monitored";
-		}
-		fprintf(stderr, "[ENTRY %p] '%s' (%s)\n",
-				(void *)(current->head), uri, state);
-		g_free(uri);
-		#endif
-		destroy(current->head);
-		next = current->tail;
-		free(current);
-		current = next;
-	}
+	/* Cleanup the watches and the index */
+	#ifndef NDEBUG
+	fprintf(stderr, "[WATCH] '%lu / %lu' (directories watched, files indexed)\n",
+			(unsigned long)(watch.num_dirs), (unsigned long)(live.num_files));
+	fprintf(stderr, "[QUEUE] '%llu / %llu' (events dispatched, events read)\n",
+			(unsigned long long)(queue.num_dispatched),
+			(unsigned long long)(queue.num_pushed));
+	#endif
+	watch_destroy(&watch);
+	queue_destroy(&queue);
+	live_destroy(&live);
 
 	/* Re-throw termination signals */
 	if (sigismember(&signal_action.sa_mask, signum)) {
@@ -65,7 +55,12 @@ handle_signal(int signum)
 int
 main(int argc, char *argv[])
 {
-	struct slist_t *current, *next;
+	int option;
+	char *index_file = INDEX_DEFAULT_FILE, *option_end;
+	char cwd[PATH_MAX_LEN], root[PATH_MAX_LEN];
+	uint64_t window = QUEUE_DEFAULT_WINDOW;
+	struct timespec started, finished;
+	GIOChannel *channel;
 
 	/* Signal handling */
 	struct sigaction old_signal_action;
@@ -93,27 +88,71 @@ main(int argc, char *argv[])
 		fprintf(stderr, "[FATAL] '%s' (notify_init)\n", NOTIFY_APP_NAME);
 		return (EXIT_FAILURE);
 	}
-	list.head = NULL;
-	list.tail = NULL;
-	current = &list;
-
 	/* Argument Parsing (TODO improve) */
-	while (--argc) {
-		next = malloc(sizeof(struct slist_t));
-		next->head = malloc(sizeof(struct slent_t));
-		next->tail = NULL;
-		if (create(argv[argc], next->head)) {
-			current->tail = next;
-			current = current->tail;
-		} else {
+	while ((option = getopt(argc, argv, "i:w:")) != -1) {
+		switch (option) {
+		case 'i':
+			index_file = optarg;
+			break;
+		case 'w':
+			window = (uint64_t)(strtoul(optarg, &option_end, 10));
+			if (*optarg == '\0' || *option_end != '\0' || window > QUEUE_MAX_WINDOW) {
+				fprintf(stderr, "[FATAL] '%s' (invalid window, at most %lu)\n",
+						optarg, (unsigned long)(QUEUE_MAX_WINDOW));
+				return (EXIT_FAILURE);
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i index] [-w milliseconds] [directory ...]\n",
+					argv[0]);
+			fprintf(stderr, "\t-i index\treport copies of files in this index"
+					" (default: %s)\n", INDEX_DEFAULT_FILE);
+			fprintf(stderr, "\t-w milliseconds\twait for files to settle this long"
+					" (default: %lu)\n", (unsigned long)(QUEUE_DEFAULT_WINDOW));
+			return (EXIT_FAILURE);
+		}
+	}
+	/* The index stays mapped, and new files are kept beside it */
+	if (!live_init(&live, index_file)) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		return (EXIT_FAILURE);
+	}
+	if (!queue_init(&queue, window)) {
+		fprintf(stderr, "[FATAL] out of memory\n");
+		live_destroy(&live);
+		return (EXIT_FAILURE);
+	}
+	if (!watch_init(&watch)) {
+		fprintf(stderr, "[FATAL] cannot watch (inotify_init)\n");
+		queue_destroy(&queue);
+		live_destroy(&live);
+		return (EXIT_FAILURE);
+	}
+	/* Every directory below each argument is watched up front, by its
+	 * absolute path (as in the index, which is then found from anywhere) */
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	if (!getcwd(cwd, PATH_MAX_LEN)) {
+		cwd[0] = '\0';
+	}
+	while (--argc >= optind) {
+		if (!watch_add(&watch, (cwd[0] && absolute_path(cwd, argv[argc], root) > 0)
+					? root : argv[argc], WATCH_ROOT, NULL, NULL)) {
 			fprintf(stderr, "[WARNING] '%s' (non-directory)\n", argv[argc]);
-			free(next->head);
-			free(next);
 		}
 	}
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	printf("[WATCH] %lu directories in %.3f seconds (%lu KiB of tables, %ld KiB peak)\n",
+			(unsigned long)(watch.num_dirs),
+			(double)(finished.tv_sec - started.tv_sec)
+				+ (double)(finished.tv_nsec - started.tv_nsec) / 1e9,
+			(unsigned long)(watch_memory(&watch) / 1024), peak_memory());
+	fflush(stdout);
 
 	/* Main Loop */
 	main_loop = g_main_loop_new(NULL, FALSE);
+	channel = g_io_channel_unix_new(watch.fd);
+	g_io_add_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP, &readable, NULL);
+	g_io_channel_unref(channel);
 	g_main_loop_run(main_loop);
 	handle_signal(0);
 	return (EXIT_SUCCESS);
@@ -1,15 +1,19 @@
 #ifndef MONITOR_H
 #define MONITOR_H
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
-#ifndef NDEBUG
 #include <stdio.h>
-#endif
+#include <string.h>
 
 #include <gio/gio.h>
 
 #include <libnotify/notify.h>
 
+#include "file_live.h"
+#include "file_queue.h"
+#include "file_watch.h"
+
 #define NOTIFY_APP_NAME "bloomd"
 #define NOTIFY_TIMEOUT 1000
 #define NOTIFY_TYPE "dialog-information"
@@ -28,227 +32,143 @@ display(char *title, char *message)
 	g_object_unref(n);
 }
 
-inline gboolean
-is_directory(GFile *file)
-{
-	return g_file_query_exists(file, NULL) &&
-		g_file_query_file_type(file,
-				G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-				NULL) == G_FILE_TYPE_DIRECTORY;
-}
+/* Every directory under the arguments is watched with one inotify
+ * instance (see file_watch.h), events are held until files settle (see
+ * file_queue.h), and every file written under them is indexed beside the
+ * index of the last scan (see file_live.h) */
+struct file_watch_t watch;
+struct file_queue_t queue;
+struct file_live_t live;
 
-/* A simple list entry */
-struct slent_t
+/* The duplicates found in a batch, shown in one notification */
+struct notice_t
 {
-	GFile *file;
-	GFileMonitor *file_monitor;
-	gulong connection_id;
-	/* TODO needs mutex? */
+	long num_files, num_copies;
+	char name[NAME_MAX + 1];
 };
 
-/* Simple list entry manipulations */
-inline void monitor(struct slent_t *);
-inline void unmonitor(struct slent_t *);
-
-/* Construct entries */
-gboolean
-create(char *arg, struct slent_t *entry)
-{
-	if (entry) {
-		entry->file = g_file_new_for_commandline_arg(arg);
-		entry->file_monitor = NULL;
-		entry->connection_id = 0;
-		/* Try to monitor the file */
-		if (is_directory(entry->file)) {
-			monitor(entry);
-			return TRUE;
-		}
-		g_object_unref(entry->file);
-		entry->file = NULL;
-	}
-	return FALSE;
-}
-
-/* Cleanup entries */
-void
-destroy(struct slent_t *entry)
-{
-	if (entry) {
-		if (entry->file_monitor) {
-			unmonitor(entry);
-		}
-		if (entry->file) {
-			g_object_unref(entry->file);
-		}
-		free(entry);
-	}
-}
-
-/* A simple entry list */
-struct slist_t
-{
-	struct slent_t *head;
-	struct slist_t *tail;
-	/* TODO needs mutex? */
-} list;
-
 /* Callback and helper functions */
 
-char letter(GFileMonitorEvent type) {
+char letter(enum watch_event_t type) {
 	switch (type) {
-	case G_FILE_MONITOR_EVENT_MOVED: return '>';
-	case G_FILE_MONITOR_EVENT_CREATED: return ':';
-	case G_FILE_MONITOR_EVENT_DELETED: return '!';
-	default: return '?';	
+	case WATCH_WRITTEN: return '=';
+	case WATCH_REMOVED: return '!';
+	default: return '?';
 	}
 }
 
-const char *word(GFileMonitorEvent type) {
+const char *word(enum watch_event_t type) {
 	switch (type) {
-	case G_FILE_MONITOR_EVENT_MOVED: return "moved";
-	case G_FILE_MONITOR_EVENT_CREATED: return "created";
-	case G_FILE_MONITOR_EVENT_DELETED: return "deleted";
-	default: return "unknown";	
+	case WATCH_WRITTEN: return "written";
+	case WATCH_REMOVED: return "removed";
+	default: return "unknown";
 	}
 }
 
-#define EVENT_FORMAT "[EVENT %p] %s %c %s\n"
+#define EVENT_FORMAT "[EVENT] %s %c %s\n"
 
+/* Events are queued as they are read (see readable) */
 void
-changed(GFileMonitor *file_monitor,
-		GFile *file1, GFile *file2,
-		GFileMonitorEvent type,
-		gpointer data)
+queued(const char *path, enum watch_event_t type, void *data)
 {
-	char *filepath1, *filepath2;
-	struct slist_t *node;
-	struct slent_t *entry;
-	/* Some state to get us through */
-	gboolean show = TRUE;
-	entry = (struct slent_t *)(data);
-	filepath1 = g_file_get_uri(file1);
+	(void)(data);
+	if (!queue_push(&queue, path, type, queue_clock())) {
+		fprintf(stderr, "[ERROR] '%s' (out of memory)\n", path);
+	}
+}
+
+/* Files are hashed once settled (after being written, or moved here),
+ * and forgotten once they are gone; only those that turn out to be
+ * duplicates are counted in the notice */
+void
+changed(const char *path, enum watch_event_t type, void *data)
+{
+	long num_matches;
+	const char *name;
+	struct notice_t *notice = data;
 	#ifndef NDEBUG
-	fprintf(stderr, EVENT_FORMAT,
-			(void *)(file_monitor),
-			filepath1, letter(type), word(type));
+	fprintf(stderr, EVENT_FORMAT, path, letter(type), word(type));
 	#endif
-	/* Behavior is dependent on event type */
-	switch (type) {
-		case G_FILE_MONITOR_EVENT_MOVED:
-			#ifndef NDEBUG
-			filepath2 = g_file_get_uri(file2);
-			fprintf(stderr, EVENT_FORMAT,
-					(void *)(file_monitor),
-					filepath1, letter(type), filepath2);
-			g_free(filepath2);
-			#endif
-			/* Replace the entry if necessary */
-			if (entry->file == file1 && is_directory(file1)) {
-				unmonitor(entry);
-				g_object_unref(entry->file);
-				entry->file = g_file_dup(file2);
-				monitor(entry);
-			}
-			break;
-		case G_FILE_MONITOR_EVENT_CREATED:
-			/* Create new entry if necessary */
-			entry = malloc(sizeof(struct slent_t));
-			if (create(filepath1, entry)) {
-				node = malloc(sizeof(struct slist_t));
-				node->head = entry;
-				node->tail = list.tail;
-				list.tail = node;
-			} else {
-				free(entry);
-			}
-			break;
-		case G_FILE_MONITOR_EVENT_DELETED:
-			if (entry->file == file1) {
-				unmonitor(entry);
-			}
-			break;
-		default:
-			show = FALSE;
+	if (type == WATCH_REMOVED) {
+		live_forget(&live, path);
+		return;
 	}
-	/* Display a notification if necessary */
-	if (show) {
-		g_free(filepath1);
-		filepath1 = g_file_get_basename(file1);
-		#define BUFFER_SIZE 1024
-		filepath2 = calloc(BUFFER_SIZE, sizeof(char));
-		snprintf(filepath2, BUFFER_SIZE, "%c%s %s",
-				letter(type), filepath1, word(type));
-		#undef BUFFER_SIZE
-		#ifndef NDEBUG
-		fprintf(stderr, "[NOTIFY] %s: %s\n", NOTIFY_APP_NAME, filepath2);
-		#else
-		display(NOTIFY_APP_NAME, filepath2);
-		#endif
-		free(filepath2);
+	num_matches = live_add(&live, path, stdout);
+	if (num_matches < 0) {
+		fprintf(stderr, "[ERROR] '%s' (out of memory)\n", path);
+	}
+	if (num_matches > 0) {
+		if (notice->num_files++ == 0) {
+			name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+			snprintf(notice->name, sizeof(notice->name), "%s", name);
+		}
+		notice->num_copies += num_matches;
 	}
-	g_free(filepath1);
 }
 
-inline void
-monitor(struct slent_t *entry)
+/* Display a notification for a batch, if necessary */
+void
+announce(const struct notice_t *notice)
 {
-	/* FIXME using (G_FILE_MONITOR_WATCH_MOUNTS | G_FILE_MONITOR_SEND_MOVED) */
-	assert(entry && entry->file);
-	if (entry->file_monitor) {
-		unmonitor(entry);
-	}
-	/* Last two nulls disregard cancel and error */
-	entry->file_monitor = g_file_monitor(
-			entry->file, G_FILE_MONITOR_SEND_MOVED, NULL, NULL);
-	entry->connection_id = g_signal_connect_after(
-			entry->file_monitor, "changed", G_CALLBACK(changed), entry);
-	#ifndef NDEBUG
-	char *uri = g_file_get_uri(entry->file);
-	if (g_signal_handler_is_connected(entry->file_monitor, entry->connection_id)) {
-		fprintf(stderr, "[CONNECTED %p] %s\n", (void *)(entry), uri);
+	char message[NAME_MAX + 64];
+	if (notice->num_files == 0) {
+		return;
+	} else if (notice->num_files == 1) {
+		snprintf(message, sizeof(message), "=%s duplicated (%ld copies)",
+				notice->name, notice->num_copies);
 	} else {
-		fprintf(stderr, "[ERROR %p] %s (failure to connect)\n", (void *)(entry), uri);
+		snprintf(message, sizeof(message), "=%s and %ld other files duplicated"
+				" (%ld copies)", notice->name, notice->num_files - 1, notice->num_copies);
 	}
-	g_free(uri);
+	#ifndef NDEBUG
+	fprintf(stderr, "[NOTIFY] %s: %s\n", NOTIFY_APP_NAME, message);
+	#else
+	display(NOTIFY_APP_NAME, message);
 	#endif
 }
 
-inline void
-unmonitor(struct slent_t *entry)
+/* The source that flushes the queue, if one is pending */
+guint flushing = 0;
+
+gboolean settled(gpointer data);
+
+/* Flush the queue once its next event is due */
+void
+schedule(void)
 {
-	assert(entry && entry->file);
-	#ifndef NDEBUG
-	char *uri = g_file_get_uri(entry->file);
-	#endif
-	if (entry->file_monitor) {
-		if (g_signal_handler_is_connected(
-					entry->file_monitor, entry->connection_id)) {
-			g_signal_handler_disconnect(
-					entry->file_monitor, entry->connection_id);
-			#ifndef NDEBUG
-			fprintf(stderr, "[DISCONNECTED %p] %s\n", (void *)(entry), uri);
-			#endif
-		}
-		if (!g_file_monitor_is_cancelled(entry->file_monitor)) {
-			if (g_file_monitor_cancel(entry->file_monitor)) {
-				#ifndef NDEBUG
-				fprintf(stderr, "[CANCELLED %p] %s\n",
-						(void *)(entry), uri);
-				#endif
-			} else {
-				#ifndef NDEBUG
-				fprintf(stderr, "[WARNING %p] %s (failure to cancel)\n",
-						(void *)(entry), uri);
-				#endif
-			}
-		}
-		g_object_unref(entry->file_monitor);
-		entry->file_monitor = NULL;
-		entry->connection_id = 0;
+	if (!flushing && queue.num_pending > 0) {
+		flushing = g_timeout_add((guint)(queue_wait(&queue, queue_clock())),
+				&settled, NULL);
 	}
-	#ifndef NDEBUG
-	g_free(uri);
-	#endif
+}
+
+/* Work through (a batch of) the files that have settled */
+gboolean
+settled(gpointer data)
+{
+	struct notice_t notice;
+	(void)(data);
+	memset(&notice, 0, sizeof(struct notice_t));
+	queue_flush(&queue, queue_clock(), QUEUE_BATCH_SIZE, &changed, &notice);
+	announce(&notice);
+	flushing = 0;
+	schedule();
+	return FALSE;
+}
+
+/* The main loop calls this whenever events are waiting */
+gboolean
+readable(GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+	(void)(channel);
+	(void)(data);
+	if ((condition & (G_IO_ERR | G_IO_HUP))
+			|| watch_read(&watch, &queued, NULL) < 0) {
+		fprintf(stderr, "[ERROR] cannot read events\n");
+		return FALSE;
+	}
+	schedule();
+	return TRUE;
 }
 
 #endif /* MONITOR_H */
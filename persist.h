@@ -1,138 +1,339 @@
 #ifndef PERSIST_H
 #define PERSIST_H
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <time.h>
 #include <unistd.h>
 
-#include <libcalg-1.0/libcalg/bloom-filter.h>
-#include <libcalg-1.0/libcalg/hash-string.h>
 #include <libcalg-1.0/libcalg/slist.h>
 
-#include <gdbm.h>
-
-#include <zlib.h>
-
+#include "file_digest.h"
+#include "file_filter.h"
+#include "file_hash.h"
 #include "file_info.h"
-#include "file_log.h"
 
 #define BLOOM_PERSISTENCE_ERROR (-1)
 #define BUFFER_SIZE 4096
 
+#define INDEX_DEFAULT_FILE "bloom_store"
 #define BLOOM_EXT_BACKUP   "bak"
-#define BLOOM_EXT_FILTER   "bbf"
-#define BLOOM_EXT_CONFIG   "bcf"
-#define BLOOM_EXT_DATABASE "bdb"
+#define BLOOM_EXT_TEMP     "tmp"
+
+/* An index is one file, laid out so that it can be mapped and used in
+ * place: a header, then the filter blocks, the digests (sorted), the
+ * entries (sorted by digest, then path) and their paths; each section
+ * starts on a filter block boundary, so the filter can be used as is */
+#define INDEX_MAGIC      "BLOOMIDX"
+#define INDEX_VERSION    2
+#define INDEX_BYTE_ORDER 0x01020304
+#define INDEX_ALIGNMENT  FILTER_BLOCK_SIZE
+/* How filter keys were made (XXH64 of the first SHALLOW_SIZE bytes) */
+#define INDEX_FILTER_XXH64 1
+
+struct index_header_t
+{
+	char magic[8];
+	uint32_t version, byte_order;
+	/* The engine of every digest in the index, and its length */
+	uint32_t engine, digest_length;
+	/* Filter parameters: blocks (m = 512 bits each), k and key hash */
+	uint64_t filter_blocks;
+	uint32_t filter_lanes, filter_hash;
+	uint64_t filter_offset;
+	uint64_t num_digests, digests_offset;
+	uint64_t num_entries, entries_offset;
+	uint64_t names_size, names_offset;
+	uint64_t file_size;
+	/* XXH64 of every section, chained in file order (see index_verify) */
+	uint64_t checksum;
+};
+
+/* Each distinct digest owns a run of entries */
+struct index_digest_t
+{
+	unsigned char digest[DIGEST_MAX_LENGTH];
+	uint64_t first_entry, num_entries;
+};
+
+struct index_entry_t
+{
+	uint64_t dev, ino, size;
+	int64_t mtime, ctime;
+	uint64_t shash;
+	/* The path is NUL-terminated, at this offset into the names */
+	uint64_t name_offset;
+	uint64_t reserved;
+};
+
+/* A mapped index (nothing is copied out of the map) */
+struct file_index_t
+{
+	void *map;
+	size_t map_size;
+	const struct index_header_t *header;
+	/* This filter is a view of the mapped blocks (never filter_free it) */
+	struct file_filter_t filter;
+	const struct index_digest_t *digests;
+	const struct index_entry_t *entries;
+	const char *names;
+};
+
+inline uint64_t
+index_align(uint64_t offset)
+{
+	return (offset + INDEX_ALIGNMENT - 1) & ~(uint64_t)(INDEX_ALIGNMENT - 1);
+}
+
+/* Sort entries by digest, then by path (so the index is reproducible) */
+int
+compare_digests(const void *lhs, const void *rhs)
+{
+	int order = memcmp((*(struct file_entry_t * const *)(lhs))->hash,
+			(*(struct file_entry_t * const *)(rhs))->hash, digest_engine->length);
+	return order ? order : compare_paths(lhs, rhs);
+}
+
+/* Write one section (and its padding), chaining it into the checksum */
+int
+index_write(FILE *stream, const void *data, size_t size, uint64_t *checksum)
+{
+	static const unsigned char padding[INDEX_ALIGNMENT];
+	size_t pad = index_align(size) - size;
+	*checksum = xxh64(data, size, *checksum);
+	return fwrite(data, 1, size, stream) == size
+		&& fwrite(padding, 1, pad, stream) == pad;
+}
+
+/* Whether an entry belongs in the index (it needs both of its hashes) */
+inline int
+index_member(const struct file_entry_t *file_entry)
+{
+	return file_entry->type == REGULAR
+		&& (file_entry->hashed & (SHALLOW | FULL)) == (SHALLOW | FULL);
+}
 
-#define BLOOM_CHAR_HASH_INDICATOR  '+'
-#define BLOOM_CHAR_SHASH_INDICATOR '-'
+/* The path an index keeps for an entry: absolute, so that it can be found
+ * from any directory (or as it was scanned, if that would not fit) */
+static inline const char *
+index_path(const char *cwd, const struct file_entry_t *file_entry, char *buffer)
+{
+	const char *path = entry_path(file_entry);
+	return (absolute_path(cwd, path, buffer) < 0) ? path : buffer;
+}
 
+/* Write an index of every fully hashed file, duplicate or not (and a
+ * filter of their shallow hashes) to backup_file, keeping the last one
+ * as a backup; files without a full hash are left out (see -n) */
 int
 persist(char *backup_file, struct file_info_t *file_info)
 {
-	/* For file manipulation */
-	time_t time_stamp;
-	char buffer[BUFFER_SIZE];
-	/* For table */
-	int fd, status;
-	bloom_size_t data_size;
-	unsigned char *data_buffer;
-	/* For entries */
-	GDBM_FILE gdbmf;
-	datum key, value;
+	int status = 1;
+	char buffer[BUFFER_SIZE], cwd[PATH_MAX_LEN], path[PATH_MAX_LEN];
+	FILE *stream;
+	size_t i, j, m, n, names_size;
+	SListEntry **lists[2];
 	SListIterator slist_iterator;
+	struct file_entry_t *file_entry, *link, **sorted;
+	struct file_filter_t *filter;
+	struct index_header_t header;
+	struct index_digest_t *digests;
+	struct index_entry_t *entries;
+	char *names;
+	uint64_t placeholder = 0;
 	/* Check for valid arguments */
-	if (!backup_file || !file_info
-			|| *backup_file == '\0'
-			|| !file_info->shash_filter) {
+	if (!backup_file || !file_info || *backup_file == '\0' || !getcwd(cwd, PATH_MAX_LEN)) {
 		return BLOOM_PERSISTENCE_ERROR;
 	}
-	time(&time_stamp);
-	status = (int)(sizeof(bloom_size_t));
-	/* If the file exists, move it to backup */
-	if (!access(backup_file, F_OK)) {
-		snprintf(buffer, BUFFER_SIZE, "%s.%lu.%s",
-				backup_file, (long unsigned)(time_stamp), BLOOM_EXT_BACKUP);
-		/* Inability to do this triggers a failure */
-		if (rename(backup_file, buffer)) {
-			#ifndef NDEBUG
-			fprintf(stderr, "[ERROR] %s > %s (rename failed)\n",
-					backup_file, buffer);
-			#endif
-			return BLOOM_PERSISTENCE_ERROR;
+	/* Gather (and sort) the entries that have a digest */
+	lists[0] = &file_info->good_files;
+	lists[1] = &file_info->unique_files;
+	for (i = m = n = 0; i < 2; ++i) {
+		slist_iterate(lists[i], &slist_iterator);
+		while (slist_iter_has_more(&slist_iterator)) {
+			file_entry = slist_iter_next(&slist_iterator);
+			if (index_member(file_entry)) {
+				/* Hard links each get an entry (with the same digest) */
+				for (link = file_entry; link; link = link->link, ++n);
+				++m;
+			}
 		}
 	}
-	/* Try to open the file */
-	snprintf(buffer, BUFFER_SIZE, "%s.%lu.%s",
-			backup_file, (long unsigned)(time_stamp), BLOOM_EXT_FILTER);
-	if ((fd = creat(buffer, S_IRUSR | S_IWUSR)) < 0) {
-		#ifndef NDEBUG
-		fprintf(stderr, "[ERROR] %s (unable to persist)\n", backup_file);
-		#endif
+	/* The filter is sized for this index (the scan's only held candidates) */
+	filter = filter_new(optimal_bits(m));
+	sorted = malloc((m + 1) * sizeof(struct file_entry_t *));
+	digests = malloc((n + 1) * sizeof(struct index_digest_t));
+	entries = malloc((n + 1) * sizeof(struct index_entry_t));
+	if (!filter || !sorted || !digests || !entries) {
+		if (filter) {
+			filter_free(filter);
+		}
+		free(sorted);
+		free(digests);
+		free(entries);
 		return BLOOM_PERSISTENCE_ERROR;
 	}
-	/* Persist the filter data */
-	data_size = (file_info->table_size + 7) / 8;
-	if (write(fd, &data_size, status) < status) {
-		#ifndef NDEBUG
-		fprintf(stderr, "[WARNING] bytes lost (%s)\n", "bloom header persist");
-		#endif
+	for (i = j = 0; i < 2; ++i) {
+		slist_iterate(lists[i], &slist_iterator);
+		while (slist_iter_has_more(&slist_iterator)) {
+			file_entry = slist_iter_next(&slist_iterator);
+			if (index_member(file_entry)) {
+				filter_insert(filter, (unsigned char *)(&file_entry->shash));
+				sorted[j++] = file_entry;
+			}
+		}
+	}
+	qsort(sorted, m, sizeof(struct file_entry_t *), &compare_digests);
+	/* Fill in the entries and the digests that own them */
+	memset(&header, 0, sizeof(struct index_header_t));
+	memset(digests, 0, (n + 1) * sizeof(struct index_digest_t));
+	memset(entries, 0, (n + 1) * sizeof(struct index_entry_t));
+	for (i = j = names_size = 0; j < m; ++j) {
+		file_entry = sorted[j];
+		if (j == 0 || memcmp(sorted[j - 1]->hash, file_entry->hash, digest_engine->length)) {
+			memcpy(digests[header.num_digests].digest, file_entry->hash,
+					digest_engine->length);
+			digests[header.num_digests++].first_entry = i;
+		}
+		for (link = file_entry; link; link = link->link, ++i) {
+			++digests[header.num_digests - 1].num_entries;
+			entries[i].dev = (uint64_t)(file_entry->dev);
+			entries[i].ino = (uint64_t)(file_entry->ino);
+			entries[i].size = (uint64_t)(file_entry->size);
+			entries[i].mtime = file_entry->mtime;
+			entries[i].ctime = file_entry->ctime;
+			entries[i].shash = file_entry->shash;
+			entries[i].name_offset = names_size;
+			names_size += strlen(index_path(cwd, link, path)) + 1;
+		}
+	}
+	names = malloc(names_size + 1);
+	for (i = j = 0; names && j < m; ++j) {
+		for (link = sorted[j]; link; link = link->link) {
+			strcpy(names + entries[i++].name_offset, index_path(cwd, link, path));
+		}
+	}
+	free(sorted);
+	if (!names) {
+		filter_free(filter);
+		free(digests);
+		free(entries);
+		return BLOOM_PERSISTENCE_ERROR;
 	}
-	data_buffer = malloc(data_size * sizeof(unsigned char));
-	bloom_filter_read(file_info->shash_filter, data_buffer);
-	if (write(fd, data_buffer, data_size) < data_size) {
+	/* Describe the layout */
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.version = INDEX_VERSION;
+	header.byte_order = INDEX_BYTE_ORDER;
+	header.engine = (uint32_t)(digest_engine - digest_engines);
+	header.digest_length = (uint32_t)(digest_engine->length);
+	header.filter_blocks = filter->num_blocks;
+	header.filter_lanes = FILTER_LANES;
+	header.filter_hash = INDEX_FILTER_XXH64;
+	header.filter_offset = index_align(sizeof(struct index_header_t));
+	header.digests_offset = header.filter_offset
+		+ index_align(filter_size(filter));
+	header.num_entries = n;
+	header.entries_offset = header.digests_offset
+		+ index_align(header.num_digests * sizeof(struct index_digest_t));
+	header.names_offset = header.entries_offset
+		+ index_align(n * sizeof(struct index_entry_t));
+	header.names_size = names_size;
+	header.file_size = header.names_offset + index_align(names_size);
+	/* Write to a new file, then move it into place */
+	snprintf(buffer, BUFFER_SIZE, "%s.%s", backup_file, BLOOM_EXT_TEMP);
+	stream = fopen(buffer, "wb");
+	if (!stream) {
 		#ifndef NDEBUG
-		fprintf(stderr, "[WARNING] bytes lost (%s)\n", "bloom table persist");
+		fprintf(stderr, "[ERROR] %s (unable to persist)\n", backup_file);
 		#endif
+		filter_free(filter);
+		free(digests);
+		free(entries);
+		free(names);
+		return BLOOM_PERSISTENCE_ERROR;
 	}
-	/* Cleanup */
-	free(data_buffer);
-	if (close(fd)) {
+	/* The header is written twice: first as a placeholder, then with
+	 * the checksum (which does not cover the header itself) */
+	status = index_write(stream, &header, sizeof(struct index_header_t), &placeholder);
+	status = status
+		&& index_write(stream, filter->blocks, filter_size(filter), &header.checksum)
+		&& index_write(stream, digests,
+				header.num_digests * sizeof(struct index_digest_t), &header.checksum)
+		&& index_write(stream, entries,
+				n * sizeof(struct index_entry_t), &header.checksum)
+		&& index_write(stream, names, names_size, &header.checksum)
+		&& !fseek(stream, 0, SEEK_SET)
+		&& fwrite(&header, sizeof(struct index_header_t), 1, stream) == 1;
+	filter_free(filter);
+	free(digests);
+	free(entries);
+	free(names);
+	if (fclose(stream) || !status) {
 		#ifndef NDEBUG
-		fprintf(stderr, "[WARNING] %s (close failed)\n", backup_file);
+		fprintf(stderr, "[WARNING] bytes lost (%s)\n", "index persist");
 		#endif
+		unlink(buffer);
+		return BLOOM_PERSISTENCE_ERROR;
+	}
+	/* If the file exists, move it to backup */
+	if (!access(backup_file, F_OK)) {
+		char backup[BUFFER_SIZE];
+		snprintf(backup, BUFFER_SIZE, "%s.%s", backup_file, BLOOM_EXT_BACKUP);
+		/* Inability to do this triggers a failure */
+		if (rename(backup_file, backup)) {
+			#ifndef NDEBUG
+			fprintf(stderr, "[ERROR] %s > %s (rename failed)\n",
+					backup_file, backup);
+			#endif
+			unlink(buffer);
+			return BLOOM_PERSISTENCE_ERROR;
+		}
 	}
-	/* Persist the data entries */
-	snprintf(buffer, BUFFER_SIZE, "%s%c%lu.%s",
-			backup_file, BLOOM_CHAR_HASH_INDICATOR,
-			(long unsigned)(time_stamp), BLOOM_EXT_DATABASE);
-	gdbmf = gdbm_open(buffer, BUFFER_SIZE,
-			GDBM_NEWDB, S_IRUSR | S_IWUSR, log_message);
-	if (!gdbmf) {
+	if (rename(buffer, backup_file)) {
 		#ifndef NDEBUG
-		fprintf(stderr, "[ERROR] %s (open database failed)\n", buffer);
+		fprintf(stderr, "[ERROR] %s > %s (rename failed)\n", buffer, backup_file);
 		#endif
 		return BLOOM_PERSISTENCE_ERROR;
 	}
-	slist_iterate(&file_info->good_files, &slist_iterator);
-	while (slist_iter_has_more(&slist_iterator)) {
-		struct file_entry_t *file_entry = slist_iter_next(&slist_iterator);
-		key.dptr = hash_entry(file_entry, FULL);
-		key.dsize = sizeof(file_entry->hash);
-		value.dptr = (char *)(file_entry);
-		value.dsize = sizeof(struct file_entry_t);
-		status = gdbm_store(gdbmf, key, value, GDBM_INSERT);
-		assert(status == 0);
-	}
-	gdbm_close(gdbmf);
-	/* TODO gzip everything into backup_file.BLOOM_EXT_CONFIG */
 	return 0;
 }
 
+inline void
+release_index(struct file_index_t *index)
+{
+	if (index->map) {
+		munmap(index->map, index->map_size);
+	}
+	memset(index, 0, sizeof(struct file_index_t));
+}
+
+/* Whether a section of count records of size bytes starts on a block
+ * boundary at offset, and ends by end (without overflowing) */
+inline int
+index_section(uint64_t offset, uint64_t count, uint64_t size, uint64_t end)
+{
+	return offset % INDEX_ALIGNMENT == 0 && offset <= end
+		&& count <= (end - offset) / size;
+}
+
+/* Map an index written by persist; only the header (and the last byte of
+ * the names) is checked, so this takes the same (short) time for any size
+ * of index, and the runs and paths it points to are checked as they are
+ * used (see index_entries and index_name) */
 int
-recover(char *backup_file, struct file_info_t *file_info)
+recover(char *backup_file, struct file_index_t *index)
 {
-	int fd, status;
-	bloom_size_t data_size;
-	unsigned char *data_buffer;
-	if (!backup_file || !file_info) {
+	int fd;
+	struct stat status;
+	const struct index_header_t *header;
+	if (!backup_file || !index) {
 		return BLOOM_PERSISTENCE_ERROR;
 	}
-	status = (int)(sizeof(bloom_size_t));
+	memset(index, 0, sizeof(struct file_index_t));
 	/* Make sure we can read from the file */
 	if ((fd = open(backup_file, O_RDONLY)) < 0) {
 		#ifndef NDEBUG
@@ -140,29 +341,119 @@ recover(char *backup_file, struct file_info_t *file_info)
 		#endif
 		return BLOOM_PERSISTENCE_ERROR;
 	}
-	/* Recover the filter data */
-	if (read(fd, &data_size, status) < status) {
-		#ifndef NDEBUG
-		fprintf(stderr, "[WARNING] bytes lost (%s)\n", "bloom header recover");
-		#endif
+	if (fstat(fd, &status) || status.st_size < (off_t)(sizeof(struct index_header_t))) {
+		close(fd);
+		return BLOOM_PERSISTENCE_ERROR;
 	}
-	data_buffer = malloc(data_size * sizeof(unsigned char));
-	if (read(fd, data_buffer, data_size) < data_size) {
+	index->map_size = (size_t)(status.st_size);
+	index->map = mmap(NULL, index->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (close(fd)) {
 		#ifndef NDEBUG
-		fprintf(stderr, "[WARNING] bytes lost (%s)\n", "bloom table recover");
+		fprintf(stderr, "[WARNING] %s (close failed)\n", backup_file);
 		#endif
 	}
-	/* Load it into the file information */
-	optimize_filter(file_info);
-	bloom_filter_load(file_info->shash_filter, data_buffer);
-	/* Cleanup */
-	free(data_buffer);
-	if (close(fd)) {
+	if (index->map == MAP_FAILED) {
+		index->map = NULL;
+		return BLOOM_PERSISTENCE_ERROR;
+	}
+	header = index->header = index->map;
+	/* Refuse anything this build would read differently */
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic))
+			|| header->version != INDEX_VERSION
+			|| header->byte_order != INDEX_BYTE_ORDER
+			|| header->file_size != index->map_size
+			|| header->filter_lanes != FILTER_LANES
+			|| header->filter_hash != INDEX_FILTER_XXH64
+			|| header->digest_length > DIGEST_MAX_LENGTH
+			|| header->filter_blocks == 0
+			|| header->filter_offset < sizeof(struct index_header_t)
+			|| !index_section(header->filter_offset, header->filter_blocks,
+				FILTER_BLOCK_SIZE, header->digests_offset)
+			|| !index_section(header->digests_offset, header->num_digests,
+				sizeof(struct index_digest_t), header->entries_offset)
+			|| !index_section(header->entries_offset, header->num_entries,
+				sizeof(struct index_entry_t), header->names_offset)
+			|| !index_section(header->names_offset, header->names_size, 1, index->map_size)
+			/* Every path ends in a NUL, so the last byte of the names does */
+			|| (header->names_size > 0 && ((const char *)(index->map))
+				[header->names_offset + header->names_size - 1] != '\0')) {
 		#ifndef NDEBUG
-		fprintf(stderr, "[WARNING] %s (close failed)\n", backup_file);
+		fprintf(stderr, "[ERROR] %s (not a usable index)\n", backup_file);
 		#endif
+		release_index(index);
+		return BLOOM_PERSISTENCE_ERROR;
 	}
+	index->filter.blocks = (uint32_t *)((char *)(index->map) + header->filter_offset);
+	index->filter.num_blocks = header->filter_blocks;
+	index->digests = (const struct index_digest_t *)
+		((const char *)(index->map) + header->digests_offset);
+	index->entries = (const struct index_entry_t *)
+		((const char *)(index->map) + header->entries_offset);
+	index->names = (const char *)(index->map) + header->names_offset;
+	filter_select();
 	return 0;
 }
 
+/* Check every section against the checksum (this reads the whole index) */
+int
+index_verify(const struct file_index_t *index)
+{
+	uint64_t checksum = 0;
+	const struct index_header_t *header = index->header;
+	checksum = xxh64((const unsigned char *)(index->filter.blocks),
+			filter_size(&index->filter), checksum);
+	checksum = xxh64((const unsigned char *)(index->digests),
+			header->num_digests * sizeof(struct index_digest_t), checksum);
+	checksum = xxh64((const unsigned char *)(index->entries),
+			header->num_entries * sizeof(struct index_entry_t), checksum);
+	checksum = xxh64((const unsigned char *)(index->names), header->names_size, checksum);
+	return checksum == header->checksum;
+}
+
+/* The run of entries a digest owns (how many in num_entries), or NULL if
+ * there is no digest, or its run is not within the index */
+inline const struct index_entry_t *
+index_entries(const struct file_index_t *index, const struct index_digest_t *digest,
+		uint64_t *num_entries)
+{
+	uint64_t total = index->header->num_entries;
+	*num_entries = 0;
+	if (!digest || digest->first_entry > total
+			|| digest->num_entries > total - digest->first_entry) {
+		return NULL;
+	}
+	*num_entries = digest->num_entries;
+	return index->entries + digest->first_entry;
+}
+
+/* The path of an entry, or NULL if it is not within the names */
+inline const char *
+index_name(const struct file_index_t *index, const struct index_entry_t *entry)
+{
+	return (entry->name_offset < index->header->names_size)
+		? index->names + entry->name_offset : NULL;
+}
+
+/* Returns the digest's record (or NULL), by binary search */
+const struct index_digest_t *
+index_find(const struct file_index_t *index, const unsigned char *digest)
+{
+	int order;
+	size_t low = 0, high = index->header->num_digests, middle;
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		order = memcmp(index->digests[middle].digest, digest,
+				index->header->digest_length);
+		if (order == 0) {
+			return &index->digests[middle];
+		}
+		if (order < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return NULL;
+}
+
 #endif /* PERSIST_H */